@@ -0,0 +1,49 @@
+/*
+  Project:  NMEAtor - NMEA0183 library
+  Purpose:  Corpus of decoder input with the expected parser output
+            - Used by the self test of the TEST build, the native tests and as
+              the seeds of the fuzz target
+            - The converted sentences expect the default settings, talker ID AO
+              and a battery offset of 0.2 V
+*/
+#ifndef NMEA_CORPUS_H
+#define NMEA_CORPUS_H
+
+typedef struct
+{
+  const char *input;    // bytes fed to the decoder
+  const char *expected; // expected sentence without checksum and terminator,
+                        // NULL if it passes unchanged, "" if nothing should come out
+} ParserTestCase;
+
+static const ParserTestCase parserCorpus[] = {
+    {"$IIVWR,151,R,02.4,N,,,,\r\n", NULL},
+    {"$IIMTW,12.2,C\r\n", NULL},
+    {"!AIVDM,1,1,,A,13aL<mhP000J9:PN?<jf4?vLP88B,0*2B\r\n", NULL},
+    {"$IIVLW,1149.1,N,001.07,N\r\n", NULL},
+    {"$GPGLL,5251.3091,N,00541.8037,E,151314.000,A,D*5B\r\n", NULL},
+    {"$GPRMC,095218.000,A,5251.5621,N,00540.8482,E,4.25,201.77,120420,,,D*6D\r\n", NULL},
+    {"$IIVHW,,,000,M,01.57,N,,\r\n", NULL},
+    {"$IIDBK,A,0014.4,f,,,,\r\n", "$AODPT,4.4,0.0"},
+    {"$PSTOB,13.0,v\r\n", "$AOXDR,U,13.2,V,BATT"},
+    //*** a single terminator and a terminator pair give the same sentence
+    {"$IIMTW,12.2,C\r", "$IIMTW,12.2,C"},
+    {"$IIMTW,12.2,C\n\r\n\r", "$IIMTW,12.2,C"},
+    //*** a start delimiter mid-sentence starts a new sentence
+    {"$IIVHW,,,0$IIMTW,12.2,C\r\n", "$IIMTW,12.2,C"},
+    {"garbage$IIMTW,12.2,C\r\n", "$IIMTW,12.2,C"},
+    //*** a shorter sentence after a restart may not keep bytes of the longer one
+    {"$IIMTW,12.2,C$IIHDM,1,M\r\n", "$IIHDM,1,M"},
+    {"$IIXXX,0123456789012345678901234567890123456789012345678901234567890123456789012345678901234567890123456789$IIMTW,12.2,C\r\n", "$IIMTW,12.2,C"},
+    //*** more fields than MAX_NMEA_FIELDS
+    {"$IIXXX,1,2,3,4,5,6,7,8,9,10,11,12,13,14,15,16,17,18,19,20,21,22,23,24,25\r\n", NULL},
+    {"$IIXXX,,,,,,,,,,,,,,,,,,,,,,,,,,,,,,,,,,,,,,,,,,,,,\r\n", NULL},
+    //*** no fields at all and a lonely start delimiter
+    {"$IIXXX\r\n", NULL},
+    {"$\r\n", NULL},
+    //*** a line longer than NMEA_BUFFER_SIZE without a terminator is dropped
+    {"$IIXXX,0123456789012345678901234567890123456789012345678901234567890123456789012345678901234567890123456789\r\n", ""},
+    //*** a terminator without a sentence
+    {"\r\n\r\n", ""}};
+
+#endif
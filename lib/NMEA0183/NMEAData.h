@@ -0,0 +1,256 @@
+/*
+  Project:  NMEAtor - NMEA0183 library
+  Purpose:  The parsed form of an NMEA sentence and the schema of the fields
+            the application uses
+*/
+#ifndef NMEA_DATA_H
+#define NMEA_DATA_H
+
+#include "NMEAText.h"
+
+//*** The maximum number of fields in an NMEA string
+//*** The number is based on the largest sentence MDA,
+//***  the Meteorological Composite sentence
+#ifndef MAX_NMEA_FIELDS
+#define MAX_NMEA_FIELDS 21
+#endif
+
+//*** The sentence IDs described by the sentence schema, see nmeaSchema[]
+enum NMEASentenceType
+{
+  NMEA_UNKNOWN,
+  NMEA_RMC,
+  NMEA_GLL,
+  NMEA_VHW,
+  NMEA_VWR,
+  NMEA_HDM,
+  NMEA_HDG,
+  NMEA_DBK,
+  NMEA_DPT,
+  NMEA_XDR,
+  NMEA_MTW,
+  NMEA_VLW,
+  NMEA_TOB,
+  NMEA_TOE,
+  NR_OF_SENTENCE_TYPES
+};
+
+//*** A structure to hold the NMEA data
+typedef struct
+{
+  NMEAField fields[MAX_NMEA_FIELDS];
+  byte nrOfFields = 0;
+  byte type = NMEA_UNKNOWN; // the sentence ID as NMEASentenceType, set by the parser
+  byte talkerClass = 0;     // TalkerClass, set on the stack
+  unsigned long received = 0; // us, the time it was parsed
+  unsigned long deadline = 0; // us, the time it must be sent
+  NMEASentence sentence = "";
+
+} NMEAData;
+
+/*
+  Convert an NMEA position i.e. 5251.5621,N to decimal degrees
+*/
+inline double nmeaToDegrees(const NMEAField &value, const NMEAField &hemisphere)
+{
+  double raw = value.toDouble();
+  int degrees = (int)(raw / 100);
+  double result = degrees + (raw - degrees * 100) / 60.0;
+  if (hemisphere == "S" || hemisphere == "W")
+    result = -result;
+  return result;
+}
+
+/*
+  Purpose:  Sentence schema describing the fields the application uses per sentence ID
+            - Per field the sentence, the position, the type and the unit, so nobody
+              needs to know that SOG is field 7 of RMC
+            - Typed accessors; reading a field with the wrong type does not compile
+            - The parser only stores the fields in the schema, all others are just
+              forwarded in the sentence
+  NOTE:     The layout of a sentence depends on its sentence ID, not on the talker ID.
+            Add a field here before using it, otherwise it is empty after parsing.
+*/
+enum NMEAFieldType
+{
+  FIELD_TEXT,
+  FIELD_CHAR,  // a single character like a status, a unit or a side
+  FIELD_FLOAT,
+  FIELD_TIME,  // hhmmss.ss
+  FIELD_DATE,  // ddmmyy
+  FIELD_LAT,   // llll.ll followed by the N/S field
+  FIELD_LON    // yyyyy.yy followed by the E/W field
+};
+
+enum NMEAFieldId
+{
+  RMC_TIME,
+  RMC_STATUS,
+  RMC_LAT,
+  RMC_LON,
+  RMC_SOG,
+  RMC_COG,
+  RMC_DATE,
+  GLL_LAT,
+  GLL_LON,
+  GLL_TIME,
+  GLL_STATUS,
+  VHW_STW,
+  VWR_ANGLE,
+  VWR_SIDE,
+  VWR_AWS,
+  HDM_HEADING,
+  HDG_HEADING,
+  DBK_DEPTH,
+  DBK_UNIT,
+  DPT_DEPTH,
+  DPT_OFFSET,
+  XDR_TYPE,
+  XDR_VALUE,
+  XDR_UNIT,
+  XDR_NAME,
+  MTW_TEMPERATURE,
+  VLW_TOTAL,
+  VLW_TRIP,
+  TOB_VOLTAGE,
+  TOB_UNIT,
+  TOE_HOURS,
+  NR_OF_FIELD_IDS
+};
+
+struct NMEAFieldSchema
+{
+  NMEAFieldId id;       // the position in nmeaSchema[], checked at compile time
+  NMEASentenceType sentence;
+  byte index;           // the position in NMEAData.fields
+  NMEAFieldType type;
+  const char *name;
+  const char *unit;     // "" without a unit, NULL when the next field holds the unit
+};
+
+constexpr NMEAFieldSchema nmeaSchema[] = {
+    {RMC_TIME, NMEA_RMC, 1, FIELD_TIME, "time", ""},
+    {RMC_STATUS, NMEA_RMC, 2, FIELD_CHAR, "status", ""}, // A valid, V invalid
+    {RMC_LAT, NMEA_RMC, 3, FIELD_LAT, "latitude", "deg"},
+    {RMC_LON, NMEA_RMC, 5, FIELD_LON, "longitude", "deg"},
+    {RMC_SOG, NMEA_RMC, 7, FIELD_FLOAT, "SOG", "kn"},
+    {RMC_COG, NMEA_RMC, 8, FIELD_FLOAT, "COG", "deg true"},
+    {RMC_DATE, NMEA_RMC, 9, FIELD_DATE, "date", ""},
+    {GLL_LAT, NMEA_GLL, 1, FIELD_LAT, "latitude", "deg"},
+    {GLL_LON, NMEA_GLL, 3, FIELD_LON, "longitude", "deg"},
+    {GLL_TIME, NMEA_GLL, 5, FIELD_TIME, "time", ""},
+    {GLL_STATUS, NMEA_GLL, 6, FIELD_CHAR, "status", ""}, // A valid, V invalid
+    {VHW_STW, NMEA_VHW, 5, FIELD_FLOAT, "STW", "kn"},
+    {VWR_ANGLE, NMEA_VWR, 1, FIELD_FLOAT, "AWA", "deg"}, // 0..180 off the bow to VWR_SIDE
+    {VWR_SIDE, NMEA_VWR, 2, FIELD_CHAR, "side", ""},     // L port, R starboard
+    {VWR_AWS, NMEA_VWR, 3, FIELD_FLOAT, "AWS", "kn"},
+    {HDM_HEADING, NMEA_HDM, 1, FIELD_FLOAT, "heading", "deg magnetic"},
+    {HDG_HEADING, NMEA_HDG, 1, FIELD_FLOAT, "heading", "deg magnetic"},
+    {DBK_DEPTH, NMEA_DBK, 2, FIELD_FLOAT, "depth", NULL}, // the Robertson layout, see nmeaSpecialty()
+    {DBK_UNIT, NMEA_DBK, 3, FIELD_CHAR, "unit", ""},      // f feet, M meters
+    {DPT_DEPTH, NMEA_DPT, 1, FIELD_FLOAT, "depth", "m"},
+    {DPT_OFFSET, NMEA_DPT, 2, FIELD_FLOAT, "offset", "m"},
+    {XDR_TYPE, NMEA_XDR, 1, FIELD_CHAR, "type", ""}, // i.e. U voltage, C temperature
+    {XDR_VALUE, NMEA_XDR, 2, FIELD_FLOAT, "value", NULL},
+    {XDR_UNIT, NMEA_XDR, 3, FIELD_CHAR, "unit", ""}, // i.e. V volts, C degrees Celsius
+    {XDR_NAME, NMEA_XDR, 4, FIELD_TEXT, "name", ""},
+    {MTW_TEMPERATURE, NMEA_MTW, 1, FIELD_FLOAT, "temperature", "C"},
+    {VLW_TOTAL, NMEA_VLW, 1, FIELD_FLOAT, "total", "nm"},
+    {VLW_TRIP, NMEA_VLW, 3, FIELD_FLOAT, "trip", "nm"},
+    {TOB_VOLTAGE, NMEA_TOB, 1, FIELD_FLOAT, "battery", "V"},
+    {TOB_UNIT, NMEA_TOB, 2, FIELD_CHAR, "unit", ""}, // v or V
+    {TOE_HOURS, NMEA_TOE, 1, FIELD_FLOAT, "engine", "h"}};
+
+//*** the sentence IDs in NMEASentenceType order
+const char *const nmeaSentenceIds[NR_OF_SENTENCE_TYPES] = {
+    "", "RMC", "GLL", "VHW", "VWR", "HDM", "HDG", "DBK", "DPT", "XDR", "MTW", "VLW", "TOB", "TOE"};
+
+//*** compile time checks of the schema, one field after the other; a value without
+//*** a unit must be followed by the char field holding it
+constexpr bool nmeaSchemaValid(int id)
+{
+  return id >= NR_OF_FIELD_IDS ||
+         (nmeaSchema[id].id == id && nmeaSchema[id].sentence != NMEA_UNKNOWN &&
+          nmeaSchema[id].index > 0 &&
+          nmeaSchema[id].index + ((nmeaSchema[id].type == FIELD_LAT || nmeaSchema[id].type == FIELD_LON) ? 1 : 0) < MAX_NMEA_FIELDS &&
+          (nmeaSchema[id].unit != NULL ||
+           (id + 1 < NR_OF_FIELD_IDS && nmeaSchema[id + 1].sentence == nmeaSchema[id].sentence &&
+            nmeaSchema[id + 1].index == nmeaSchema[id].index + 1 && nmeaSchema[id + 1].type == FIELD_CHAR)) &&
+          nmeaSchemaValid(id + 1));
+}
+
+static_assert(sizeof(nmeaSchema) / sizeof(nmeaSchema[0]) == NR_OF_FIELD_IDS, "nmeaSchema needs one entry per NMEAFieldId");
+static_assert(nmeaSchemaValid(0), "nmeaSchema is out of order, has a field out of range or misses a unit field");
+static_assert(MAX_NMEA_FIELDS <= 32, "the used fields of a sentence are a 32 bit mask");
+
+//*** the fields of a sentence to store; the tag, the schema fields and the hemisphere of a position
+constexpr uint32_t nmeaFieldBits(const NMEAFieldSchema &field)
+{
+  return (1UL << field.index) | ((field.type == FIELD_LAT || field.type == FIELD_LON) ? 1UL << (field.index + 1) : 0);
+}
+
+constexpr uint32_t nmeaFieldMask(int type, int id)
+{
+  return id >= NR_OF_FIELD_IDS ? 1UL : (nmeaSchema[id].sentence == type ? nmeaFieldBits(nmeaSchema[id]) : 0) | nmeaFieldMask(type, id + 1);
+}
+
+const uint32_t nmeaUsedFields[NR_OF_SENTENCE_TYPES] = {
+    nmeaFieldMask(NMEA_UNKNOWN, 0), nmeaFieldMask(NMEA_RMC, 0), nmeaFieldMask(NMEA_GLL, 0),
+    nmeaFieldMask(NMEA_VHW, 0), nmeaFieldMask(NMEA_VWR, 0), nmeaFieldMask(NMEA_HDM, 0),
+    nmeaFieldMask(NMEA_HDG, 0), nmeaFieldMask(NMEA_DBK, 0), nmeaFieldMask(NMEA_DPT, 0),
+    nmeaFieldMask(NMEA_XDR, 0), nmeaFieldMask(NMEA_MTW, 0), nmeaFieldMask(NMEA_VLW, 0),
+    nmeaFieldMask(NMEA_TOB, 0), nmeaFieldMask(NMEA_TOE, 0)};
+
+/*
+  The sentence type of a tag; only $ttsss tags are known, AIS and odd tags are not
+*/
+inline NMEASentenceType nmeaSentenceType(const char *tag)
+{
+  if (tag[0] != '$' || strlen(tag) != 6)
+    return NMEA_UNKNOWN;
+  for (int type = NMEA_UNKNOWN + 1; type < NR_OF_SENTENCE_TYPES; type++)
+  {
+    if (strcmp(&tag[3], nmeaSentenceIds[type]) == 0)
+      return (NMEASentenceType)type;
+  }
+  return NMEA_UNKNOWN;
+}
+
+//*** typed accessors, check nmea.type before using them
+template <NMEAFieldId id>
+const NMEAField &nmeaText(const NMEAData &nmea)
+{
+  return nmea.fields[nmeaSchema[id].index];
+}
+
+template <NMEAFieldId id>
+char nmeaChar(const NMEAData &nmea)
+{
+  static_assert(nmeaSchema[id].type == FIELD_CHAR, "field is not a single character");
+  const NMEAField &field = nmea.fields[nmeaSchema[id].index];
+  return field.length() == 1 ? field[0] : '\0';
+}
+
+template <NMEAFieldId id>
+float nmeaFloat(const NMEAData &nmea)
+{
+  static_assert(nmeaSchema[id].type == FIELD_FLOAT, "field is not a number");
+  return nmea.fields[nmeaSchema[id].index].toFloat();
+}
+
+//*** the N/S or E/W field following a position
+template <NMEAFieldId id>
+const NMEAField &nmeaHemisphere(const NMEAData &nmea)
+{
+  static_assert(nmeaSchema[id].type == FIELD_LAT || nmeaSchema[id].type == FIELD_LON, "field is not a position");
+  return nmea.fields[nmeaSchema[id].index + 1];
+}
+
+template <NMEAFieldId id>
+double nmeaDegrees(const NMEAData &nmea)
+{
+  static_assert(nmeaSchema[id].type == FIELD_LAT || nmeaSchema[id].type == FIELD_LON, "field is not a position");
+  return nmeaToDegrees(nmea.fields[nmeaSchema[id].index], nmea.fields[nmeaSchema[id].index + 1]);
+}
+
+#endif
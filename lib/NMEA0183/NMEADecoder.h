@@ -0,0 +1,159 @@
+/*
+  Project:  NMEAtor - NMEA0183 library
+  Purpose:  Framing the bytes of a listener into sentences for the parser
+*/
+#ifndef NMEA_DECODER_H
+#define NMEA_DECODER_H
+
+#include "NMEAParser.h"
+
+enum NMEAReceiveStatus
+{
+  INVALID,
+  VALID,
+  RECEIVING,
+  CHECKSUMMING,
+  TERMINATING,
+  NMEA_READY
+};
+
+/*
+  Purpose:  Decoder of the incomming characters of a listener
+            - A start delimiter starts a new sentence, also in the middle of a sentence
+            - A <CR> or <LF> ends it; in old v1.5 version NMEA data may not be checksummed
+            - A line longer than NMEA_BUFFER_SIZE without a terminator is dropped
+            - A complete sentence goes to the parser
+ */
+class NMEADecoder
+{
+public:
+  NMEADecoder(NMEAParser *_parser);
+  void decode(char cIn);        // next byte from the listener
+  void resync();                // drop a partial sentence, i.e. after a UART error
+  bool isConsistent();          // the invariants of the buffer, for the tests
+  unsigned long getSentences(); // nr of sentences passed to the parser
+  unsigned long getOversizeLines();
+
+private:
+  NMEAParser *parser;
+  char buffer[NMEA_BUFFER_SIZE + 1];
+  byte status = INVALID;
+  byte index = 0;
+  bool dataReady = false;
+  unsigned long sentences = 0;
+  unsigned long oversizeLines = 0; // lines longer than NMEA_BUFFER_SIZE without a terminator
+};
+
+inline NMEADecoder::NMEADecoder(NMEAParser *_parser)
+    : parser(_parser)
+{
+  memset(buffer, 0, sizeof(buffer));
+}
+
+/*
+  Decode the incomming character and test if it is valid NMEA data.
+  If true than put it the NMEA buffer and call NMEAParser object
+  to process incomming and complete MNEA sentence
+*/
+inline void NMEADecoder::decode(char cIn)
+{
+  switch (cIn)
+  {
+  case '~':
+    // reserved by NMEA
+  case '!':
+    //for AIS info
+  case '$':
+    // for general NMEA info
+    status = RECEIVING;
+    index = 0;
+    break;
+  case '*':
+    if (status == RECEIVING)
+    {
+      status = CHECKSUMMING;
+    }
+    break;
+  case '\n':
+  case '\r':
+    // in old v1.5 version, NMEA Data may not be checksummed!
+    if (status == RECEIVING || status == CHECKSUMMING)
+    {
+      dataReady = true;
+      status = TERMINATING;
+    }
+    else
+      status = INVALID;
+
+    break;
+  }
+  switch (status)
+  {
+  case INVALID:
+    // do nothing
+    index = 0;
+    dataReady = false;
+    break;
+  case RECEIVING:
+  case CHECKSUMMING:
+    if (index >= NMEA_BUFFER_SIZE)
+    {
+      //*** no terminator within the max sentence length; drop the line
+      oversizeLines++;
+      status = INVALID;
+      index = 0;
+      break;
+    }
+    buffer[index] = cIn;
+    index++;
+    break;
+  case TERMINATING:
+
+    status = INVALID;
+    if (dataReady)
+    {
+      dataReady = false;
+
+      // Clear the remaining buffer content with '\0'; after a dropped line or a
+      // restart on a start delimiter the buffer still holds the bytes of that line
+      for (int y = index; y < NMEA_BUFFER_SIZE + 1; y++)
+      {
+        buffer[y] = '\0';
+      }
+#ifdef DEBUG
+      debugWrite(buffer);
+#endif
+      sentences++;
+      parser->parseNMEASentence(buffer);
+
+      //clear the NMEAbuffer with 0
+      memset(buffer, 0, NMEA_BUFFER_SIZE + 1);
+      index = 0;
+    }
+
+    break;
+  }
+}
+
+inline void NMEADecoder::resync()
+{
+  status = INVALID;
+  index = 0;
+}
+
+inline bool NMEADecoder::isConsistent()
+{
+  return index <= NMEA_BUFFER_SIZE && buffer[NMEA_BUFFER_SIZE] == '\0';
+}
+
+inline unsigned long NMEADecoder::getSentences()
+{
+  return sentences;
+}
+
+inline unsigned long NMEADecoder::getOversizeLines()
+{
+  return oversizeLines;
+}
+
+#endif
@@ -0,0 +1,198 @@
+/*
+  Project:  NMEAtor - NMEA0183 library
+  Purpose:  Writing NMEA sentences without String objects
+*/
+#ifndef NMEA_FORMATTER_H
+#define NMEA_FORMATTER_H
+
+#include "NMEAPlatform.h"
+
+/*
+  Purpose:  Formatter writing NMEA sentences straight into a caller supplied buffer
+            - No String objects and no heap; every sentence costs a bounded nr of steps
+            - The checksum is calculated while the fields are written
+            - Hex digits of the checksum come from a lookup table
+            - On overflow of the buffer end() returns 0 and the buffer holds an empty string
+            i.e.  NMEAFormatter(buffer, sizeof(buffer)).tag('$', "AO", "DPT").field("4.4").field("0.0").end();
+ */
+static const char hexTable[] = "0123456789abcdef"; // lower case, as the checksums have always been sent
+
+/*
+  Format a float with a fixed nr of decimals like String(value, decimals) does,
+  returns the nr of chars written
+*/
+inline size_t formatFixed(char *buffer, size_t size, float value, byte decimals)
+{
+  static const unsigned long scales[] = {1, 10, 100, 1000, 10000};
+  char digits[12];
+  size_t length = 0;
+  byte nrOfDigits = 0;
+
+  if (decimals > 4)
+    decimals = 4;
+  if (value < 0 && length + 1 < size)
+  {
+    buffer[length++] = '-';
+    value = -value;
+  }
+  unsigned long scaled = (unsigned long)(value * scales[decimals] + 0.5f);
+  //*** the digits in reverse order, at least one before the decimal point
+  do
+  {
+    digits[nrOfDigits++] = '0' + scaled % 10;
+    scaled /= 10;
+  } while ((scaled > 0 || nrOfDigits <= decimals) && nrOfDigits < sizeof(digits));
+
+  while (nrOfDigits > 0 && length + 1 < size)
+  {
+    buffer[length++] = digits[--nrOfDigits];
+    if (nrOfDigits == decimals && decimals > 0 && length + 1 < size)
+      buffer[length++] = '.';
+  }
+  buffer[length] = '\0';
+  return length;
+}
+
+class NMEAFormatter
+{
+public:
+  NMEAFormatter(char *_buffer, size_t _size);
+  NMEAFormatter &tag(char start, const char *talker, const char *sentenceId); // i.e. $ AO DPT
+  NMEAFormatter &field(const char *value);
+  NMEAFormatter &fieldUpper(const char *value); // the value in upper case
+  NMEAFormatter &field(float value, byte decimals);
+  NMEAFormatter &field(char value);
+  size_t end(bool terminate = false); // add *hh and optionally <CR><LF>, returns the length
+
+private:
+  char *buffer;
+  size_t size;
+  size_t length = 0;
+  byte cs = 0;
+  bool overflow = false;
+  void put(char c); // append a char that is part of the checksum
+};
+
+inline NMEAFormatter::NMEAFormatter(char *_buffer, size_t _size)
+    : buffer(_buffer), size(_size)
+{
+  if (size > 0)
+    buffer[0] = '\0';
+}
+
+inline void NMEAFormatter::put(char c)
+{
+  //*** keep room for *hh<CR><LF> and the '\0'
+  if (length + 6 >= size)
+  {
+    overflow = true;
+    return;
+  }
+  if (length > 0) // the start delimiter is not part of the checksum
+    cs ^= c;
+  buffer[length++] = c;
+}
+
+inline NMEAFormatter &NMEAFormatter::tag(char start, const char *talker, const char *sentenceId)
+{
+  put(start);
+  for (const char *c = talker; *c != '\0'; c++)
+    put(*c);
+  for (const char *c = sentenceId; *c != '\0'; c++)
+    put(*c);
+  return *this;
+}
+
+inline NMEAFormatter &NMEAFormatter::field(const char *value)
+{
+  put(',');
+  for (const char *c = value; *c != '\0'; c++)
+    put(*c);
+  return *this;
+}
+
+inline NMEAFormatter &NMEAFormatter::fieldUpper(const char *value)
+{
+  put(',');
+  for (const char *c = value; *c != '\0'; c++)
+    put(toupper(*c));
+  return *this;
+}
+
+inline NMEAFormatter &NMEAFormatter::field(float value, byte decimals)
+{
+  char number[16];
+  formatFixed(number, sizeof(number), value, decimals);
+  return field(number);
+}
+
+inline NMEAFormatter &NMEAFormatter::field(char value)
+{
+  put(',');
+  put(value);
+  return *this;
+}
+
+inline size_t NMEAFormatter::end(bool terminate)
+{
+  if (overflow || length == 0)
+  {
+    if (size > 0)
+      buffer[0] = '\0';
+    return 0;
+  }
+  buffer[length++] = '*';
+  buffer[length++] = hexTable[cs >> 4];
+  buffer[length++] = hexTable[cs & 0x0F];
+  if (terminate)
+  {
+    buffer[length++] = '\r';
+    buffer[length++] = '\n';
+  }
+  buffer[length] = '\0';
+  return length;
+}
+
+/*
+  Templates for the sentences we generate; the layout of the fields is fixed,
+  only the values are filled in. The talker is our talker ID, the application
+  passes its setting. All return the length or 0 on overflow.
+*/
+//*** $--DPT,x.x,x.x  depth below the transducer in meters and the transducer offset
+inline size_t formatDPT(char *buffer, size_t size, const char *talker, const char *depth, float offset)
+{
+  return NMEAFormatter(buffer, size).tag('$', talker, "DPT").field(depth).field(offset, 1).end();
+}
+
+//*** $--XDR,a,x.x,a,c--c  transducer type, measurement, unit and name
+inline size_t formatXDR(char *buffer, size_t size, const char *talker, char type, const char *value, const char *unit, const char *name)
+{
+  return NMEAFormatter(buffer, size).tag('$', talker, "XDR").field(type).field(value).fieldUpper(unit).field(name).end();
+}
+
+//*** $--HDG,x.x,x.x,a,x.x,a  magnetic heading, deviation (unknown) and variation
+inline size_t formatHDG(char *buffer, size_t size, const char *talker, float heading, float variation)
+{
+  return NMEAFormatter(buffer, size).tag('$', talker, "HDG").field(heading, 1).field("").field("").field(fabs(variation), 2).field(variation < 0 ? 'W' : 'E').end();
+}
+
+//*** $--HDT,x.x,T  true heading
+inline size_t formatHDT(char *buffer, size_t size, const char *talker, float heading)
+{
+  return NMEAFormatter(buffer, size).tag('$', talker, "HDT").field(heading, 1).field('T').end();
+}
+
+//*** $--ALR,hhmmss.ss,xxx,A,A,c--c  time, alarm id, condition, acknowledge state and text
+inline size_t formatALR(char *buffer, size_t size, const char *talker, const char *time, int id, bool active, const char *text)
+{
+  char number[4] = {(char)('0' + (id / 100) % 10), (char)('0' + (id / 10) % 10), (char)('0' + id % 10), '\0'};
+  return NMEAFormatter(buffer, size).tag('$', talker, "ALR").field(time).field(number).field(active ? 'A' : 'V').field('V').field(text).end();
+}
+
+//*** $--WPL,llll.ll,a,yyyyy.yy,a,c--c  waypoint position and name
+inline size_t formatWPL(char *buffer, size_t size, const char *talker, const char *position, const char *name)
+{
+  return NMEAFormatter(buffer, size).tag('$', talker, "WPL").field(position).field(name).end();
+}
+
+#endif
@@ -0,0 +1,301 @@
+/*
+  Project:  NMEAtor - NMEA0183 library
+  Purpose:  Parsing NMEA sentences into NMEAData
+*/
+#ifndef NMEA_PARSER_H
+#define NMEA_PARSER_H
+
+#include "NMEAData.h"
+#include "NMEAFormatter.h"
+
+#ifndef NMEA_TERMINATOR
+#define NMEA_TERMINATOR "\r\n"
+#endif
+#ifndef FTM
+#define FTM 0.3048 // feet to meters
+#endif
+
+//*** the application decides what happens with a parsed sentence
+typedef bool (*NMEAFilter)(NMEAData &nmea);  // false drops the sentence
+typedef void (*NMEAHandler)(NMEAData &nmea); // takes a parsed and converted sentence
+
+/*
+    Purpose:  An NMEA0183 parser to convert old to new version NMEA sentences
+            - Reading NMEA0183 v1.5 data without a checksum,
+            - Filtering out current heading data causing incorrect course in fo in navigation app
+              i.e. HDG, HDM and VHW messages
+            
+          
+  NOTE:     NMEA encoding conventions in short
+            An NMEA sentence consists of a start delimiter, followed by a comma-separated sequence
+            of fields, followed by the character '*' (ASCII 42), the checksum and an end-of-line marker.
+            i.e. <start delimiter><field 0>,<field 1>,,,<field n>*<checksum><end-of-linemarker>
+            The start delimiter is either $ or !. <field 0> contains the tag and the remaining fields
+            the values. The tag is normaly a 5 character wide identifier where the 1st 2 characters
+            identify the talker ID and the last 3 identify the sentence ID.
+            Maximum sentence length, including the $ and <CR><LF> is 82 bytes.
+
+  Source: https://gpsd.gitlab.io/gpsd/NMEA.html#_nmea_0183_physical_protocol_layer
+  */
+class NMEAParser
+{
+public:
+  NMEAParser(NMEAHandler _handler, NMEAFilter _filter, const char *_talkerId, const char *_specialty,
+             const float *_batteryOffset);
+
+  void parseNMEASentence(const char *nmeaIn); // parse an NMEA sentence with each part stored in the array
+
+  unsigned long getCounter(); //return nr of sentences parsed since switched on
+
+private:
+  NMEAHandler handler;
+  NMEAFilter filter;          // NULL passes all sentences
+  const char *talkerId;       // talker ID of the converted sentences
+  const char *specialty;      // tags needing a conversion, see isSpecialty()
+  const float *batteryOffset; // Volts, added to the battery voltage
+  NMEAData nmeaData; // self explaining
+  void reset();                            // clears the nmeaData struct;
+  void checksum(const char *str, char *cs); //calculate the checksum *hh for str
+  bool isSpecialty(const NMEAField &tag);  // true if tag is one of the tags in specialty
+  NMEAData nmeaSpecialty(NMEAData nmeaIn); // special treatment function
+  unsigned long counter = 0;
+};
+
+// ***
+// *** NMEAParser Constructor
+// *** input parameters:
+// *** the handler and the filter of the parsed sentences, the talker ID and
+// *** the specialty tags; the strings and the battery offset are settings,
+// *** so they are read on every sentence and may change while running
+inline NMEAParser::NMEAParser(NMEAHandler _handler, NMEAFilter _filter, const char *_talkerId,
+                              const char *_specialty, const float *_batteryOffset)
+    : handler(_handler), filter(_filter), talkerId(_talkerId), specialty(_specialty), batteryOffset(_batteryOffset)
+{
+  //*** initialize the NMEAData struct.
+  reset();
+}
+
+/*
+ * Clear the nmeaData attribute
+ */
+inline void NMEAParser::reset()
+{
+  nmeaData.nrOfFields = 0;
+  nmeaData.type = NMEA_UNKNOWN;
+  nmeaData.sentence = "";
+  for (int i = 0; i < MAX_NMEA_FIELDS; i++)
+  {
+    nmeaData.fields[i] = "";
+  }
+}
+
+/*
+
+*/
+inline NMEAData NMEAParser::nmeaSpecialty(NMEAData nmeaIn)
+{
+  NMEAData nmeaOut; //= nmeaIn;
+  char sentence[NMEA_BUFFER_SIZE + 1];
+#ifdef DEBUG
+  debugWrite(" Specialty found... for filter" + String(specialty));
+#endif
+  if (isSpecialty(nmeaIn.fields[0]))
+  {
+    /* In my on-board Robertson data network some sentences
+       are not NMEA0183 compliant. So these sentences need
+       to be converted to compliant sentences
+    */
+    //*** $IIDBK is not NMEA0183 compliant and needs conversion
+    //*** Since DBK/DBS sentences are obsolete DPT is used
+    if (nmeaIn.type == NMEA_DBK)
+    {
+#ifdef DEBUG
+      debugWrite("Found " + String(nmeaIn.fields[0].c_str()));
+#endif
+      // a typical non standard DBK message I receive is
+      // $IIDBK,A,0017.6,f,,,,
+      // Char A can also be a V if invalid and shoul be removed
+      // All fields after the tag shift 1 position to the left
+      // Since we modify the sentence we'll also put our talker ID in place
+
+      //*** below code is for DPT since TZ iBoat does not use DBT
+      char depth[NMEA_BUFFER_SIZE + 1];
+      if (nmeaChar<DBK_UNIT>(nmeaIn) == 'f')
+      {
+        //depth in feet need to be converted
+        float ft = nmeaFloat<DBK_DEPTH>(nmeaIn);
+        formatFixed(depth, sizeof(depth), ft * FTM, 1);
+      }
+      else
+      {
+        strncpy(depth, nmeaText<DBK_DEPTH>(nmeaIn).c_str(), sizeof(depth) - 1);
+        depth[sizeof(depth) - 1] = '\0';
+      }
+      formatDPT(sentence, sizeof(sentence), talkerId, depth, 0.0);
+      nmeaOut.fields[0] = "$";
+      nmeaOut.fields[0] += talkerId;
+      nmeaOut.fields[0] += "DPT";
+      nmeaOut.fields[1] = depth;
+      nmeaOut.fields[2] = "0.0";
+      nmeaOut.nrOfFields = 3;
+      nmeaOut.type = NMEA_DPT;
+      nmeaOut.sentence = sentence;
+
+#ifdef DEBUG
+      debugWrite(String(" Modified to:") + nmeaOut.sentence.c_str());
+#endif
+      return nmeaOut;
+    }
+
+    //*** current Battery info is in a non NMEA0183 format
+    //*** i.e. $PSTOB,13.2,V
+    //*** will be converted to $AOXDR,U,13.2,V,BATT,*CS
+    if (nmeaIn.type == NMEA_TOB)
+    {
+      char batt[16];
+      formatFixed(batt, sizeof(batt), nmeaFloat<TOB_VOLTAGE>(nmeaIn) + *batteryOffset, 1);
+      formatXDR(sentence, sizeof(sentence), talkerId, 'U', batt, nmeaText<TOB_UNIT>(nmeaIn).c_str(), "BATT");
+      nmeaOut.nrOfFields = 5;
+      nmeaOut.type = NMEA_XDR;
+      nmeaOut.fields[0] = "$";
+      nmeaOut.fields[0] += talkerId;
+      nmeaOut.fields[0] += "XDR";
+      nmeaOut.fields[1] = "U";              // the transducer unit
+      nmeaOut.fields[2] = batt;             // the actual measurement value
+      nmeaOut.fields[3] = nmeaText<TOB_UNIT>(nmeaIn); // unit of measure
+      nmeaOut.fields[3].toUpperCase();
+      nmeaOut.fields[4] = "BATT";
+      nmeaOut.sentence = sentence;
+#ifdef DEBUG
+      debugWrite(String(" Modified to:") + nmeaOut.sentence.c_str());
+#endif
+      return nmeaOut;
+    }
+  }
+  return nmeaOut;
+}
+
+/*
+  The specialty filter is a concatenation of 6 char tags i.e. $IIDBK$PSTOB
+  so only a whole tag on a tag boundary is a match
+*/
+inline bool NMEAParser::isSpecialty(const NMEAField &tag)
+{
+  if (tag.length() != 6)
+    return false;
+  for (const char *tags = specialty; strlen(tags) >= 6; tags += 6)
+  {
+    if (strncmp(tags, tag.c_str(), 6) == 0)
+      return true;
+  }
+  return false;
+}
+
+// calculate checksum function (thanks to https://mechinations.wordpress.com)
+inline void NMEAParser::checksum(const char *str, char *cs)
+{
+  byte sum = 0;
+  for (const char *c = str + 1; *c != '\0'; c++)
+  {
+    sum ^= *c;
+  }
+  cs[0] = '*';
+  cs[1] = hexTable[sum >> 4];
+  cs[2] = hexTable[sum & 0x0F];
+  cs[3] = '\0';
+}
+
+/*
+   parse an NMEA sentence into into an NMEAData structure.
+*/
+inline void NMEAParser::parseNMEASentence(const char *nmeaStr)
+{
+  reset();
+  int currentIndex = 0;
+  int lastIndex = -1;
+  int sentenceLength = strlen(nmeaStr);
+  const char *separator;
+  char field[NMEA_BUFFER_SIZE + 1];
+  uint32_t usedFields = 1; // the tag, the rest follows from the sentence type
+
+//*** check for a valid NMEA sentence
+#ifdef DEBUG
+  debugWrite(" In te loop to parse for " + String(sentenceLength) + " chars");
+#endif
+  if (nmeaStr[0] == '$' || nmeaStr[0] == '!' || nmeaStr[0] == '~')
+  {
+
+    //*** parse the fields from the NMEA string
+    //*** keeping in mind that indeOf() can return -1 if not found!
+    separator = strchr(nmeaStr, ',');
+    currentIndex = (separator != NULL) ? separator - nmeaStr : sentenceLength; // a sentence without fields
+    while (lastIndex < sentenceLength)
+    {
+
+      //*** remember to sepatrate fields with the ',' character
+      //*** but do not end with one!
+      if (lastIndex > 0)
+        nmeaData.sentence += ',';
+
+      //*** we want the data without the ',' in fields array
+      //*** fields beyond MAX_NMEA_FIELDS and fields not in the schema are passed on but not stored
+      bool store = nmeaData.nrOfFields < MAX_NMEA_FIELDS && (usedFields & (1UL << nmeaData.nrOfFields));
+      if (currentIndex - lastIndex > 1) // check for an empty field
+      {
+        int fieldLength = constrain(currentIndex - lastIndex - 1, 0, NMEA_BUFFER_SIZE);
+        memcpy(field, nmeaStr + lastIndex + 1, fieldLength);
+        field[fieldLength] = '\0';
+        nmeaData.sentence += field;
+        if (store)
+          nmeaData.fields[nmeaData.nrOfFields] = field;
+      }
+      else if (store)
+        nmeaData.fields[nmeaData.nrOfFields] = "0";
+      if (nmeaData.nrOfFields < MAX_NMEA_FIELDS)
+        nmeaData.nrOfFields++;
+      if (nmeaData.nrOfFields == 1)
+      {
+        nmeaData.type = nmeaSentenceType(nmeaData.fields[0].c_str());
+        usedFields = nmeaUsedFields[nmeaData.type];
+      }
+      lastIndex = currentIndex; // searching from next char of ',' !
+      separator = (lastIndex < sentenceLength) ? strchr(nmeaStr + lastIndex + 1, ',') : NULL;
+      //*** check if we found the last seperator
+      //*** and make sure we parse the last part of the string too!
+      currentIndex = (separator != NULL) ? separator - nmeaStr : sentenceLength;
+    }
+    //*** i.e. duplicates of the selected source are not forwarded
+    if (filter != NULL && !filter(nmeaData))
+      return;
+
+    NMEAData converted;
+    if (isSpecialty(nmeaData.fields[0]) && (converted = nmeaSpecialty(nmeaData)).sentence.length() > 0)
+    {
+      nmeaData = converted;
+    }
+    else if (nmeaData.sentence.indexOf('*') < 1) //Check for checksum in sentence
+    {
+      char cs[4];
+      checksum(nmeaData.sentence.c_str(), cs);
+      nmeaData.sentence += cs;
+    }
+#ifdef DEBUG
+    debugWrite(String("Parsed : ") + nmeaData.sentence.c_str());
+#endif
+    nmeaData.sentence += NMEA_TERMINATOR;
+#ifdef DEBUG
+    debugWrite(String("Parsed & terminated: ") + nmeaData.sentence.c_str());
+#endif
+    counter++; // for every sentence handled the counter increments
+    handler(nmeaData);
+  }
+
+  return;
+}
+
+inline unsigned long NMEAParser::getCounter()
+{
+  return counter;
+}
+
+#endif
@@ -0,0 +1,34 @@
+/*
+  Project:  NMEAtor - NMEA0183 library
+  Purpose:  The few Arduino definitions the NMEA0183 library uses
+            - On the ESP32 it is just Arduino.h
+            - On a host, for the native tests and the fuzz target, the C library
+              gives the rest; there is no String there, so the native build needs
+              the fixed size text of STATIC_ARENA
+*/
+#ifndef NMEA_PLATFORM_H
+#define NMEA_PLATFORM_H
+
+#ifdef ARDUINO
+#include <Arduino.h>
+#else
+#include <ctype.h>
+#include <math.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifndef STATIC_ARENA
+#error "The native build of the NMEA0183 library needs STATIC_ARENA"
+#endif
+
+typedef uint8_t byte;
+#define constrain(amt, low, high) ((amt) < (low) ? (low) : ((amt) > (high) ? (high) : (amt)))
+#endif
+
+#ifdef DEBUG
+void debugWrite(String debugMsg); // in the application
+#endif
+
+#endif
@@ -0,0 +1,170 @@
+/*
+  Project:  NMEAtor - NMEA0183 library
+  Purpose:  The text type of the NMEAData members
+            - Arduino String in the default build
+            - NMEAText, a fixed size text, in the STATIC_ARENA build
+*/
+#ifndef NMEA_TEXT_H
+#define NMEA_TEXT_H
+
+#include "NMEAPlatform.h"
+
+//*** The NMEA defines in total 82 characters including the starting
+//*** characters $ or ! and the checksum character *, the checksum
+//*** AND last but not least the <CR><LF> chacters.
+#ifndef NMEA_BUFFER_SIZE
+#define NMEA_BUFFER_SIZE 82
+#endif
+#ifndef FIELD_SIZE
+#define FIELD_SIZE 16 // chars per field incl. '\0' in the STATIC_ARENA build; longer is cut off
+#endif
+
+#ifdef STATIC_ARENA
+/*
+  Purpose:  Fixed size text for the NMEAData members in the STATIC_ARENA build
+            - The part of the String interface the pipeline uses, so the code is the
+              same in both builds
+            - The text lives in the object itself, so the stack, the parser and every
+              copy of NMEAData are sized at compile time and nothing is on the heap
+            - Text beyond the capacity is cut off
+ */
+template <size_t N>
+class NMEAText
+{
+public:
+  NMEAText();
+  NMEAText(const char *value);
+  NMEAText &operator=(const char *value);
+  NMEAText &operator+=(const char *value);
+  NMEAText &operator+=(char c);
+  bool operator==(const char *value) const;
+  bool operator!=(const char *value) const;
+  char operator[](unsigned int index) const;
+  unsigned int length() const;
+  const char *c_str() const;
+  int indexOf(char c) const;
+  float toFloat() const;
+  double toDouble() const;
+  long toInt() const;
+  void toUpperCase();
+
+private:
+  char text[N];
+  unsigned int len;
+  void append(const char *value);
+};
+
+template <size_t N>
+NMEAText<N>::NMEAText()
+{
+  text[0] = '\0';
+  len = 0;
+}
+
+template <size_t N>
+NMEAText<N>::NMEAText(const char *value)
+{
+  *this = value;
+}
+
+template <size_t N>
+NMEAText<N> &NMEAText<N>::operator=(const char *value)
+{
+  len = 0;
+  append(value);
+  return *this;
+}
+
+template <size_t N>
+NMEAText<N> &NMEAText<N>::operator+=(const char *value)
+{
+  append(value);
+  return *this;
+}
+
+template <size_t N>
+NMEAText<N> &NMEAText<N>::operator+=(char c)
+{
+  char value[2] = {c, '\0'};
+  append(value);
+  return *this;
+}
+
+template <size_t N>
+bool NMEAText<N>::operator==(const char *value) const
+{
+  return strcmp(text, value) == 0;
+}
+
+template <size_t N>
+bool NMEAText<N>::operator!=(const char *value) const
+{
+  return strcmp(text, value) != 0;
+}
+
+template <size_t N>
+char NMEAText<N>::operator[](unsigned int index) const
+{
+  return index < len ? text[index] : '\0';
+}
+
+template <size_t N>
+unsigned int NMEAText<N>::length() const
+{
+  return len;
+}
+
+template <size_t N>
+const char *NMEAText<N>::c_str() const
+{
+  return text;
+}
+
+template <size_t N>
+int NMEAText<N>::indexOf(char c) const
+{
+  const char *found = strchr(text, c);
+  return found != NULL ? found - text : -1;
+}
+
+template <size_t N>
+float NMEAText<N>::toFloat() const
+{
+  return atof(text);
+}
+
+template <size_t N>
+double NMEAText<N>::toDouble() const
+{
+  return atof(text);
+}
+
+template <size_t N>
+long NMEAText<N>::toInt() const
+{
+  return atol(text);
+}
+
+template <size_t N>
+void NMEAText<N>::toUpperCase()
+{
+  for (unsigned int i = 0; i < len; i++)
+    text[i] = toupper(text[i]);
+}
+
+template <size_t N>
+void NMEAText<N>::append(const char *value)
+{
+  while (*value != '\0' && len < N - 1)
+    text[len++] = *value++;
+  text[len] = '\0';
+}
+
+typedef NMEAText<FIELD_SIZE> NMEAField;
+typedef NMEAText<NMEA_BUFFER_SIZE + 6> NMEASentence; // room for *hh<CR><LF>
+#else
+typedef String NMEAField;
+typedef String NMEASentence;
+#endif
+
+#endif
@@ -0,0 +1,244 @@
+/*
+  Project:  NMEAtor - NMEA listener library
+  Purpose:  Detection of the baudrate and the polarity of a listener line from the
+            times of its edges; the interrupt on the ESP32 or synthetic lines in the
+            self test and the native tests
+*/
+#ifndef NMEA_DETECTOR_H
+#define NMEA_DETECTOR_H
+
+#include <algorithm>
+#include <stdint.h>
+#include <string.h>
+
+#ifndef HIGH
+#define HIGH 1
+#define LOW 0
+#endif
+
+#ifndef DETECT_EDGES
+#define DETECT_EDGES 512 // line edges sampled per detection window
+#endif
+#ifndef DETECT_MIN_FRAMES
+#define DETECT_MIN_FRAMES 20 // frames needed for a lock
+#endif
+#ifndef DETECT_MIN_SCORE
+#define DETECT_MIN_SCORE 90 // % good frames needed for a lock
+#endif
+#ifndef DETECT_ALIGNMENTS
+#define DETECT_ALIGNMENTS 10 // first falling edges tried as the first start bit
+#endif
+#ifndef DETECT_MIN_PULSE
+#define DETECT_MIN_PULSE 30 // % of a bit, a shorter pulse is noise
+#endif
+#ifndef DETECT_PULSE_PERCENTILE
+#define DETECT_PULSE_PERCENTILE 10 // % of the pulses below the estimate of a single bit
+#endif
+
+const unsigned long detectRates[] = {4800, 9600, 19200, 38400, 57600, 115200};
+#define NR_OF_DETECT_CANDIDATES (2 * sizeof(detectRates) / sizeof(detectRates[0]))
+
+typedef struct
+{
+  unsigned long rate;
+  bool inverted;
+  unsigned int frames; // frames decoded
+  uint8_t score;       // % frames with a stop bit and an NMEA character
+} DetectResult;
+
+/*
+  Purpose:  Scoring the candidate baudrates and polarities on an edge list
+            - Only the times of the edges are needed; the level after an edge follows
+              from the level before the first one, as the levels alternate
+            - Per candidate, pulses shorter than DETECT_MIN_PULSE % of a bit are noise;
+              such a pulse and the edge before it are removed, which keeps the
+              alternation and joins the pulses around it again
+            - NMEA text has many single bit pulses, so the DETECT_PULSE_PERCENTILE
+              percentile of the pulse widths is about a bit. A single short pulse or
+              the jitter of the interrupt on the edges does not move it much, where
+              the shortest pulse would. A baudrate with a bit far from it is impossible.
+            - The edges are decoded like a UART would; the score is the % of frames
+              with a stop bit and an NMEA character. The window starts anywhere in a
+              frame and a wrong framing can last long in a busy line, so the first
+              DETECT_ALIGNMENTS falling edges are all tried as the first start bit and
+              the best framing counts.
+ */
+class NMEADetector
+{
+public:
+  //*** score all candidates on n edge times in us, returns true and the best one on a lock
+  bool evaluate(const uint32_t *times, int n, uint8_t startLevel, DetectResult &best);
+  const DetectResult &getResult(unsigned int candidate); // of the last evaluation
+
+private:
+  DetectResult results[NR_OF_DETECT_CANDIDATES];
+  uint32_t edges[DETECT_EDGES];  // the edges left after the noise is removed
+  uint16_t pulses[DETECT_EDGES]; // us, the widths between them
+  int removeNoise(const uint32_t *times, int n, float minPulse);
+  float pulseWidth(int n, float minPulse);
+  uint8_t levelAt(int n, uint8_t startLevel, float t, int &index);
+  unsigned int decode(int n, uint8_t startLevel, int start, float bitTime, uint8_t mark, unsigned int &frames);
+  void score(const uint32_t *times, int n, uint8_t startLevel, DetectResult &result);
+  static uint8_t levelAfter(int edge, uint8_t startLevel);
+};
+
+//*** the level after an edge; every edge flips it
+inline uint8_t NMEADetector::levelAfter(int edge, uint8_t startLevel)
+{
+  return (edge < 0 || edge % 2 == 1) ? startLevel : !startLevel;
+}
+
+/*
+  Copy the edges into edges[] without the pulses shorter than minPulse, returns the nr left.
+  A short pulse takes the edge that started it along, so a glitch of two edges is gone and
+  the levels keep alternating.
+*/
+inline int NMEADetector::removeNoise(const uint32_t *times, int n, float minPulse)
+{
+  int kept = 0;
+  for (int i = 0; i < n && i < DETECT_EDGES; i++)
+  {
+    if (kept > 0 && times[i] - edges[kept - 1] < minPulse)
+      kept--;
+    else
+      edges[kept++] = times[i];
+  }
+  return kept;
+}
+
+/*
+  The estimate of a single bit; the low percentile of the pulse widths, or 0 without pulses
+*/
+inline float NMEADetector::pulseWidth(int n, float minPulse)
+{
+  int count = 0;
+  for (int i = 1; i < n; i++)
+  {
+    uint32_t width = edges[i] - edges[i - 1];
+    if (width >= minPulse)
+      pulses[count++] = width > UINT16_MAX ? UINT16_MAX : width;
+  }
+  if (count == 0)
+    return 0;
+  uint16_t *percentile = pulses + count * DETECT_PULSE_PERCENTILE / 100;
+  std::nth_element(pulses, percentile, pulses + count);
+  return *percentile;
+}
+
+/*
+  The level on the line at time t, index is the last edge before the previous t;
+  t only increases while decoding
+*/
+inline uint8_t NMEADetector::levelAt(int n, uint8_t startLevel, float t, int &index)
+{
+  while (index + 1 < n && edges[index + 1] - edges[0] <= t)
+    index++;
+  return levelAfter(index, startLevel);
+}
+
+/*
+  Decode the frames from the start bit at edge start, returns the nr of good frames
+*/
+inline unsigned int NMEADetector::decode(int n, uint8_t startLevel, int start, float bitTime, uint8_t mark,
+                                         unsigned int &frames)
+{
+  unsigned int good = 0;
+  frames = 0;
+  while (start >= 0 && start < n)
+  {
+    float t0 = edges[start] - edges[0];
+    if (t0 + 10 * bitTime > edges[n - 1] - edges[0])
+      break; // the frame is not complete
+
+    //*** every edge has the jitter of the interrupt, so the frame is placed on the mean
+    //*** offset of its edges to the bit boundaries, not on the start bit alone; a
+    //*** falling edge after the last data bit is the start bit of the next frame
+    float offset = 0;
+    int count = 1;
+    for (int i = start + 1; i < n; i++)
+    {
+      float bits = (edges[i] - edges[0] - t0) / bitTime;
+      if (bits >= 9.5 || (bits > 8.5 && levelAfter(i, startLevel) != mark))
+        break;
+      offset += (bits - (int)(bits + 0.5)) * bitTime;
+      count++;
+    }
+    t0 += offset / count;
+    int index = start;
+    uint8_t data = 0;
+    for (int bit = 0; bit < 8; bit++)
+    {
+      if (levelAt(n, startLevel, t0 + (bit + 1.5) * bitTime, index) == mark)
+        data |= 1 << bit;
+    }
+    int last = index; // the last edge before the sample of the last data bit
+    bool stop = levelAt(n, startLevel, t0 + 9.5 * bitTime, index) == mark;
+    frames++;
+    if (stop && ((data >= 0x20 && data < 0x7F) || data == '\r' || data == '\n'))
+      good++;
+
+    //*** the next start bit is a falling edge to space after the last data bit
+    start = -1;
+    for (int i = last + 1; i < n; i++)
+    {
+      if (edges[i] - edges[0] > t0 + 8.5 * bitTime && levelAfter(i, startLevel) != mark)
+      {
+        start = i;
+        break;
+      }
+    }
+  }
+  return good;
+}
+
+inline void NMEADetector::score(const uint32_t *times, int n, uint8_t startLevel, DetectResult &result)
+{
+  result.frames = 0;
+  result.score = 0;
+  float bitTime = 1000000.0 / result.rate;
+  float minPulse = bitTime * DETECT_MIN_PULSE / 100;
+  uint8_t mark = result.inverted ? LOW : HIGH; // the level of an idle line
+
+  n = removeNoise(times, n, minPulse);
+  float pulse = pulseWidth(n, minPulse);
+  if (pulse < bitTime * 0.6 || pulse > bitTime * 1.6)
+    return;
+
+  int alignments = 0;
+  for (int i = 0; i < n && alignments < DETECT_ALIGNMENTS; i++)
+  {
+    if (levelAfter(i, startLevel) == mark)
+      continue; // not a falling edge to space
+    alignments++;
+    unsigned int frames = 0;
+    unsigned int good = decode(n, startLevel, i, bitTime, mark, frames);
+    if (frames > 0 && good * 100 / frames > result.score)
+    {
+      result.score = good * 100 / frames;
+      result.frames = frames;
+    }
+  }
+}
+
+inline bool NMEADetector::evaluate(const uint32_t *times, int n, uint8_t startLevel, DetectResult &best)
+{
+  int found = -1;
+  for (unsigned int c = 0; c < NR_OF_DETECT_CANDIDATES; c++)
+  {
+    results[c].rate = detectRates[c / 2];
+    results[c].inverted = c % 2 == 0;
+    score(times, n, startLevel, results[c]);
+    if (found < 0 || results[c].score > results[found].score ||
+        (results[c].score == results[found].score && results[c].frames > results[found].frames))
+      found = c;
+  }
+  best = results[found];
+  return best.frames >= DETECT_MIN_FRAMES && best.score >= DETECT_MIN_SCORE;
+}
+
+inline const DetectResult &NMEADetector::getResult(unsigned int candidate)
+{
+  return results[candidate];
+}
+
+#endif
@@ -0,0 +1,82 @@
+/*
+  Project:  NMEAtor - NMEA listener library
+  Purpose:  Synthetic listener lines for the detector
+            - Used by the self test of the TEST build and the native tests
+            - The edge times of NMEA text at a baudrate and polarity, with the
+              jitter of the interrupt on the edges and glitches on the line
+*/
+#ifndef NMEA_LISTENER_CORPUS_H
+#define NMEA_LISTENER_CORPUS_H
+
+#include "NMEADetector.h"
+
+typedef struct
+{
+  unsigned long rate;
+  bool inverted;
+  uint8_t jitter;   // us, the max deviation of an edge time
+  uint8_t glitches; // a 1 us spike in the middle of a bit every so many chars, 0 for none
+} ListenerTestCase;
+
+static const ListenerTestCase listenerCorpus[] = {
+    {4800, true, 0, 0},
+    {4800, false, 0, 0},
+    {9600, true, 0, 0},
+    {38400, false, 0, 0},
+    {38400, true, 0, 0},
+    {115200, false, 0, 0},
+    {4800, true, 0, 5},
+    {38400, false, 1, 5},
+    {115200, false, 2, 0},
+    {115200, true, 2, 10}};
+
+/*
+  Fill times with the edges of the test line, up to max; returns the nr of edges and the
+  level before the first one
+*/
+inline int synthesizeLine(const ListenerTestCase &test, uint32_t *times, int max, uint8_t &startLevel)
+{
+  const char *text = "$GPRMC,095218.000,A,5251.5621,N,00540.8482,E,4.25,201.77,120420,,,D*6D\r\n"
+                     "$IIVWR,151,R,02.4,N,,,,\r\n";
+  double bitTime = 1000000.0 / test.rate;
+  double t = 1000;
+  uint8_t mark = test.inverted ? LOW : HIGH;
+  uint8_t level = mark;
+  uint32_t random = test.rate; // xorshift, the same line every run
+  int n = 0;
+  for (int c = 0; n < max; c++)
+  {
+    char data = text[c % strlen(text)];
+    //*** a start bit, 8 data bits LSB first and a stop bit
+    for (int bit = 0; bit < 10 && n < max; bit++)
+    {
+      bool logic = bit == 0 ? false : (bit == 9 ? true : (data >> (bit - 1)) & 1);
+      uint8_t pin = logic ? mark : !mark;
+      if (pin != level)
+      {
+        random ^= random << 13;
+        random ^= random >> 17;
+        random ^= random << 5;
+        double jitter = test.jitter == 0 ? 0 : (int)(random % (2 * test.jitter + 1)) - test.jitter;
+        times[n++] = (uint32_t)(t + jitter + 0.5);
+        level = pin;
+      }
+      if (test.glitches > 0 && c % test.glitches == 0 && bit == 4 && n + 2 <= max)
+      {
+        times[n++] = (uint32_t)(t + bitTime / 2 + 0.5);
+        times[n++] = (uint32_t)(t + bitTime / 2 + 1.5);
+      }
+      t += bitTime;
+    }
+    if (data == '\n')
+      t += 20 * bitTime; // a gap between the sentences
+  }
+  //*** drop the first edges, the window starts in the middle of a frame
+  const int skip = 3;
+  startLevel = skip % 2 == 0 ? mark : !mark;
+  for (int i = skip; i < n; i++)
+    times[i - skip] = times[i];
+  return n - skip;
+}
+
+#endif
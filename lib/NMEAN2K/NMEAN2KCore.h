@@ -0,0 +1,252 @@
+/*
+  Project:  NMEAtor - NMEA2000 library
+  Purpose:  The scheduling, the fast-packet framing and the address claim of the
+            NMEA2000 gateway on plain CAN frames; the TWAI controller of the ESP32
+            or a SocketCAN interface for the native tests
+*/
+#ifndef NMEA_N2K_CORE_H
+#define NMEA_N2K_CORE_H
+
+#include "NMEAN2KPgns.h"
+
+#ifndef N2K_SOURCE_ADDRESS
+#define N2K_SOURCE_ADDRESS 35 // preferred source address on the bus
+#endif
+#ifndef N2K_MANUFACTURER
+#define N2K_MANUFACTURER 2046 // manufacturer code, 2046 is for own builds
+#endif
+#ifndef N2K_FRAME_QUEUE
+#define N2K_FRAME_QUEUE 32 // nr of CAN frames waiting to be sent
+#endif
+#ifndef N2K_DATA_TIMEOUT
+#define N2K_DATA_TIMEOUT 5000 // ms after which a value is too old to send
+#endif
+
+//*** a CAN frame with an extended (29 bits) id
+struct N2KFrame
+{
+  uint32_t id;
+  byte len;
+  byte data[8];
+};
+
+/*
+  Purpose:  NMEA2000 gateway core converting the parsed NMEA0183 data to PGNs
+            - The latest values are kept in an N2KValues struct, updated through the
+              n2kSentences table from the same sentences startTalking() sends out
+            - schedule() queues the frames of the PGNs of the n2kPgns table that are due
+            - PGNs longer than 8 bytes are split up according the fast-packet protocol
+            - The application takes the frames from the queue with peek() and pop()
+              and hands the received frames to receive()
+            The time is passed in, so the tests control it.
+
+  NOTE:     A CAN id on an NMEA2000 network is 29 bits wide and formatted as
+            <priority 3 bits><PGN 18 bits><source address 8 bits>
+            Fast-packet frames start with a sequence counter (3 bits) and frame counter (5 bits).
+            The first frame holds the total nr of bytes and 6 data bytes, the others 7 data bytes.
+ */
+class NMEAN2KCore
+{
+public:
+  NMEAN2KCore();
+  void begin(uint32_t uniqueNumber);                // claim our address with this unique number in the NAME
+  void update(NMEAData &nmea, unsigned long now);   // update the N2K values from a sent sentence
+  void schedule(unsigned long now);                 // queue the frames of the due PGNs with recent data
+  void sendPgn(unsigned long pgn, byte priority, const byte *data, byte len); // queue one PGN
+  void receive(const N2KFrame &frame);              // handle a frame from the bus
+  void claimAddress();                              // queue our address claim
+  const N2KFrame *peek();                           // the next frame to send or NULL
+  void pop();                                       // remove the frame after it has been sent
+  uint64_t getName();                               // the ISO NAME of this device
+  byte getAddress();                                // our source address on the bus
+  byte getQueued();                                 // nr of frames waiting
+  unsigned long getDropped();                       // nr of frames dropped since the queue was full
+
+private:
+  N2KValues values;
+  N2KFrame queue[N2K_FRAME_QUEUE];
+  unsigned long lastSent[N2K_PGNS] = {0};
+  byte queueHead = 0;
+  byte queueCount = 0;
+  byte sid = 0;         // sequence id to relate PGNs of the same moment
+  byte fastPacketSeq = 0;
+  byte address = N2K_SOURCE_ADDRESS;
+  uint32_t unique = 0;
+  unsigned long dropped = 0;
+  bool enqueue(unsigned long pgn, byte priority, const byte *data, byte len);
+};
+
+inline NMEAN2KCore::NMEAN2KCore()
+{
+}
+
+inline void NMEAN2KCore::begin(uint32_t uniqueNumber)
+{
+  unique = uniqueNumber & 0x1FFFFF;
+  claimAddress();
+}
+
+inline void NMEAN2KCore::update(NMEAData &nmea, unsigned long now)
+{
+  for (unsigned int i = 0; i < sizeof(n2kSentences) / sizeof(n2kSentences[0]); i++)
+  {
+    if (nmea.type == n2kSentences[i].type)
+    {
+      n2kSentences[i].handler(values, nmea);
+      values.updated[n2kSentences[i].value] = now;
+      return;
+    }
+  }
+}
+
+inline void NMEAN2KCore::schedule(unsigned long now)
+{
+  bool newSid = false;
+  for (unsigned int i = 0; i < N2K_PGNS; i++)
+  {
+    const N2KPgn &p = n2kPgns[i];
+    unsigned long updated = values.updated[p.value];
+    if (updated == 0 || now - updated > N2K_DATA_TIMEOUT || now - lastSent[i] < p.interval)
+      continue;
+
+    byte data[N2K_MAX_DATA];
+    byte len = p.encoder(values, sid, data);
+    if (len > 0)
+    {
+      sendPgn(p.pgn, p.priority, data, len);
+      newSid = true;
+    }
+    lastSent[i] = now;
+  }
+  if (newSid)
+    sid = (sid + 1) % 253; // 253..255 are reserved
+}
+
+inline bool NMEAN2KCore::enqueue(unsigned long pgn, byte priority, const byte *data, byte len)
+{
+  if (queueCount >= N2K_FRAME_QUEUE)
+  {
+    dropped++;
+    return false;
+  }
+  N2KFrame &frame = queue[(queueHead + queueCount) % N2K_FRAME_QUEUE];
+  frame.id = ((uint32_t)priority << 26) | (pgn << 8) | address;
+  frame.len = 8;
+  memset(frame.data, 0xFF, 8);
+  memcpy(frame.data, data, len);
+  queueCount++;
+  return true;
+}
+
+inline void NMEAN2KCore::sendPgn(unsigned long pgn, byte priority, const byte *data, byte len)
+{
+  if (len <= 8)
+  {
+    enqueue(pgn, priority, data, len);
+    return;
+  }
+
+  //*** fast-packet; all frames must fit or the receiver drops the whole PGN
+  byte frames = 1 + (len - 6 + 6) / 7;
+  if (N2K_FRAME_QUEUE - queueCount < frames)
+  {
+    dropped += frames;
+    return;
+  }
+  byte frame[8];
+  byte seq = (fastPacketSeq++ & 0x07) << 5;
+  frame[0] = seq;
+  frame[1] = len;
+  memcpy(&frame[2], data, 6);
+  enqueue(pgn, priority, frame, 8);
+  for (byte counter = 1, index = 6; index < len; counter++, index += 7)
+  {
+    byte chunk = (len - index < 7) ? len - index : 7;
+    memset(frame, 0xFF, 8);
+    frame[0] = seq | counter;
+    memcpy(&frame[1], &data[index], chunk);
+    enqueue(pgn, priority, frame, chunk + 1);
+  }
+}
+
+/*
+  The ISO NAME identifies this device on the bus; the lowest NAME wins an address conflict
+*/
+inline uint64_t NMEAN2KCore::getName()
+{
+  uint64_t name = 0;
+  name |= (uint64_t)unique;                         // unique number
+  name |= (uint64_t)N2K_MANUFACTURER << 21;         // manufacturer code
+  name |= (uint64_t)135 << 40;                      // function: NMEA 0183 gateway
+  name |= (uint64_t)25 << 49;                       // class: inter/intranetwork device
+  name |= (uint64_t)4 << 60;                        // industry group: marine
+  name |= (uint64_t)1 << 63;                        // arbitrary address capable
+  return name;
+}
+
+inline void NMEAN2KCore::claimAddress()
+{
+  byte data[8];
+  uint64_t name = getName();
+  for (int i = 0; i < 8; i++)
+  {
+    data[i] = (name >> (8 * i)) & 0xFF;
+  }
+  enqueue(60928UL | 0xFF, 6, data, 8); // to the global address
+}
+
+inline void NMEAN2KCore::receive(const N2KFrame &frame)
+{
+  unsigned long pf = (frame.id >> 16) & 0xFF;
+  byte ps = (frame.id >> 8) & 0xFF;
+  byte src = frame.id & 0xFF;
+
+  //*** ISO request for the address claim
+  if (pf == 0xEA && (ps == address || ps == 0xFF) && frame.len >= 3 &&
+      (frame.data[0] | (frame.data[1] << 8) | ((unsigned long)frame.data[2] << 16)) == 60928UL)
+  {
+    claimAddress();
+  }
+  //*** another device claims our address; the lowest NAME keeps it
+  if (pf == 0xEE && src == address && frame.len == 8)
+  {
+    uint64_t other = 0;
+    for (int i = 7; i >= 0; i--)
+    {
+      other = (other << 8) | frame.data[i];
+    }
+    if (other < getName())
+      address = (address + 1) % 252;
+    claimAddress();
+  }
+}
+
+inline const N2KFrame *NMEAN2KCore::peek()
+{
+  return (queueCount > 0) ? &queue[queueHead] : NULL;
+}
+
+inline void NMEAN2KCore::pop()
+{
+  if (queueCount == 0)
+    return;
+  queueHead = (queueHead + 1) % N2K_FRAME_QUEUE;
+  queueCount--;
+}
+
+inline byte NMEAN2KCore::getAddress()
+{
+  return address;
+}
+
+inline byte NMEAN2KCore::getQueued()
+{
+  return queueCount;
+}
+
+inline unsigned long NMEAN2KCore::getDropped()
+{
+  return dropped;
+}
+
+#endif
@@ -0,0 +1,224 @@
+/*
+  Project:  NMEAtor - NMEA2000 library
+  Purpose:  The tables converting the parsed NMEA0183 sentences into N2K values
+            and the N2K values into the data of the PGNs
+            - n2kSentences; which sentence updates which value
+            - n2kPgns; per PGN the priority, the send interval and the encoder
+
+  Source: https://canboat.github.io/canboat/canboat.html
+*/
+#ifndef NMEA_N2K_PGNS_H
+#define NMEA_N2K_PGNS_H
+
+#include <NMEAData.h>
+
+#ifndef N2K_MAX_DATA
+#define N2K_MAX_DATA 32 // max nr of data bytes in a PGN we send
+#endif
+#ifndef N2K_VALUES
+#define N2K_VALUES 7 // nr of values kept for the PGNs
+#endif
+#ifndef NTK
+#define NTK 1.852 // nautical mile to km
+#endif
+#ifndef DEG_TO_RAD
+#define DEG_TO_RAD 0.017453292519943295
+#endif
+#ifndef PI
+#define PI 3.1415926535897932384626433832795
+#endif
+
+struct N2KValues
+{
+  float depth = 0;      // m below transducer
+  float depthOffset = 0; // m, transducer offset
+  float windAngle = 0;  // rad, 0..2PI clockwise from the bow
+  float windSpeed = 0;  // m/s
+  float stw = 0;        // m/s, speed through water
+  float heading = 0;    // rad, magnetic
+  float battery = 0;    // V
+  float log = 0;        // m, total distance
+  float trip = 0;       // m, trip distance
+  float waterTemp = 0;  // K
+  unsigned long updated[N2K_VALUES] = {0}; // ms of last update per value
+};
+
+enum N2KValueIndex
+{
+  N2K_DEPTH,
+  N2K_WIND,
+  N2K_STW,
+  N2K_HEADING,
+  N2K_BATTERY,
+  N2K_LOG,
+  N2K_TEMP
+};
+
+//*** converts a sentence into N2K values
+typedef void (*N2KSentenceHandler)(N2KValues &values, NMEAData &nmea);
+//*** encodes a PGN into data, returns the nr of bytes or 0 if there is nothing to send
+typedef byte (*N2KPgnEncoder)(N2KValues &values, byte sid, byte *data);
+
+struct N2KSentence
+{
+  NMEASentenceType type;
+  N2KValueIndex value;
+  N2KSentenceHandler handler;
+};
+
+struct N2KPgn
+{
+  unsigned long pgn;
+  byte priority;
+  unsigned long interval; // ms between two transmissions
+  N2KValueIndex value;    // the value needed to send this PGN
+  N2KPgnEncoder encoder;
+};
+
+//*** little endian helpers for the N2K data fields
+inline void n2kPut16(byte *data, int index, uint16_t value)
+{
+  data[index] = value & 0xFF;
+  data[index + 1] = (value >> 8) & 0xFF;
+}
+
+inline void n2kPut32(byte *data, int index, uint32_t value)
+{
+  n2kPut16(data, index, value & 0xFFFF);
+  n2kPut16(data, index + 2, value >> 16);
+}
+
+//*** sentence handlers; units are converted to the SI units used by NMEA2000
+inline void n2kFromDPT(N2KValues &values, NMEAData &nmea)
+{
+  values.depth = nmeaFloat<DPT_DEPTH>(nmea);
+  values.depthOffset = nmeaFloat<DPT_OFFSET>(nmea);
+}
+
+inline void n2kFromVWR(N2KValues &values, NMEAData &nmea)
+{
+  float angle = nmeaFloat<VWR_ANGLE>(nmea) * DEG_TO_RAD;
+  values.windAngle = (nmeaChar<VWR_SIDE>(nmea) == 'L') ? 2 * PI - angle : angle;
+  values.windSpeed = nmeaFloat<VWR_AWS>(nmea) * NTK / 3.6;
+}
+
+inline void n2kFromVHW(N2KValues &values, NMEAData &nmea)
+{
+  values.stw = nmeaFloat<VHW_STW>(nmea) * NTK / 3.6;
+}
+
+inline void n2kFromHDM(N2KValues &values, NMEAData &nmea)
+{
+  values.heading = nmeaFloat<HDM_HEADING>(nmea) * DEG_TO_RAD;
+}
+
+inline void n2kFromXDR(N2KValues &values, NMEAData &nmea)
+{
+  values.battery = nmeaFloat<XDR_VALUE>(nmea);
+}
+
+inline void n2kFromVLW(N2KValues &values, NMEAData &nmea)
+{
+  values.log = nmeaFloat<VLW_TOTAL>(nmea) * NTK * 1000;
+  values.trip = nmeaFloat<VLW_TRIP>(nmea) * NTK * 1000;
+}
+
+inline void n2kFromMTW(N2KValues &values, NMEAData &nmea)
+{
+  values.waterTemp = nmeaFloat<MTW_TEMPERATURE>(nmea) + 273.15;
+}
+
+//*** PGN encoders, unused fields are set to 0xFF (not available)
+inline byte n2kWaterDepth(N2KValues &values, byte sid, byte *data)
+{
+  data[0] = sid;
+  n2kPut32(data, 1, (uint32_t)(values.depth * 100));          // 0.01 m
+  n2kPut16(data, 5, (int16_t)(values.depthOffset * 1000)); // 0.001 m
+  data[7] = 0xFF;                                            // range not available
+  return 8;
+}
+
+inline byte n2kWindData(N2KValues &values, byte sid, byte *data)
+{
+  data[0] = sid;
+  n2kPut16(data, 1, (uint16_t)(values.windSpeed * 100));   // 0.01 m/s
+  n2kPut16(data, 3, (uint16_t)(values.windAngle * 10000)); // 0.0001 rad
+  data[5] = 0xFA;                                          // apparent wind
+  data[6] = 0xFF;
+  data[7] = 0xFF;
+  return 8;
+}
+
+inline byte n2kSpeed(N2KValues &values, byte sid, byte *data)
+{
+  data[0] = sid;
+  n2kPut16(data, 1, (uint16_t)(values.stw * 100)); // 0.01 m/s
+  n2kPut16(data, 3, 0xFFFF);                       // SOG not available
+  data[5] = 0x00;                                  // paddle wheel
+  data[6] = 0xFF;
+  data[7] = 0xFF;
+  return 8;
+}
+
+inline byte n2kVesselHeading(N2KValues &values, byte sid, byte *data)
+{
+  data[0] = sid;
+  n2kPut16(data, 1, (uint16_t)(values.heading * 10000)); // 0.0001 rad
+  n2kPut16(data, 3, 0x7FFF);                             // deviation not available
+  n2kPut16(data, 5, 0x7FFF);                             // variation not available
+  data[7] = 0xFD;                                        // magnetic reference
+  return 8;
+}
+
+inline byte n2kBatteryStatus(N2KValues &values, byte sid, byte *data)
+{
+  data[0] = 0;                                         // battery instance
+  n2kPut16(data, 1, (int16_t)(values.battery * 100)); // 0.01 V
+  n2kPut16(data, 3, 0x7FFF);                          // current not available
+  n2kPut16(data, 5, 0xFFFF);                          // temperature not available
+  data[7] = sid;
+  return 8;
+}
+
+inline byte n2kDistanceLog(N2KValues &values, byte /*sid*/, byte *data)
+{
+  n2kPut16(data, 0, 0xFFFF);                    // date not available
+  n2kPut32(data, 2, 0xFFFFFFFF);                // time not available
+  n2kPut32(data, 6, (uint32_t)values.log);      // 1 m
+  n2kPut32(data, 10, (uint32_t)values.trip);    // 1 m
+  return 14;
+}
+
+inline byte n2kEnvironment(N2KValues &values, byte sid, byte *data)
+{
+  data[0] = sid;
+  n2kPut16(data, 1, (uint16_t)(values.waterTemp * 100)); // 0.01 K
+  n2kPut16(data, 3, 0xFFFF);                             // air temperature not available
+  n2kPut16(data, 5, 0xFFFF);                             // pressure not available
+  data[7] = 0xFF;
+  return 8;
+}
+
+//*** which sentence updates which value
+const N2KSentence n2kSentences[] = {
+    {NMEA_DPT, N2K_DEPTH, n2kFromDPT},
+    {NMEA_VWR, N2K_WIND, n2kFromVWR},
+    {NMEA_VHW, N2K_STW, n2kFromVHW},
+    {NMEA_HDM, N2K_HEADING, n2kFromHDM},
+    {NMEA_XDR, N2K_BATTERY, n2kFromXDR},
+    {NMEA_VLW, N2K_LOG, n2kFromVLW},
+    {NMEA_MTW, N2K_TEMP, n2kFromMTW}};
+
+//*** the PGNs to send, intervals according the NMEA2000 default rates
+const N2KPgn n2kPgns[] = {
+    {128267, 3, 1000, N2K_DEPTH, n2kWaterDepth},
+    {130306, 2, 100, N2K_WIND, n2kWindData},
+    {128259, 2, 1000, N2K_STW, n2kSpeed},
+    {127250, 2, 100, N2K_HEADING, n2kVesselHeading},
+    {127508, 6, 1500, N2K_BATTERY, n2kBatteryStatus},
+    {128275, 6, 1000, N2K_LOG, n2kDistanceLog},
+    {130310, 5, 500, N2K_TEMP, n2kEnvironment}};
+
+#define N2K_PGNS (sizeof(n2kPgns) / sizeof(n2kPgns[0]))
+
+#endif
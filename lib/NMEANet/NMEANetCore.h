@@ -0,0 +1,278 @@
+/*
+  Project:  NMEAtor ESP32 - NMEA network library
+  Purpose:  The clients, the batches and the eviction of the network talker on plain
+            BSD sockets; lwip on the ESP32, the host sockets for the native tests
+*/
+#ifndef NMEA_NET_CORE_H
+#define NMEA_NET_CORE_H
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#ifdef ARDUINO
+#include <lwip/sockets.h>
+#else
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#endif
+#include "NMEARing.h"
+
+#ifndef MAX_NET_CLIENTS
+#define MAX_NET_CLIENTS 4 // max nr of simultaneous TCP clients
+#endif
+#ifndef NET_BATCH_SIZE
+#define NET_BATCH_SIZE 512 // max nr of bytes per UDP packet or TCP write
+#endif
+#ifndef NET_FLUSH_DELAY
+#define NET_FLUSH_DELAY 20 // ms to collect sentences before sending a batch
+#endif
+#ifndef NET_EVICT_TIMEOUT
+#define NET_EVICT_TIMEOUT 5000 // ms a client may stall before it is dropped
+#endif
+
+#ifdef MSG_NOSIGNAL
+#define NET_SEND_FLAGS (MSG_DONTWAIT | MSG_NOSIGNAL) // a closed client may not kill a host process
+#else
+#define NET_SEND_FLAGS MSG_DONTWAIT
+#endif
+
+/*
+  Purpose:  Network talker core sending the NMEA sentences to the network
+            - UDP broadcast on the port for any app listening on the network
+            - TCP server on the port for up to MAX_NET_CLIENTS clients
+            - Sentences are collected and sent in batches of up to NET_BATCH_SIZE bytes
+            - Sockets are written non blocking; a client that cannot keep up overflows
+              its ring buffer or stalls for NET_EVICT_TIMEOUT and is disconnected.
+              This way a slow client can never hold up the serial talker.
+            The time is passed in, so the tests control it.
+ */
+class NMEANetCore
+{
+public:
+  NMEANetCore();
+  bool begin(uint16_t port, uint32_t broadcastAddress); // the address in network byte order
+  void end();                                             // disconnect all and close the sockets
+  void queue(const char *data, size_t len);               // queue one sentence for all receivers
+  void handle(unsigned long now);                         // ms; accept clients and send pending batches
+  uint8_t getClients();                                   // nr of connected TCP clients
+  unsigned long getEvicted();                             // nr of clients dropped for being too slow
+
+private:
+  struct NetClient
+  {
+    int fd = -1;
+    NMEARing ring;
+    bool active = false;
+    unsigned long lastProgress = 0; // last time data was accepted by the socket
+  };
+  int serverFd = -1;
+  int udpFd = -1;
+  struct sockaddr_in broadcast;
+  NetClient clients[MAX_NET_CLIENTS];
+  char udpBatch[NET_BATCH_SIZE];
+  size_t udpLength = 0;
+  unsigned long lastFlush = 0;
+  unsigned long evicted = 0;
+  bool running = false;
+  void acceptClients(unsigned long now);
+  void flushUDP();
+  void flushClient(NetClient &nc, unsigned long now);
+  void disconnect(NetClient &nc);
+  void evict(NetClient &nc);
+};
+
+inline NMEANetCore::NMEANetCore()
+{
+  memset(&broadcast, 0, sizeof(broadcast));
+}
+
+inline bool NMEANetCore::begin(uint16_t port, uint32_t broadcastAddress)
+{
+  int on = 1;
+  struct sockaddr_in local;
+  memset(&local, 0, sizeof(local));
+  local.sin_family = AF_INET;
+  local.sin_port = htons(port);
+  local.sin_addr.s_addr = htonl(INADDR_ANY);
+  broadcast = local;
+  broadcast.sin_addr.s_addr = broadcastAddress;
+
+  serverFd = socket(AF_INET, SOCK_STREAM, 0);
+  udpFd = socket(AF_INET, SOCK_DGRAM, 0);
+  if (serverFd < 0 || udpFd < 0 ||
+      setsockopt(serverFd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on)) < 0 ||
+      bind(serverFd, (struct sockaddr *)&local, sizeof(local)) < 0 ||
+      listen(serverFd, MAX_NET_CLIENTS) < 0 ||
+      fcntl(serverFd, F_SETFL, fcntl(serverFd, F_GETFL, 0) | O_NONBLOCK) < 0 ||
+      setsockopt(udpFd, SOL_SOCKET, SO_BROADCAST, &on, sizeof(on)) < 0)
+  {
+    end();
+    return false;
+  }
+  running = true;
+  return true;
+}
+
+inline void NMEANetCore::end()
+{
+  for (int i = 0; i < MAX_NET_CLIENTS; i++)
+  {
+    if (clients[i].active)
+      disconnect(clients[i]);
+  }
+  udpLength = 0;
+  if (serverFd >= 0)
+    close(serverFd);
+  if (udpFd >= 0)
+    close(udpFd);
+  serverFd = -1;
+  udpFd = -1;
+  running = false;
+}
+
+inline void NMEANetCore::queue(const char *data, size_t len)
+{
+  if (!running || len == 0 || len > NET_BATCH_SIZE)
+    return;
+
+  //*** UDP; send the batch first if this sentence does not fit anymore
+  if (udpLength + len > NET_BATCH_SIZE)
+    flushUDP();
+  memcpy(&udpBatch[udpLength], data, len);
+  udpLength += len;
+
+  //*** TCP; every client gets its own copy to send at its own pace
+  for (int i = 0; i < MAX_NET_CLIENTS; i++)
+  {
+    if (clients[i].active && !clients[i].ring.put(data, len))
+    {
+      evict(clients[i]);
+    }
+  }
+}
+
+inline void NMEANetCore::handle(unsigned long now)
+{
+  if (!running)
+    return;
+
+  acceptClients(now);
+
+  //*** send batches, not every single sentence, to limit the nr of packets
+  if (now - lastFlush < NET_FLUSH_DELAY && udpLength < NET_BATCH_SIZE / 2)
+    return;
+  lastFlush = now;
+
+  flushUDP();
+  for (int i = 0; i < MAX_NET_CLIENTS; i++)
+  {
+    if (clients[i].active)
+      flushClient(clients[i], now);
+  }
+}
+
+inline void NMEANetCore::acceptClients(unsigned long now)
+{
+  int fd = accept(serverFd, NULL, NULL);
+  if (fd < 0)
+    return;
+
+  for (int i = 0; i < MAX_NET_CLIENTS; i++)
+  {
+    if (!clients[i].active)
+    {
+      int on = 1;
+      setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+      fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK);
+      clients[i].fd = fd;
+      clients[i].ring.clear();
+      clients[i].lastProgress = now;
+      clients[i].active = true;
+      return;
+    }
+  }
+  //*** no free slot available
+  close(fd);
+}
+
+inline void NMEANetCore::flushUDP()
+{
+  if (udpLength == 0)
+    return;
+  sendto(udpFd, udpBatch, udpLength, 0, (struct sockaddr *)&broadcast, sizeof(broadcast));
+  udpLength = 0;
+}
+
+inline void NMEANetCore::flushClient(NetClient &nc, unsigned long now)
+{
+  //*** a closed connection reads as 0 bytes; what a client sends is not used
+  char c;
+  int received = recv(nc.fd, &c, 1, MSG_PEEK | MSG_DONTWAIT);
+  if (received == 0 || (received < 0 && errno != EAGAIN && errno != EWOULDBLOCK))
+  {
+    disconnect(nc);
+    return;
+  }
+
+  const char *data;
+  size_t len = nc.ring.peek(&data);
+  if (len == 0)
+  {
+    nc.lastProgress = now;
+    return;
+  }
+  if (len > NET_BATCH_SIZE)
+    len = NET_BATCH_SIZE;
+
+  //*** never wait for a full socket
+  int sent = send(nc.fd, data, len, NET_SEND_FLAGS);
+  if (sent > 0)
+  {
+    nc.ring.consume(sent);
+    nc.lastProgress = now;
+  }
+  else if (sent < 0 && errno != EAGAIN && errno != EWOULDBLOCK)
+  {
+    disconnect(nc);
+  }
+  else if (now - nc.lastProgress > NET_EVICT_TIMEOUT)
+  {
+    evict(nc);
+  }
+}
+
+inline void NMEANetCore::disconnect(NetClient &nc)
+{
+  close(nc.fd);
+  nc.fd = -1;
+  nc.ring.clear();
+  nc.active = false;
+}
+
+inline void NMEANetCore::evict(NetClient &nc)
+{
+  disconnect(nc);
+  evicted++;
+}
+
+inline uint8_t NMEANetCore::getClients()
+{
+  uint8_t n = 0;
+  for (int i = 0; i < MAX_NET_CLIENTS; i++)
+  {
+    if (clients[i].active)
+      n++;
+  }
+  return n;
+}
+
+inline unsigned long NMEANetCore::getEvicted()
+{
+  return evicted;
+}
+
+#endif
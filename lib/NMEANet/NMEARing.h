@@ -0,0 +1,84 @@
+/*
+  Project:  NMEAtor ESP32 - NMEA network library
+  Purpose:  Ring buffer of the sentences waiting for a network client
+*/
+#ifndef NMEA_RING_H
+#define NMEA_RING_H
+
+#include <stddef.h>
+
+#ifndef NET_CLIENT_BUFFER
+#define NET_CLIENT_BUFFER 1024 // ring buffer per TCP client, ~12 sentences
+#endif
+
+/*
+  Purpose:  Helper class buffering NMEA sentences for a network client
+            - A fixed size ring buffer, so no heap is used while running
+            - Only complete sentences are accepted, a sentence never gets split
+              when the buffer is full
+ */
+class NMEARing
+{
+public:
+  NMEARing();
+  bool put(const char *data, size_t len); // add len bytes, returns false if they do not fit
+  size_t peek(const char **data);         // returns the nr of contiguous bytes ready at *data
+  void consume(size_t len);               // remove len bytes after they have been sent
+  size_t getCount();                      // nr of bytes waiting in the buffer
+  void clear();
+
+private:
+  char buffer[NET_CLIENT_BUFFER];
+  size_t head = 0;  // first free position
+  size_t tail = 0;  // first byte to send
+  size_t count = 0; // nr of bytes waiting
+};
+
+inline NMEARing::NMEARing()
+{
+  clear();
+}
+
+inline bool NMEARing::put(const char *data, size_t len)
+{
+  if (len > NET_CLIENT_BUFFER - count)
+    return false;
+  for (size_t i = 0; i < len; i++)
+  {
+    buffer[head] = data[i];
+    head = (head + 1) % NET_CLIENT_BUFFER;
+  }
+  count += len;
+  return true;
+}
+
+inline size_t NMEARing::peek(const char **data)
+{
+  *data = &buffer[tail];
+  if (count == 0)
+    return 0;
+  //*** only up to the end of the array, the rest follows on the next peek
+  return (tail + count > NET_CLIENT_BUFFER) ? NET_CLIENT_BUFFER - tail : count;
+}
+
+inline void NMEARing::consume(size_t len)
+{
+  if (len > count)
+    len = count;
+  tail = (tail + len) % NET_CLIENT_BUFFER;
+  count -= len;
+}
+
+inline size_t NMEARing::getCount()
+{
+  return count;
+}
+
+inline void NMEARing::clear()
+{
+  head = 0;
+  tail = 0;
+  count = 0;
+}
+
+#endif
@@ -6,7 +6,45 @@
   VERSION:  1.0
   Date:     10-10-2020
   Last
-  Update:   30-04-2021 V1.0
+  Update:   18-10-2026 V1.19
+            Listener baudrate and polarity detection when the sync is lost
+            18-10-2026 V1.18
+            Trend graphs of depth, TWS, SOG and battery on a Nextion waveform
+            18-10-2026 V1.17
+            Talker sends earliest deadline first with latency statistics per priority class
+            18-10-2026 V1.16
+            Sentence schema with typed field access; unused fields are not stored
+            18-10-2026 V1.15
+            Static arena build, heap telemetry and RAM per subsystem
+            18-10-2026 V1.14
+            Variation from position and date, HDG and HDT generated from HDM
+            18-10-2026 V1.13
+            Added a raw byte capture of the listener to Serial or SD
+            18-10-2026 V1.12
+            Added a power manager with idle CPU frequency, light sleep and display sleep
+            18-10-2026 V1.11
+            Generated sentences are formatted without String concatenation
+            18-10-2026 V1.10
+            Added anchor watch, depth, battery and data loss alarms
+            18-10-2026 V1.09
+            Added source selection with failover for data from multiple talkers
+            18-10-2026 V1.08
+            Added a trip computer writing a logbook and voyage summaries to SD
+            18-10-2026 V1.07
+            Fixed the fields overflow in the parser; parser self test in TEST mode, native tests and a fuzz target
+            18-10-2026 V1.06
+            Added a supervisor with watchdogs, bounded input and self healing ports
+            18-10-2026 V1.05
+            Faster startup; the NMEA pipeline starts before the display
+            18-10-2026 V1.04
+            Nextion touch events handled in a separate display task
+            18-10-2026 V1.03
+            Settings stored in NVS and changeable on the USB Serial console
+            18-10-2026 V1.02
+            Added an NMEA2000 gateway on the TWAI (CAN) controller
+            18-10-2026 V1.01
+            Added Wi-Fi output with a TCP server and UDP broadcast on port 10110
+            30-04-2021 V1.0
             Released version
             30-04-2021 V0.13
             Tested version for input and output with all parameters to display
@@ -49,6 +87,10 @@
   Serial1 Rx1 (GPIO 18) and Tx1 (GPIO 19) are reserved for the NMEA listener on 4800Bd
   Serial2 Rx2 (GPIO 16) and Tx2 (GPIO17) are reserved for communicating with the Nextion
   GPIO 22 (and 23) are reserved for NMEA talker via SoftSerial on 38400 Bd
+  The Wi-Fi access point YAZZ_NMEA serves the same NMEA data over TCP and UDP on port 10110
+  GPIO 25 (TX) and 26 (RX) are reserved for the CAN transceiver to the NMEA2000 backbone
+  GPIO 13, 14, 27 and 32 are reserved for the SD card on HSPI, since VSPI shares GPIO 18, 19 and 23;
+  not the HSPI default MISO 12 and CS 15, they are strapping pins and a card can stop the boot
   
   Hardware setup:
 
@@ -74,6 +116,24 @@ Wiring Diagram (for ESP32 to Nextion display)
      GND    |  GND 
       3,3V  |   5V
 
+Wiring Diagram (for ESP32 to SD card module)
+  ESP32     | SD card
+    Pin 14  |  SCK
+    Pin 27  |  MISO
+    Pin 13  |  MOSI
+    Pin 32  |  CS
+    GND     |  GND
+      3,3V  |  3V3
+
+Wiring Diagram (for ESP32 to SN65HVD230 CAN transceiver)
+  ESP32     | SN65HVD230 | NMEA2000
+    Pin 25  |  CTX       |
+    Pin 26  |  CRX       |
+            |  CANH      | NET-H (white)
+            |  CANL      | NET-L (blue)
+    GND     |  GND       | NET-C (black)
+      3,3V  |  3V3       |
+
 
 ---------------
 Terms of use:
@@ -107,6 +167,13 @@ Credit:
 //*** it can invert te signal back to its orignal pulse set
 #include <SoftwareSerial.h>
 #include <Nextion.h> //All other Nextion classes come with this libray
+#include <WiFi.h>
+#include <WiFiUdp.h>
+#include <driver/twai.h>   // ESP32 CAN controller for NMEA2000
+#include <Preferences.h>    // settings stored in the NVS flash
+#include <esp_task_wdt.h>   // task watchdog for the supervisor
+#include <esp_sleep.h>      // light sleep between the UART events when idle
+#include <atomic>           // lock-free indexes of the capture ring
 
 /*
    Definitions go here
@@ -116,17 +183,27 @@ Credit:
 // *** be ommitted from the code
 //#define DEBUG 1
 //#define TEST 1
+// *** In the static arena build all pipeline memory is sized at compile time;
+// *** the sentence data uses fixed size text instead of String objects on the heap
+//#define STATIC_ARENA 1
 #define NEXTION_ATTACHED 1 //out comment if no display available
+#define WIFI_ATTACHED 1    //out comment if no Wi-Fi output is wanted
+#define N2K_ATTACHED 1     //out comment if no NMEA2000 backbone is connected
+#define LOGBOOK_ATTACHED 1 //out comment if no trip computer and logbook is wanted
+#define CAPTURE_ATTACHED 1 //out comment if no raw capture of the listener is wanted
 
 #define VESSEL_NAME "YAZZ"
 #define PROGRAM_NAME "NMEAtor ESP32"
-#define PROGRAM_VERSION "1.0"
+#define PROGRAM_VERSION "1.19"
 
 #define SAMPLERATE 115200
 
 #define LISTENER_RATE 4800 // Baudrate for the listner
 #define LISTENER_RX 18     // Serial1 Rx port
 #define LISTENER_TX 19     // Serial1 TX port
+#define LISTENER_BUFFER 512 // Serial1 RX buffer size
+#define LISTENER_RING_SIZE 512 // nr of time stamped bytes waiting for the decoder, a power of 2
+#define LISTENER_INVERT 1  // 1 for an RS-232 level input, a start bit is high on the pin
 #define TALKER_RATE 38400  // Baudrate for the talker
 #define TALKER_PORT 23     // SoftSerial port 2
 
@@ -136,10 +213,58 @@ Credit:
 #define NEXTION_TX (int8_t)17
 #define NEXTION_RCV_DELAY 100
 #define NEXTION_SND_DELAY 50
+
+//*** Wi-Fi settings for the NMEA network output
+//*** Navigation apps like TZ iBoat connect to the access point and
+//*** either listen for UDP broadcasts or connect to the TCP server
+#define WIFI_SSID VESSEL_NAME "_NMEA"
+#define WIFI_PASSWORD "yazz2021" // min. 8 characters for WPA2
+#define NMEA_NET_PORT 10110      // IANA registered port for NMEA0183 over IP
+#define MAX_NET_CLIENTS 4        // max nr of simultaneous TCP clients
+#define NET_CLIENT_BUFFER 1024   // ring buffer per TCP client, ~12 sentences
+#define NET_BATCH_SIZE 512       // max nr of bytes per UDP packet or TCP write
+#define NET_FLUSH_DELAY 20       // ms to collect sentences before sending a batch
+#define NET_EVICT_TIMEOUT 5000   // ms a client may stall before it is dropped
+
+//*** NMEA2000 settings
+#define N2K_TX GPIO_NUM_25       // CAN TX to the transceiver
+#define N2K_RX GPIO_NUM_26       // CAN RX from the transceiver
+#define N2K_SOURCE_ADDRESS 35    // preferred source address on the bus
+#define N2K_MANUFACTURER 2046    // manufacturer code, 2046 is for own builds
+#define N2K_FRAME_QUEUE 32       // nr of CAN frames waiting to be sent
+#define N2K_MAX_DATA 32          // max nr of data bytes in a PGN we send
+#define N2K_VALUES 7             // nr of values kept for the PGNs
+#define N2K_DATA_TIMEOUT 5000    // ms after which a value is too old to send
+
+//*** Trip computer and logbook settings
+#define SD_SCK 14
+#define SD_MISO 27 // GPIO 12 is a strapping pin, a card pulling it high sets the flash to 1.8 V
+#define SD_MOSI 13
+#define SD_CS 32   // GPIO 15 is a strapping pin as well
+#define LOGBOOK_FILE "/logbook.csv"
+#define VOYAGE_FILE "/voyages.csv"
+#define LOGBOOK_INTERVAL 600000UL // ms between two logbook records
+#define LOGBOOK_LINE_SIZE 200
+#define LOGBOOK_QUEUE 4           // nr of lines waiting for the SD card
+#define LOGBOOK_TASK_STACK 4096
+#define VOYAGE_START_SOG 1.0      // kn, above this we are underway
+#define VOYAGE_END_DELAY 1800000UL // ms below VOYAGE_START_SOG before the voyage ends
+#define MIN_POSITION_CHANGE 0.005 // nm, smaller changes are GPS jitter
+#define MAX_POSITION_JUMP 5.0     // nm, larger changes between two fixes are invalid
 //*** Some conversion factors
+//*** Raw capture of the listener; the SD card is shared with the logbook
+#define CAPTURE_FILE "/capture.bin"
+#define CAPTURE_MAGIC "NMEACAP2"     // start of a capture stream or file
+#define CAPTURE_RING_SIZE 2048       // nr of records, a power of 2; ~4 s at 4800 Bd
+#define CAPTURE_FRAME_RECORDS 64     // max nr of records in a frame written to Serial or SD at once
+#define CAPTURE_TASK_STACK 4096
+#define CAPTURE_TASK_DELAY 5         // ms between two runs of the capture task
+#define CAPTURE_SYNC_INTERVAL 1000   // ms between two flushes of the capture file
+
 #define FTM 0.3048    // feet to meters
 #define MTF 3.28084   // meters to feet
 #define NTK 1.852     // nautical mile to km
+#define EARTH_RADIUS_NM 3440.065 // mean earth radius in nautical miles
 #define KTN 0.5399569 // km to nautical mile
 
 //*** The NMEA defines in totl 82 characters including the starting
@@ -153,11 +278,76 @@ Credit:
 //*** The number is based on the largest sentence MDA,
 //***  the Meteorological Composite sentence
 #define MAX_NMEA_FIELDS 21
+#define FIELD_SIZE 16 // chars per field incl. '\0' in the STATIC_ARENA build; longer is cut off
 
 #define STACKSIZE 10 // Size of the stack; adjust according use
 
+//*** Talker scheduling; the deadline per priority class is the time from parsing a
+//*** sentence up to its last byte sent by the talker
+#define LATENCY_SLO 1            // 1 to send earliest deadline first, 0 in stack order
+#define DEADLINE_CONTROL 50      // ms, heading, wind and rudder data for the autopilot; above the
+                                 // 21 ms of an 82 byte sentence at 38400 Bd plus a loop
+#define DEADLINE_NAVIGATION 250  // ms, position, speed, depth and alarms
+#define DEADLINE_BACKGROUND 2000 // ms, satellites, AIS and all other sentences
+
+//*** Source selection when the same data comes from more than one talker
+//*** the talker IDs in order of preference, 2 chars each
+#define PREFERRED_TALKERS "GPGNIIWISDHC"
+#define SOURCE_TABLE_SIZE 32       // max nr of sentence ID and talker combinations
+#define SOURCE_STALE_TIMEOUT 5000  // ms without data before a source is stale
+
+//*** Alarm defaults; the limits can be changed on the console, 0 disables an alarm
+#define ALARM_ANCHOR_RADIUS 50     // m from the anchor position
+#define ALARM_SHALLOW_DEPTH 2.5    // m below the transducer
+#define ALARM_DEEP_DEPTH 0         // m below the transducer
+#define ALARM_BATTERY_LOW 11.8     // Volts
+#define ANCHOR_HYSTERESIS 0.1      // part of the anchor radius
+#define DEPTH_HYSTERESIS 0.3       // m
+#define BATTERY_HYSTERESIS 0.3     // Volts
+#define ALARM_REPEAT_INTERVAL 30000 // ms between repeats of an active alarm
+#define NEXTION_ALARM "alarm"      // text component on every page for the alarms
+
+//*** Supervisor settings to keep the box running unattended
+#define WDT_TIMEOUT 15                // s before the task watchdog restarts the ESP32
+#define SUPERVISOR_INTERVAL 1000      // ms between two supervisor checks
+#define LISTENER_SILENCE_TIMEOUT 10000 // ms without input before the listener is restarted
+
+//*** Listener auto detection of the baudrate and the polarity when the sync is lost
+#define LISTENER_AUTO 1            // 1 to detect the baudrate and polarity, 0 to keep the settings
+#define LISTENER_SYNC_WINDOW 2000  // ms, the window the sync is checked in
+#define LISTENER_SYNC_BYTES 100    // bytes in a window without a sentence means no sync
+#define LISTENER_SYNC_ERRORS 10    // UART errors in a window without a sentence means no sync
+#define DETECT_EDGES 512           // line edges sampled per detection window
+#define DETECT_WINDOW 1000         // ms max per detection window
+#define DETECT_ATTEMPTS 3          // windows before falling back to the settings
+#define DETECT_MIN_FRAMES 20       // frames needed for a lock
+#define DETECT_MIN_SCORE 90        // % good frames needed for a lock
+#define DETECT_ALIGNMENTS 10       // first falling edges tried as the first start bit
+#define DETECT_MIN_PULSE 30        // % of a bit, a shorter pulse is noise
+#define DETECT_PULSE_PERCENTILE 10 // % of the pulses below the estimate of a single bit
+#define TALKER_STALL_TIMEOUT 5000     // ms the stack may stay full before the talker is restarted
+#define DISPLAY_PROBE_INTERVAL 5000   // ms between two sendme probes to the Nextion
+#define DISPLAY_STALL_TIMEOUT 15000   // ms without a Nextion reply before it is re-initialized
+#define PIPELINE_RAM_BUDGET 8192      // B for the stack and the parser in the STATIC_ARENA build
+//*** Power manager
+#define CPU_FREQ_ACTIVE 240           // MHz while sentences come in
+#define CPU_FREQ_IDLE 80              // MHz when idle; the lowest keeping the 80 MHz APB clock of the UARTs
+#define POWER_IDLE_TIMEOUT 5000       // ms without a sentence before going idle
+#define POWER_SLEEP_TIME 100          // ms max per light sleep
+#define POWER_LOW_LIMIT 12.0          // V, below this the reduced output mode is used
+#define POWER_HYSTERESIS 0.3          // V
+#define LIGHT_SLEEP 0                 // 1 to light sleep when idle
+#define DISPLAY_DIM_TIMEOUT 60        // s without a touch before the display is dimmed
+#define DISPLAY_SLEEP_TIMEOUT 900     // s without a touch before the display sleeps
+
 #define TALKER_ID "AO"
-#define VARIATION "1.57,E" //Varition in Lemmer on 12-05-2020, change 0.11 per year
+#define VARIATION "1.57,E" //Varition in Lemmer on 12-05-2020, change 0.11 per year; setting home_variation
+#define VARIATION_YEAR 2020.36  // date of VARIATION as a decimal year
+#define HOME_LAT 52.853         // position of VARIATION
+#define HOME_LON 5.710
+#define VARIATION_DISTANCE 10.0 // nm the position moves before the variation is calculated again
+#define WMM_EPOCH 2020.0        // epoch of the model coefficients
+#define WMM_DEGREE 6            // highest degree and order of the model coefficients
 //*** On my boat there is an ofsett of 0.2V between the battery monitor and what
 //*** is measured by the Robertson Databox
 #define BATTERY_OFFSET 0.2 //Volts
@@ -237,6 +427,8 @@ Credit:
    If there is some special treatment needed for some NMEA sentences then
    add the their definitions to the NMEA_SPECIALTY definition
    The pre-compiler concatenates string literals by using "" in between
+   NOTE: the generated tags below use the talker ID from the settings,
+   the parser gets it from the settings too
 */
 #define NMEA_SPECIALTY "" _DBK "" _TOB
 
@@ -246,17 +438,64 @@ Credit:
 #define WINDDISPLAY_NMEA "speed.nmea"
 #define FIELD_BUFFER 10 //nr of char used for displaying info on Nextion
 
-//*** A structure to hold the NMEA data
-typedef struct
-{
-  String fields[MAX_NMEA_FIELDS];
-  byte nrOfFields = 0;
-  String sentence = "";
+//*** Nextion pages and the ids of the components sending a touch event
+//*** NOTE: the HMI switches pages and dims by itself; the touch events
+//***       keep the firmware informed, so check "Send Component ID"
+#define PAGE_SPLASH 0
+#define PAGE_SPEED 1
+#define PAGE_COURSE 2
+#define PAGE_TRIP 3
+#define PAGE_SETTINGS 4
+#define PAGE_TREND 5
+#define BTN_HOME 20
+#define BTN_SPEED 21
+#define BTN_COURSE 22
+#define BTN_TRIP 23
+#define BTN_SETTINGS 24
+#define BTN_DIMUP 25
+#define BTN_DIMDOWN 26
+#define BTN_RESET 27
+#define BTN_MOB 28
+#define BTN_TREND 29
+#define BTN_TREND_RES 30 // next resolution on the trend page
+#define DIM_STEP 20 // same step as the dim buttons in the HMI
+#define DIM_MIN 10
+
+#define NEXTION_EVENT_QUEUE 8  // nr of touch events waiting to be handled
+#define NEXTION_RX_BUFFER 16   // longest Nextion return message we handle
+#define NEXTION_CMD_BUFFER 300 // longest command we send to the Nextion
+#define DISPLAY_TASK_STACK 4096
+#define DISPLAY_TASK_DELAY 10 // ms between two runs of the display task
+#define SPLASH_DELAY 5000      // ms the splash screen is shown
+#define NEXTION_RESET_DELAY 3000 // ms for the Nextion to restart after a reset
 
-} NMEAData;
+//*** Trend graphs; the waveform on the trend page has a channel per instrument
+#define NEXTION_TREND_ID 2            // component id of the waveform
+#define NEXTION_TREND_RES "trendres"  // text component showing the resolution
+#define TREND_POINTS 240              // points per resolution, the width of the waveform
+#define TREND_HEIGHT 200              // height of the waveform, the value of a full scale point
+#define TREND_SAMPLE_INTERVAL 1000    // ms, the highest resolution
+#define TREND_ADD_LIMIT 4             // new points sent one by one with add, more at once with addt
+#define NEXTION_ADDT_TIMEOUT 100      // ms for the Nextion to get ready for the addt data
+
+//*** The NMEA0183, network, NMEA2000 and listener libraries in lib/; they take the definitions above
+#include <NMEAData.h>
+#include <NMEAFormatter.h>
+#include <NMEAParser.h>
+#include <NMEADecoder.h>
+#ifdef WIFI_ATTACHED
+#include <NMEANetCore.h>
+#endif
+#ifdef N2K_ATTACHED
+#include <NMEAN2KCore.h>
+#endif
+#include <NMEADetector.h>
+#ifdef TEST
+#include <NMEACorpus.h>
+#include <NMEAListenerCorpus.h>
+#endif
 
 // Declare buffers for NMEA string and display parameters
-char nmeaBuffer[NMEA_BUFFER_SIZE + 1] = {0};
 char nb_AWA[FIELD_BUFFER] = {0};
 char nb_COG[FIELD_BUFFER] = {0};
 char nb_SOG[FIELD_BUFFER] = {0};
@@ -271,32 +510,62 @@ char nb_LOG[FIELD_BUFFER] = {0};
 char nb_MTW[FIELD_BUFFER] = {0};
 char nb_TRP[FIELD_BUFFER] = {0};
 char oldVal[255] = {0}; // holds previos _BITVALUE to check if we need to send
+char lastPosition[32] = {0}; // lat,N/S,lon,E/W of the last RMC or GLL sentence
+
+//*** the nb_ buffers are written by the data path and read by the display task
+portMUX_TYPE displayMux = portMUX_INITIALIZER_UNLOCKED;
 
-enum NMEAReceiveStatus
+//*** Nextion return codes and events
+#define NEX_RET_TOUCH 0x65
+#define NEX_RET_PAGE 0x66
+#define NEX_RET_WAKE 0x87 // the Nextion woke up from sleep by a touch
+#define NEX_RET_TRANSPARENT_READY 0xFE // ready for the data of an addt command
+#define NEX_RELEASE 0x00
+
+enum NextionEventType
 {
-  INVALID,
-  VALID,
-  RECEIVING,
-  CHECKSUMMING,
-  TERMINATING,
-  NMEA_READY
+  NEX_NONE,
+  NEX_TOUCH,
+  NEX_PAGE,
+  NEX_ALARM, // from the alarm engine; component is the alarm, pressed is on/off
+  NEX_WAKE
 };
-byte nmeaStatus = INVALID;
-byte nmeaIndex = 0;
-bool nmeaDataReady = false;
+
+typedef struct
+{
+  byte type;
+  byte page;
+  byte component;
+  byte pressed;
+} NextionEvent;
+
+QueueHandle_t nextionEvents;
+TaskHandle_t displayTaskHandle = NULL;
+byte nextionBuffer[NEXTION_RX_BUFFER] = {0};
+byte nextionIndex = 0;
+byte nextionTerminator = 0; // nr of 0xFF received in a row
+volatile byte activePage = PAGE_SPLASH;
+volatile int dimLevel = 100;
+volatile float tripTotal = 0;  // trip distance as received
+volatile float tripOffset = 0; // trip distance at the last reset
+volatile bool mobRequested = false;
+volatile unsigned long lastTouch = 0; // ms, last touch on the Nextion or alarm shown
+bool nextionTransparentReady = false;  // the Nextion waits for the addt data, display task only
+
 bool newData = false;
 unsigned long tmr1 = 0;
+unsigned long pipelineReadyTime = 0;  // ms after boot the listener and talker were up
+unsigned long firstSentenceTime = 0;  // ms after boot the first sentence was forwarded
 
 //*** Global scope variable declaration goes here
 NexPicture dispStatus = NexPicture(1, 35, WINDDISPLAY_STATUS);
-NexText nmeaTxt = NexText(1, 16, WINDDISPLAY_NMEA);
-NexText versionTxt = NexText(0, 3, "version");
 
 SoftwareSerial nmeaSerialOut; // // signal need to be inverted for RS-232
+SPIClass logbookSPI(HSPI);    // for the SD card; VSPI pins are in use by the listener and talker
 
 #define WHITE 0xFFFF /* 255, 255, 255 */
 #define BLACK 0x0000 /*   0,   0,   0 */
-int16_t current_color;
+#define GREY 0x8410  /* 128, 128, 128 */
 
 // ----- software timer
 unsigned long Timer2 = 1000000; //500000L;                         // 500mS loop ... used when sending data to to Processing
@@ -324,6 +593,13 @@ boolean isNumeric(char *value)
   }
   return result;
 }
+
+/*** function check if a display value is a number and not a placeholder like --.-
+*/
+boolean hasValue(char *value)
+{
+  return isNumeric(value) && strpbrk(value, "0123456789") != NULL;
+}
 //*** ISR to set listerDataReady flag
 void listenerReady()
 {
@@ -345,742 +621,4376 @@ void debugWrite(String debugMsg)
 }
 
 /*
-   Class definitions go here
+  Runtime configuration
+  The #defines above are the factory defaults. At startup the settings stored in the
+  NVS flash are loaded once into the config struct, so the hot paths just read a field.
+  Settings are changed on the USB Serial console with the set command and stored with save.
 */
+#define CONFIG_NAMESPACE "nmeator" // NVS namespace for the settings
+#define SPECIALTY_SIZE 32          // max nr of chars for the specialty filter
 
-/*
-  Purpose:  Helper class stacking NMEA data as a part of the multiplexer application
-            - Pushin and popping NMEAData structure on the stack for buffer purposes
- */
-class NMEAStack
+typedef struct
 {
-public:
-  NMEAStack();              // Constructor with the size of the stack
-  int push(NMEAData _nmea); // put an NMEAData struct on the stack and returns the lastIndex or -1
-  NMEAData pop();           // get an NMEAData struct from the stack and decreases the lastIndex
-  int getIndex();           // returns the position of the next free postion in the stack
+  unsigned long listenerRate;       // baudrate of the listener
+  unsigned long listenerInvert;     // 1 for an inverted listener input
+  unsigned long listenerAuto;       // 1 to detect the listener baudrate and polarity
+  unsigned long talkerRate;         // baudrate of the talker
+  float homeVariation;              // degrees at HOME_LAT/HOME_LON on VARIATION_YEAR, positive for East
+  float batteryOffset;              // Volts
+  char talkerId[3];                 // talker ID for generated sentences
+  char specialty[SPECIALTY_SIZE];   // tags which need a special treatment
+  unsigned long nextionSndDelay;    // ms between two updates of the display
+  unsigned long stackSize;          // nr of stack entries used, max. STACKSIZE
+  float anchorRadius;               // m, anchor watch radius
+  float shallowAlarm;               // m, shallow water limit
+  float deepAlarm;                  // m, deep water limit
+  float batteryLow;                 // V, low battery limit
+  float powerLow;                   // V, reduced output mode below this voltage
+  unsigned long lightSleep;         // 1 to light sleep when idle
+  unsigned long displayDim;         // s without a touch before dimming the display, 0 never
+  unsigned long displaySleep;       // s without a touch before the display sleeps, 0 never
+  unsigned long latencySlo;         // 1 to send earliest deadline first, 0 in stack order
+  unsigned long deadlines[3];       // ms per talker priority class
+} NMEAConfig;
 
-private:
-  NMEAData stack[STACKSIZE]; // the array containg the structs
-  int lastIndex = 0;         // an index pointng to the first free psotiion in the stack
+NMEAConfig config;
+
+//*** what needs to be re-initialized after a setting is changed
+#define APPLY_NONE 0
+#define APPLY_LISTENER 1
+#define APPLY_TALKER 2
+
+enum ConfigType
+{
+  CFG_ULONG,
+  CFG_FLOAT,
+  CFG_TEXT
 };
 
-NMEAStack::NMEAStack()
+//*** description of a setting, used to load, store and change it by name
+typedef struct
 {
-  this->lastIndex = 0;
-  for (int i = 0; i < STACKSIZE; i++)
+  const char *key; // name in the NVS and on the console; max 15 chars
+  ConfigType type;
+  void *value;     // pointer in the config struct
+  size_t size;     // buffer size for CFG_TEXT
+  float min;       // range check for numbers
+  float max;
+  byte apply;      // APPLY_* flags
+} ConfigItem;
+
+const ConfigItem configItems[] = {
+    {"listener_rate", CFG_ULONG, &config.listenerRate, 0, 300, 115200, APPLY_LISTENER},
+    {"listener_invert", CFG_ULONG, &config.listenerInvert, 0, 0, 1, APPLY_LISTENER},
+    {"listener_auto", CFG_ULONG, &config.listenerAuto, 0, 0, 1, APPLY_NONE},
+    {"talker_rate", CFG_ULONG, &config.talkerRate, 0, 300, 115200, APPLY_TALKER},
+    {"home_variation", CFG_FLOAT, &config.homeVariation, 0, -180, 180, APPLY_NONE},
+    {"battery_offset", CFG_FLOAT, &config.batteryOffset, 0, -5, 5, APPLY_NONE},
+    {"talker_id", CFG_TEXT, config.talkerId, sizeof(config.talkerId), 0, 0, APPLY_NONE},
+    {"specialty", CFG_TEXT, config.specialty, sizeof(config.specialty), 0, 0, APPLY_NONE},
+    {"nextion_delay", CFG_ULONG, &config.nextionSndDelay, 0, 0, 10000, APPLY_NONE},
+    {"stack_size", CFG_ULONG, &config.stackSize, 0, 1, STACKSIZE, APPLY_NONE},
+    {"anchor_radius", CFG_FLOAT, &config.anchorRadius, 0, 0, 5000, APPLY_NONE},
+    {"shallow_alarm", CFG_FLOAT, &config.shallowAlarm, 0, 0, 100, APPLY_NONE},
+    {"deep_alarm", CFG_FLOAT, &config.deepAlarm, 0, 0, 1000, APPLY_NONE},
+    {"battery_low", CFG_FLOAT, &config.batteryLow, 0, 0, 30, APPLY_NONE},
+    {"power_low", CFG_FLOAT, &config.powerLow, 0, 0, 30, APPLY_NONE},
+    {"light_sleep", CFG_ULONG, &config.lightSleep, 0, 0, 1, APPLY_NONE},
+    {"display_dim", CFG_ULONG, &config.displayDim, 0, 0, 86400, APPLY_NONE},
+    {"display_sleep", CFG_ULONG, &config.displaySleep, 0, 0, 86400, APPLY_NONE},
+    {"latency_slo", CFG_ULONG, &config.latencySlo, 0, 0, 1, APPLY_NONE},
+    {"deadline_ctrl", CFG_ULONG, &config.deadlines[0], 0, 1, 60000, APPLY_NONE},
+    {"deadline_nav", CFG_ULONG, &config.deadlines[1], 0, 1, 60000, APPLY_NONE},
+    {"deadline_bg", CFG_ULONG, &config.deadlines[2], 0, 1, 60000, APPLY_NONE}};
+
+#define NR_OF_CONFIG_ITEMS (sizeof(configItems) / sizeof(configItems[0]))
+
+Preferences preferences;
+
+/*
+  Fill the config struct with the compiled in defaults
+*/
+void defaultConfig()
+{
+  config.listenerRate = LISTENER_RATE;
+  config.listenerInvert = LISTENER_INVERT;
+  config.listenerAuto = LISTENER_AUTO;
+  config.talkerRate = TALKER_RATE;
+  //*** VARIATION is formatted like in NMEA i.e. "1.57,E"
+  config.homeVariation = atof(VARIATION);
+  if (strchr(VARIATION, 'W') != NULL)
+    config.homeVariation = -config.homeVariation;
+  config.batteryOffset = BATTERY_OFFSET;
+  strncpy(config.talkerId, TALKER_ID, sizeof(config.talkerId) - 1);
+  config.talkerId[sizeof(config.talkerId) - 1] = '\0';
+  strncpy(config.specialty, NMEA_SPECIALTY, sizeof(config.specialty) - 1);
+  config.specialty[sizeof(config.specialty) - 1] = '\0';
+  config.nextionSndDelay = NEXTION_SND_DELAY;
+  config.stackSize = STACKSIZE;
+  config.anchorRadius = ALARM_ANCHOR_RADIUS;
+  config.shallowAlarm = ALARM_SHALLOW_DEPTH;
+  config.deepAlarm = ALARM_DEEP_DEPTH;
+  config.batteryLow = ALARM_BATTERY_LOW;
+  config.powerLow = POWER_LOW_LIMIT;
+  config.lightSleep = LIGHT_SLEEP;
+  config.displayDim = DISPLAY_DIM_TIMEOUT;
+  config.displaySleep = DISPLAY_SLEEP_TIMEOUT;
+  config.latencySlo = LATENCY_SLO;
+  config.deadlines[0] = DEADLINE_CONTROL;
+  config.deadlines[1] = DEADLINE_NAVIGATION;
+  config.deadlines[2] = DEADLINE_BACKGROUND;
+}
+
+/*
+  Load the config from NVS; settings never saved keep their default
+*/
+void loadConfig()
+{
+  defaultConfig();
+  preferences.begin(CONFIG_NAMESPACE, true);
+  for (unsigned int i = 0; i < NR_OF_CONFIG_ITEMS; i++)
   {
-    for (int j = 0; j < MAX_NMEA_FIELDS; j++)
+    const ConfigItem &item = configItems[i];
+    if (!preferences.isKey(item.key))
+      continue;
+    switch (item.type)
     {
-      stack[i].fields[j] = "";
+    case CFG_ULONG:
+      *(unsigned long *)item.value = preferences.getULong(item.key, *(unsigned long *)item.value);
+      break;
+    case CFG_FLOAT:
+      *(float *)item.value = preferences.getFloat(item.key, *(float *)item.value);
+      break;
+    case CFG_TEXT:
+      preferences.getString(item.key, (char *)item.value, item.size);
+      break;
     }
-    stack[i].nrOfFields = 0;
-    stack[i].sentence = "";
   }
+  preferences.end();
 }
 
-int NMEAStack::push(NMEAData _nmea)
+/*
+  Store the current config in NVS
+*/
+void saveConfig()
 {
-#ifdef DEBUG
-  debugWrite("Pushing on index:" + String(this->lastIndex));
-#endif
-  if (this->lastIndex < STACKSIZE)
-  {
-    stack[this->lastIndex++] = _nmea;
-    return this->lastIndex;
-  }
-  else
+  preferences.begin(CONFIG_NAMESPACE, false);
+  for (unsigned int i = 0; i < NR_OF_CONFIG_ITEMS; i++)
   {
-    this->lastIndex = STACKSIZE;
-    return -1; // of stack is full
+    const ConfigItem &item = configItems[i];
+    switch (item.type)
+    {
+    case CFG_ULONG:
+      preferences.putULong(item.key, *(unsigned long *)item.value);
+      break;
+    case CFG_FLOAT:
+      preferences.putFloat(item.key, *(float *)item.value);
+      break;
+    case CFG_TEXT:
+      preferences.putString(item.key, (char *)item.value);
+      break;
+    }
   }
+  preferences.end();
 }
 
-NMEAData NMEAStack::pop()
+/*
+  Remove all stored settings so the defaults are used again
+*/
+void clearConfig()
 {
-  NMEAData nmeaOut;
-  nmeaOut.sentence = "";
-  if (this->lastIndex > 0)
-  {
-    this->lastIndex--;
-    nmeaOut = stack[this->lastIndex];
-  }
-#ifdef DEBUG
-  debugWrite("Popped from index: " + String(lastIndex));
-#endif
-
-  return nmeaOut;
+  preferences.begin(CONFIG_NAMESPACE, false);
+  preferences.clear();
+  preferences.end();
+  defaultConfig();
 }
 
-int NMEAStack::getIndex()
+/*
+  Health status of the NMEA pipeline, maintained by the supervisor
+  and shown with the status command on the console
+*/
+typedef struct
 {
-  return this->lastIndex;
-}
+  unsigned long stackOverflows = 0; // sentences lost on a full stack
+  volatile unsigned long uartErrors = 0; // listener UART overruns and framing errors
+  unsigned long listenerResets = 0;
+  unsigned long talkerResets = 0;
+  unsigned long displayResets = 0;
+  unsigned long lastByteTime = 0;          // ms, last byte received by the listener
+  unsigned long listenerBytes = 0;         // bytes received by the listener
+  volatile unsigned long lastNextionReply = 0; // ms, last message received from the Nextion
+  uint32_t minLargestBlock = UINT32_MAX;       // B, smallest largest free heap block seen
+  byte maxFragmentation = 0;                   // %, highest heap fragmentation seen
+} PipelineHealth;
+
+PipelineHealth health;
+volatile bool displayResetRequested = false;
+unsigned long lastSupervision = 0;
+unsigned long stackFullSince = 0;
 
 /*
-    Purpose:  An NMEA0183 parser to convert old to new version NMEA sentences
-            - Reading NMEA0183 v1.5 data without a checksum,
-            - Filtering out current heading data causing incorrect course in fo in navigation app
-              i.e. HDG, HDM and VHW messages
-            
-          
-  NOTE:     NMEA encoding conventions in short
-            An NMEA sentence consists of a start delimiter, followed by a comma-separated sequence
-            of fields, followed by the character '*' (ASCII 42), the checksum and an end-of-line marker.
-            i.e. <start delimiter><field 0>,<field 1>,,,<field n>*<checksum><end-of-linemarker>
-            The start delimiter is either $ or !. <field 0> contains the tag and the remaining fields
-            the values. The tag is normaly a 5 character wide identifier where the 1st 2 characters
-            identify the talker ID and the last 3 identify the sentence ID.
-            Maximum sentence length, including the $ and <CR><LF> is 82 bytes.
+   Class definitions go here
+*/
 
-  Source: https://gpsd.gitlab.io/gpsd/NMEA.html#_nmea_0183_physical_protocol_layer
-  */
-class NMEAParser
+/*
+  Great circle distance in nautical miles between two positions in degrees
+*/
+double distanceNM(double lat1, double lon1, double lat2, double lon2)
 {
-public:
-  NMEAParser(NMEAStack *_ptrNMEAStack);
+  double dLat = (lat2 - lat1) * DEG_TO_RAD;
+  double dLon = (lon2 - lon1) * DEG_TO_RAD;
+  double a = sin(dLat / 2) * sin(dLat / 2) +
+             cos(lat1 * DEG_TO_RAD) * cos(lat2 * DEG_TO_RAD) * sin(dLon / 2) * sin(dLon / 2);
+  return 2 * atan2(sqrt(a), sqrt(1 - a)) * EARTH_RADIUS_NM;
+}
 
-  void parseNMEASentence(String nmeaIn); // parse an NMEA sentence with each part stored in the array
+/*
+  Purpose:  Source selection when the same data arrives from more than one talker
+            - Per sentence ID and talker the last seen time and the validity are tracked
+            - Per sentence ID one source is selected; the most preferred live and valid one
+            - When the selected source goes stale the next live source takes over
+            - Sentences from the other sources are suppressed as duplicates
+            The table is fixed in size; when it is full new sources are passed unfiltered.
+ */
+typedef struct
+{
+  char sentenceId[4]; // i.e. RMC
+  char talker[3];     // i.e. GP
+  byte rank;          // position in PREFERRED_TALKERS, lower is better
+  bool valid;         // last sentence had valid data
+  bool selected;      // this source is forwarded
+  unsigned long lastSeen;
+  unsigned long count; // nr of sentences received
+} SourceEntry;
 
-  unsigned long getCounter(); //return nr of sentences parsed since switched on
+class SourceSelector
+{
+public:
+  SourceSelector();
+  bool accept(NMEAData &nmea);         // returns true if the sentence is to be forwarded
+  bool isStale(const char *sentenceId); // true if the selected source has gone stale
+  unsigned long getSuppressed();
+  unsigned long getFailovers();
+  void print();                        // show the sources on the console
 
 private:
-  NMEAStack *ptrNMEAStack;
-  String NMEAFilter = NMEA_SPECIALTY;
-  NMEAData nmeaData; // self explaining
-  String nmeaSentence = "";
-  void reset();                            // clears the nmeaData struct;
-  String checksum(String str);             //calculate the checksum for str
-  NMEAData nmeaSpecialty(NMEAData nmeaIn); // special treatment function
-  unsigned long counter = 0;
+  SourceEntry table[SOURCE_TABLE_SIZE];
+  byte entries = 0;
+  unsigned long suppressed = 0;
+  unsigned long failovers = 0;
+  SourceEntry *find(const char *sentenceId, const char *talker);
+  SourceEntry *findSelected(const char *sentenceId);
+  bool isLive(SourceEntry *entry, unsigned long now);
+  bool isValid(NMEAData &nmea);
+  byte getRank(const char *talker);
 };
 
-// ***
-// *** NMEAParser Constructor
-// *** input parameters:
-// *** reference to the debugger object
-NMEAParser::NMEAParser(NMEAStack *_ptrNMEAStack)
-    : ptrNMEAStack(_ptrNMEAStack)
+SourceSelector::SourceSelector()
 {
-  //*** initialize the NMEAData struct.
-  reset();
 }
 
-/*
- * Clear the nmeaData attribute
- */
-void NMEAParser::reset()
+SourceEntry *SourceSelector::find(const char *sentenceId, const char *talker)
 {
-  nmeaData.nrOfFields = 0;
-  nmeaData.sentence = "";
-  for (int i = 0; i < MAX_NMEA_FIELDS; i++)
+  for (byte i = 0; i < entries; i++)
   {
-    nmeaData.fields[i] = "";
+    if (strncmp(table[i].sentenceId, sentenceId, 3) == 0 && strncmp(table[i].talker, talker, 2) == 0)
+      return &table[i];
   }
-  current_color = WHITE;
+  if (entries >= SOURCE_TABLE_SIZE)
+    return NULL;
+
+  SourceEntry *entry = &table[entries++];
+  memcpy(entry->sentenceId, sentenceId, 3);
+  entry->sentenceId[3] = '\0';
+  memcpy(entry->talker, talker, 2);
+  entry->talker[2] = '\0';
+  entry->rank = getRank(talker);
+  entry->valid = false;
+  entry->selected = false;
+  entry->lastSeen = 0;
+  entry->count = 0;
+  return entry;
 }
 
-/*
+SourceEntry *SourceSelector::findSelected(const char *sentenceId)
+{
+  for (byte i = 0; i < entries; i++)
+  {
+    if (table[i].selected && strncmp(table[i].sentenceId, sentenceId, 3) == 0)
+      return &table[i];
+  }
+  return NULL;
+}
+
+bool SourceSelector::isLive(SourceEntry *entry, unsigned long now)
+{
+  return entry->lastSeen > 0 && now - entry->lastSeen <= SOURCE_STALE_TIMEOUT;
+}
 
+/*
+  Only the position sentences carry a status field; A is valid, V is not
 */
-NMEAData NMEAParser::nmeaSpecialty(NMEAData nmeaIn)
+bool SourceSelector::isValid(NMEAData &nmea)
 {
-  String filter = NMEA_SPECIALTY;
+  if (nmea.type == NMEA_RMC && nmeaChar<RMC_STATUS>(nmea) == 'A')
+    return nmeaChar<RMC_STATUS>(nmea) == 'A';
+  if (nmea.type == NMEA_GLL)
+    return nmeaChar<GLL_STATUS>(nmea) == 'A';
+  return true;
+}
 
-  NMEAData nmeaOut; //= nmeaIn;
-#ifdef DEBUG
-  debugWrite(" Specialty found... for filter" + filter);
-#endif
-  if (filter.indexOf(nmeaIn.fields[0]) > -1)
+byte SourceSelector::getRank(const char *talker)
+{
+  const char *preferred = PREFERRED_TALKERS;
+  for (byte rank = 0; preferred[rank * 2] != '\0'; rank++)
   {
-    /* In my on-board Robertson data network some sentences
-       are not NMEA0183 compliant. So these sentences need
-       to be converted to compliant sentences
-    */
-    //*** $IIDBK is not NMEA0183 compliant and needs conversion
-    //*** Since DBK/DBS sentences are obsolete DPT is used
-    if (nmeaIn.fields[0] == _DBK)
-    {
-#ifdef DEBUG
-      debugWrite("Found " + String(_DBK));
-#endif
-      // a typical non standard DBK message I receive is
-      // $IIDBK,A,0017.6,f,,,,
-      // Char A can also be a V if invalid and shoul be removed
-      // All fields after the tag shift 1 position to the left
-      // Since we modify the sentence we'll also put our talker ID in place
+    if (strncmp(&preferred[rank * 2], talker, 2) == 0)
+      return rank;
+  }
+  return 0xFF; // unknown talkers come last
+}
 
-      //*** below code is for DPT since TZ iBoat does not use DBT
-      nmeaOut.fields[0] = "$AODPT";
-      if (nmeaIn.fields[3] == "f")
-      {
-        //depth in feet need to be converted
-        float ft = nmeaIn.fields[2].toFloat();
-        nmeaOut.fields[1] = String(ft * FTM, 1);
-      }
-      else
-        nmeaOut.fields[1] = nmeaIn.fields[2];
-      nmeaOut.fields[2] = "0.0";
-      nmeaOut.nrOfFields = 3;
-      for (int i = 0; i < nmeaOut.nrOfFields; i++)
-      {
-#ifdef DEBUG
-        debugWrite("Field[" + String(i) + "] = " + nmeaOut.fields[i]);
-#endif
-        if (i > 0)
-          nmeaOut.sentence += ",";
-        nmeaOut.sentence += nmeaOut.fields[i];
-      }
-      nmeaOut.sentence += checksum(nmeaOut.sentence);
+bool SourceSelector::accept(NMEAData &nmea)
+{
+  //*** only $ttsss sentences are selected, AIS and odd tags pass as they are
+  const char *tag = nmea.fields[0].c_str();
+  if (tag[0] != '$' || nmea.fields[0].length() != 6)
+    return true;
 
-#ifdef DEBUG
-      debugWrite(" Modified to:" + nmeaOut.sentence);
-#endif
-      return nmeaOut;
-    }
+  SourceEntry *entry = find(&tag[3], &tag[1]);
+  if (entry == NULL)
+    return true;
 
-    //*** current Battery info is in a non NMEA0183 format
-    //*** i.e. $PSTOB,13.2,V
-    //*** will be converted to $AOXDR,U,13.2,V,BATT,*CS
-    if (nmeaIn.fields[0] == _TOB)
+  unsigned long now = millis();
+  entry->lastSeen = now;
+  entry->valid = isValid(nmea);
+  entry->count++;
+
+  SourceEntry *current = findSelected(entry->sentenceId);
+  if (current == entry)
+  {
+    if (entry->valid)
+      return true;
+    //*** our selected source became invalid; let another one take over if there is one
+    for (byte i = 0; i < entries; i++)
     {
-      reset();
-      float batt = (nmeaIn.fields[1]).toFloat() + BATTERY_OFFSET;
-      nmeaOut.nrOfFields = 5;
-      nmeaOut.fields[0] = "$AOXDR";
-      nmeaOut.fields[1] = "U";              // the transducer unit
-      nmeaOut.fields[2] = String(batt, 1);  // the actual measurement value
-      nmeaOut.fields[3] = nmeaIn.fields[2]; // unit of measure
-      nmeaOut.fields[3].toUpperCase();
-      nmeaOut.fields[4] = "BATT";
-      for (int i = 0; i < nmeaOut.nrOfFields; i++)
+      if (&table[i] != entry && strcmp(table[i].sentenceId, entry->sentenceId) == 0 &&
+          table[i].valid && isLive(&table[i], now))
       {
-#ifdef DEBUG
-        debugWrite("Field[" + String(i) + "] = " + nmeaOut.fields[i]);
-#endif
-        if (i > 0)
-          nmeaOut.sentence += ",";
-        nmeaOut.sentence += nmeaOut.fields[i];
+        entry->selected = false;
+        table[i].selected = true;
+        failovers++;
+        suppressed++;
+        return false;
       }
-      nmeaOut.sentence += checksum(nmeaOut.sentence);
-      return nmeaOut;
     }
+    return true;
   }
-  return nmeaOut;
-}
 
-// calculate checksum function (thanks to https://mechinations.wordpress.com)
-String NMEAParser::checksum(String str)
-{
-  byte cs = 0;
-  for (unsigned int n = 1; n < str.length(); n++)
+  //*** take over when there is no live selected source, or when we are valid
+  //*** and the selected one is not, or when we are preferred over it
+  bool takeOver = current == NULL || !isLive(current, now) ||
+                  (entry->valid && (!current->valid || entry->rank < current->rank));
+  if (takeOver)
   {
-    if (str[n] != '$' || str[n] != '!' || str[n] != '*')
+    if (current != NULL)
     {
-      cs ^= str[n];
+      current->selected = false;
+      failovers++;
     }
+    entry->selected = true;
+    return true;
   }
+  suppressed++;
+  return false;
+}
 
-  if (cs < 0x10)
-    return "*0" + String(cs, HEX);
-  else
-    return "*" + String(cs, HEX);
+bool SourceSelector::isStale(const char *sentenceId)
+{
+  SourceEntry *current = findSelected(sentenceId);
+  return current != NULL && !isLive(current, millis());
 }
 
-/*
-   parse an NMEA sentence into into an NMEAData structure.
-*/
-void NMEAParser::parseNMEASentence(String nmeaStr)
+unsigned long SourceSelector::getSuppressed()
 {
-  reset();
-  int currentIndex = 0;
-  int lastIndex = -1;
-  int sentenceLength = nmeaStr.length();
+  return suppressed;
+}
 
-//*** check for a valid NMEA sentence
-#ifdef DEBUG
-  debugWrite(" In te loop to parse for " + String(sentenceLength) + " chars");
-#endif
-  if (nmeaStr[0] == '$' || nmeaStr[0] == '!' || nmeaStr[0] == '~')
+unsigned long SourceSelector::getFailovers()
+{
+  return failovers;
+}
+
+void SourceSelector::print()
+{
+  unsigned long now = millis();
+  for (byte i = 0; i < entries; i++)
   {
+    SourceEntry &e = table[i];
+    Serial.printf("%s from %s: %s%s%s, %lu sentences, last %lu ms ago\n", e.sentenceId, e.talker,
+                  e.selected ? "selected" : "standby", e.valid ? "" : ", invalid",
+                  isLive(&e, now) ? "" : ", stale", e.count, now - e.lastSeen);
+  }
+  Serial.printf("Suppressed: %lu, failovers: %lu\n", suppressed, failovers);
+}
 
-    //*** parse the fields from the NMEA string
-    //*** keeping in mind that indeOf() can return -1 if not found!
-    currentIndex = nmeaStr.indexOf(',', 0);
-    while (lastIndex < sentenceLength)
-    {
+SourceSelector Sources;
 
-      //*** remember to sepatrate fields with the ',' character
-      //*** but do not end with one!
-      if (lastIndex > 0)
-        nmeaData.sentence += ',';
+//*** the alarm engine sends through the parser, so it is defined after it
+void evaluateSentence(NMEAData &nmea); // the engines following the parsed sentences
 
-      //*** we want the data without the ',' in fields array
-      if (currentIndex - lastIndex > 1) // check for an empty field
-      {
-        nmeaData.fields[nmeaData.nrOfFields] = nmeaStr.substring(lastIndex + 1, currentIndex);
-        nmeaData.sentence += nmeaData.fields[nmeaData.nrOfFields];
-      }
-      else
-        nmeaData.fields[nmeaData.nrOfFields] = "0";
-      nmeaData.nrOfFields++;
-      lastIndex = currentIndex; // searching from next char of ',' !
-      currentIndex = nmeaStr.indexOf(',', lastIndex + 1);
-      //*** check if we found the last seperator
-      if (currentIndex < 0)
-      {
-        //*** and make sure we parse the last part of the string too!
-        currentIndex = sentenceLength;
-      }
-    }
-    if (NMEAFilter.indexOf(nmeaData.fields[0]) > -1)
-    {
-      nmeaData = nmeaSpecialty(nmeaData);
-    }
-    else if (nmeaData.sentence.indexOf('*') < 1) //Check for checksum in sentence
-    {
-      nmeaData.sentence += checksum(nmeaData.sentence);
-    }
-#ifdef DEBUG
-    debugWrite("Parsed : " + nmeaData.sentence);
-#endif
-    nmeaData.sentence += NMEA_TERMINATOR;
-#ifdef DEBUG
-    debugWrite("Parsed & terminated: " + nmeaData.sentence);
-#endif
-    ptrNMEAStack->push(nmeaData); //push the struct to the stack for later use; i.e. buffer it
-    counter++;                    // for every sentence pushed the counter increments
-  }
+/*
+  Purpose:  Deadline scheduling of the talker for a predictable output latency
+            - Every sentence gets a priority class from its sentence ID, and a deadline;
+              the time it was parsed plus the deadline of its class
+            - The stack hands out the sentence with the earliest deadline first and when
+              it is full a new sentence pushes out the one with the latest deadline,
+              see NMEAStack
+            - Per class the nr of sentences sent, the deadline misses and the latency from
+              parsing up to the last byte written by the talker
+            - The talker load; the time writing against the time passed
+  NOTE:     The talker writes a whole sentence at a time, at 38400 Bd an 82 byte sentence
+            takes 21 ms. So a heading can wait up to that long behind a sentence that
+            is already being written, and the control deadline must be longer than that
+            plus a loop, else every heading counts as a miss.
+*/
+enum TalkerClass
+{
+  TALKER_CONTROL,
+  TALKER_NAVIGATION,
+  TALKER_BACKGROUND,
+  NR_OF_TALKER_CLASSES
+};
 
-  return;
-}
+const char *const talkerClassNames[NR_OF_TALKER_CLASSES] = {"control", "navigation", "background"};
 
-unsigned long NMEAParser::getCounter()
+typedef struct
 {
-  return counter;
-}
+  const char *sentenceId;
+  TalkerClass talkerClass;
+} TalkerPriority;
 
-/***********************************************************************************
-   Global variables go here
-*/
-NMEAStack NmeaStack;
-NMEAParser NmeaParser(&NmeaStack);
-NMEAData NmeaData;
+//*** sentence IDs not in the list and AIS are background
+const TalkerPriority talkerPriorities[] = {
+    {"HDG", TALKER_CONTROL},
+    {"HDM", TALKER_CONTROL},
+    {"HDT", TALKER_CONTROL},
+    {"ROT", TALKER_CONTROL},
+    {"RSA", TALKER_CONTROL},
+    {"MWV", TALKER_CONTROL},
+    {"VWR", TALKER_CONTROL},
+    {"APB", TALKER_CONTROL},
+    {"XTE", TALKER_CONTROL},
+    {"RMB", TALKER_NAVIGATION},
+    {"RMC", TALKER_NAVIGATION},
+    {"GLL", TALKER_NAVIGATION},
+    {"GGA", TALKER_NAVIGATION},
+    {"VTG", TALKER_NAVIGATION},
+    {"VHW", TALKER_NAVIGATION},
+    {"DPT", TALKER_NAVIGATION},
+    {"DBK", TALKER_NAVIGATION},
+    {"DBT", TALKER_NAVIGATION},
+    {"MWD", TALKER_NAVIGATION},
+    {"ALR", TALKER_NAVIGATION},
+    {"WPL", TALKER_NAVIGATION}};
 
-/*
-  Initialize the NMEA Talker port and baudrate
-  on RX/TX port 2 to the multiplexer
-*/
-void initializeTalker()
+class TalkerScheduler
 {
-  nmeaSerialOut.begin(TALKER_RATE, SWSERIAL_8N1, 22, TALKER_PORT, true);
-#ifdef DEBUG
-  debugWrite("Talker initialized...");
-#endif
-}
+public:
+  TalkerScheduler();
+  void schedule(NMEAData &nmea);                       // set the class and the deadline of a new sentence
+  unsigned long deadline(const NMEAData &nmea);        // the deadline a sentence parsed now gets
+  void sent(NMEAData &nmea, unsigned long writeTime); // account a sentence written in writeTime us
+  void print();
+  void reset();
 
-/*** Converts and adjusts the incomming values to usable values for the HMI display 
- * and concatenates these values in one string so it can be send in one command to the 
- * Nextion HMI in timed intervals of 50ms.
- * This is due the fact that a timer in the HMI checks on new data and refreshes the 
- * display. So no need to send more data than you can chew!
- * A refresh of 20x per second is more then sufficient.
- * The string is formatted like:
- * <Sentence ID1>=<Value1>#....<Sentence IDn>=<Value_n>#
- * Sentence ID = 3 chars i.e. SOG, COG etc
- * Value can be an integer or float with 1 decimal and max 5 char long incl. delimiter
- * i.e. SOG=6.4#COG=213.2#BAT=12.5#AWA=37#AWS=15.7#
- * The order is not applicable, so can be random
- */
-void displayData()
+private:
+  TalkerClass classify(const NMEAField &tag);
+  unsigned long sentences[NR_OF_TALKER_CLASSES];
+  unsigned long misses[NR_OF_TALKER_CLASSES];
+  unsigned long maxLatency[NR_OF_TALKER_CLASSES];   // us
+  unsigned long long totalLatency[NR_OF_TALKER_CLASSES]; // us
+  unsigned long long busy = 0;                      // us spent writing since
+  unsigned long since = 0;                          // ms
+};
+
+TalkerScheduler::TalkerScheduler()
 {
-  char _BITVAL[255] = {0};
+  reset();
+}
 
-  // if cog is a number
-  if (isNumeric(nb_COG))
+void TalkerScheduler::reset()
+{
+  for (int i = 0; i < NR_OF_TALKER_CLASSES; i++)
   {
-    strcat(_BITVAL, "COG=");
-    strcat(_BITVAL, nb_COG);
-    strcat(_BITVAL, "#");
+    sentences[i] = 0;
+    misses[i] = 0;
+    maxLatency[i] = 0;
+    totalLatency[i] = 0;
   }
+  busy = 0;
+  since = millis();
+}
 
-  //set awa if is a number
-  if (isNumeric(nb_AWA))
+TalkerClass TalkerScheduler::classify(const NMEAField &tag)
+{
+  if (tag[0] != '$' || tag.length() != 6)
+    return TALKER_BACKGROUND;
+  for (unsigned int i = 0; i < sizeof(talkerPriorities) / sizeof(talkerPriorities[0]); i++)
   {
-    strcat(_BITVAL, "AWA=");
-    strcat(_BITVAL, nb_AWA);
-    strcat(_BITVAL, "#");
+    if (strcmp(tag.c_str() + 3, talkerPriorities[i].sentenceId) == 0)
+      return talkerPriorities[i].talkerClass;
   }
+  return TALKER_BACKGROUND;
+}
 
-  //set sog if is a number
-  if (isNumeric(nb_SOG))
-  {
-    strcat(_BITVAL, "SOG=");
-    strcat(_BITVAL, nb_SOG);
-    strcat(_BITVAL, "#");
-  }
+void TalkerScheduler::schedule(NMEAData &nmea)
+{
+  nmea.talkerClass = classify(nmea.fields[0]);
+  nmea.received = micros();
+  nmea.deadline = nmea.received + config.deadlines[nmea.talkerClass] * 1000;
+}
 
-  // set aws is is a number
-  if (isNumeric(nb_AWS))
+unsigned long TalkerScheduler::deadline(const NMEAData &nmea)
+{
+  return micros() + config.deadlines[classify(nmea.fields[0])] * 1000;
+}
+
+void TalkerScheduler::sent(NMEAData &nmea, unsigned long writeTime)
+{
+  unsigned long latency = micros() - nmea.received;
+  byte c = nmea.talkerClass;
+  sentences[c]++;
+  totalLatency[c] += latency;
+  if (latency > maxLatency[c])
+    maxLatency[c] = latency;
+  if (latency > config.deadlines[c] * 1000)
+    misses[c]++;
+  busy += writeTime;
+}
+
+void TalkerScheduler::print()
+{
+  unsigned long elapsed = millis() - since;
+  Serial.printf("Scheduling: %s\n", config.latencySlo ? "earliest deadline first" : "stack order");
+  for (int i = 0; i < NR_OF_TALKER_CLASSES; i++)
   {
-    strcat(_BITVAL, "AWS=");
-    strcat(_BITVAL, nb_AWS);
-    strcat(_BITVAL, "#");
+    Serial.printf("%-10s deadline %5lu ms, sent %lu, missed %lu, latency avg %.1f max %.1f ms\n",
+                  talkerClassNames[i], config.deadlines[i], sentences[i], misses[i],
+                  sentences[i] > 0 ? totalLatency[i] / 1000.0 / sentences[i] : 0.0, maxLatency[i] / 1000.0);
   }
+  Serial.printf("Talker load: %.1f%% of %lu s\n", elapsed > 0 ? busy / 10.0 / elapsed : 0.0, elapsed / 1000);
+}
 
-  // set BATT is is a number
-  if (isNumeric(nb_BAT))
+TalkerScheduler Scheduler;
+
+/*
+  Purpose:  Helper class stacking NMEA data as a part of the multiplexer application
+            - Pushin and popping NMEAData structure on the stack for buffer purposes
+            - With config.latencySlo the entries stay in the order they arrived and pop()
+              returns the one with the earliest deadline, otherwise the last one pushed
+            - An entry stays in its slot from push to pop; only the byte array with the
+              slot numbers in order is shifted, so taking out an entry in the middle for
+              the earliest deadline moves no NMEAData
+ */
+class NMEAStack
+{
+public:
+  NMEAStack();                      // Constructor with the size of the stack
+  int push(const NMEAData &_nmea);  // put an NMEAData struct on the stack and returns the lastIndex or -1
+  bool pop(NMEAData &nmeaOut);      // get an NMEAData struct from the stack, false when it is empty
+  void clear();                     // drop all entries
+  int getIndex();                   // returns the position of the next free postion in the stack
+
+private:
+  NMEAData stack[STACKSIZE]; // the array containg the structs, config.stackSize are used
+  byte slots[STACKSIZE];     // the slots in use in the order they were pushed, then the free ones
+  int lastIndex = 0;         // an index pointng to the first free psotiion in slots
+  int findDeadline(bool latest); // position in slots of the entry with the earliest or latest deadline
+  byte remove(int index);        // take a position out of slots keeping the order, returns its slot
+};
+
+NMEAStack::NMEAStack()
+{
+  this->lastIndex = 0;
+  for (int i = 0; i < STACKSIZE; i++)
+  {
+    for (int j = 0; j < MAX_NMEA_FIELDS; j++)
+    {
+      stack[i].fields[j] = "";
+    }
+    stack[i].nrOfFields = 0;
+    stack[i].sentence = "";
+    slots[i] = i;
+  }
+}
+
+int NMEAStack::push(const NMEAData &_nmea)
+{
+#ifdef DEBUG
+  debugWrite("Pushing on index:" + String(this->lastIndex));
+#endif
+  if (this->lastIndex < (int)config.stackSize)
+  {
+    NMEAData &entry = stack[slots[this->lastIndex++]];
+    entry = _nmea;
+    Scheduler.schedule(entry);
+    return this->lastIndex;
+  }
+  else
+  {
+    this->lastIndex = config.stackSize;
+    //*** a more urgent sentence takes the place of the one that can wait the longest
+    if (config.latencySlo && this->lastIndex > 0)
+    {
+      int latest = findDeadline(true);
+      if ((long)(Scheduler.deadline(_nmea) - stack[slots[latest]].deadline) < 0)
+      {
+        NMEAData &entry = stack[remove(latest)];
+        this->lastIndex++;
+        entry = _nmea;
+        Scheduler.schedule(entry);
+      }
+    }
+    return -1; // of stack is full, a sentence is lost
+  }
+}
+
+int NMEAStack::findDeadline(bool latest)
+{
+  int found = 0;
+  for (int i = 1; i < this->lastIndex; i++)
+  {
+    long difference = (long)(stack[slots[i]].deadline - stack[slots[found]].deadline);
+    if (latest ? difference >= 0 : difference < 0)
+      found = i;
+  }
+  return found;
+}
+
+byte NMEAStack::remove(int index)
+{
+  byte slot = slots[index];
+  for (int i = index; i < this->lastIndex - 1; i++)
+  {
+    slots[i] = slots[i + 1];
+  }
+  this->lastIndex--;
+  slots[this->lastIndex] = slot; // the first free one
+  return slot;
+}
+
+bool NMEAStack::pop(NMEAData &nmeaOut)
+{
+  if (this->lastIndex == 0)
+    return false;
+  if (config.latencySlo)
+    nmeaOut = stack[remove(findDeadline(false))];
+  else
+    nmeaOut = stack[slots[--this->lastIndex]];
+#ifdef DEBUG
+  debugWrite("Popped from index: " + String(lastIndex));
+#endif
+
+  return true;
+}
+
+void NMEAStack::clear()
+{
+  this->lastIndex = 0;
+}
+
+int NMEAStack::getIndex()
+{
+  return this->lastIndex;
+}
+
+#ifdef WIFI_ATTACHED
+/*
+  Purpose:  Network talker sending the NMEA sentences over Wi-Fi
+            - The access point of the ESP32 with the network core of lib/NMEANet on it,
+              UDP broadcast and a TCP server on NMEA_NET_PORT
+            - A client that cannot keep up is disconnected, so a slow client can
+              never hold up the serial talker
+ */
+class NMEANetServer
+{
+public:
+  void begin();                            // start the access point, the TCP server and UDP
+  void end();                              // disconnect all and switch Wi-Fi off
+  void queue(const char *data, size_t len); // queue one sentence for all receivers
+  void handle();                           // accept clients and send pending batches
+  byte getClients();                       // nr of connected TCP clients
+  unsigned long getEvicted();              // nr of clients dropped for being too slow
+
+private:
+  NMEANetCore core;
+};
+
+void NMEANetServer::begin()
+{
+  WiFi.mode(WIFI_AP);
+  WiFi.softAP(WIFI_SSID, WIFI_PASSWORD);
+  if (!core.begin(NMEA_NET_PORT, (uint32_t)WiFi.softAPBroadcastIP()))
+  {
+    Serial.println("Network talker sockets failed");
+    return;
+  }
+#ifdef DEBUG
+  debugWrite("Network talker initialized...");
+#endif
+}
+
+void NMEANetServer::end()
+{
+  core.end();
+  WiFi.softAPdisconnect(true);
+  WiFi.mode(WIFI_OFF);
+#ifdef DEBUG
+  debugWrite("Network talker stopped...");
+#endif
+}
+
+void NMEANetServer::queue(const char *data, size_t len)
+{
+  core.queue(data, len);
+}
+
+void NMEANetServer::handle()
+{
+  core.handle(millis());
+}
+
+byte NMEANetServer::getClients()
+{
+  return core.getClients();
+}
+
+unsigned long NMEANetServer::getEvicted()
+{
+  return core.getEvicted();
+}
+#endif
+
+#ifdef N2K_ATTACHED
+/*
+  Purpose:  NMEA2000 gateway on the TWAI (CAN) controller
+            - NMEAN2KCore in lib/NMEAN2K converts the data and frames the PGNs
+            - Frames are sent through the TWAI controller at 250kbit/s without waiting
+            - A bus-off controller is recovered, so the gateway heals by itself
+ */
+class N2KGateway
+{
+public:
+  N2KGateway();
+  bool begin();                 // install the TWAI driver and claim our address
+  void update(NMEAData &nmea);  // update the N2K values from a sent sentence
+  void handle();                // schedule due PGNs and send the queued frames
+  unsigned long getDropped();   // nr of frames dropped since the queue was full
+
+private:
+  NMEAN2KCore core;
+  bool running = false;
+  void receive();
+  void transmit();
+  void checkBus();
+};
+
+N2KGateway::N2KGateway()
+{
+}
+
+bool N2KGateway::begin()
+{
+  twai_general_config_t g_config = TWAI_GENERAL_CONFIG_DEFAULT(N2K_TX, N2K_RX, TWAI_MODE_NORMAL);
+  twai_timing_config_t t_config = TWAI_TIMING_CONFIG_250KBITS();
+  twai_filter_config_t f_config = TWAI_FILTER_CONFIG_ACCEPT_ALL();
+
+  if (twai_driver_install(&g_config, &t_config, &f_config) != ESP_OK || twai_start() != ESP_OK)
+  {
+#ifdef DEBUG
+    debugWrite("NMEA2000 initialization failed...");
+#endif
+    return false;
+  }
+  running = true;
+  core.begin(ESP.getEfuseMac() & 0x1FFFFF);
+#ifdef DEBUG
+  debugWrite("NMEA2000 gateway initialized...");
+#endif
+  return true;
+}
+
+void N2KGateway::update(NMEAData &nmea)
+{
+  core.update(nmea, millis());
+}
+
+void N2KGateway::handle()
+{
+  if (!running)
+    return;
+
+  checkBus();
+  receive();
+  core.schedule(millis());
+  transmit();
+}
+
+//*** hand the frames over to the controller until its tx queue is full
+void N2KGateway::transmit()
+{
+  const N2KFrame *frame;
+  while ((frame = core.peek()) != NULL)
+  {
+    twai_message_t msg;
+    msg.flags = 0;
+    msg.extd = 1;
+    msg.identifier = frame->id;
+    msg.data_length_code = frame->len;
+    memcpy(msg.data, frame->data, 8);
+    if (twai_transmit(&msg, 0) != ESP_OK)
+      break;
+    core.pop();
+  }
+}
+
+void N2KGateway::receive()
+{
+  twai_message_t msg;
+  while (twai_receive(&msg, 0) == ESP_OK)
+  {
+    N2KFrame frame;
+    frame.id = msg.identifier;
+    frame.len = msg.data_length_code > 8 ? 8 : msg.data_length_code;
+    memcpy(frame.data, msg.data, 8);
+    core.receive(frame);
+  }
+}
+
+/*
+  A bus without other devices or with a wiring problem drives the controller
+  into bus-off; recover and restart it so the gateway heals by itself
+*/
+void N2KGateway::checkBus()
+{
+  twai_status_info_t status;
+  if (twai_get_status_info(&status) != ESP_OK)
+    return;
+  if (status.state == TWAI_STATE_BUS_OFF)
+  {
+    twai_initiate_recovery();
+  }
+  else if (status.state == TWAI_STATE_STOPPED)
+  {
+    twai_start();
+    core.claimAddress();
+  }
+}
+
+unsigned long N2KGateway::getDropped()
+{
+  return core.getDropped();
+}
+#endif
+
+#ifdef LOGBOOK_ATTACHED
+/*
+  Running min, max and average of an instrument in O(1) memory
+*/
+typedef struct
+{
+  float min;
+  float max;
+  float sum;
+  unsigned long count;
+} RunningStat;
+
+void resetStat(RunningStat &stat)
+{
+  stat.min = 0;
+  stat.max = 0;
+  stat.sum = 0;
+  stat.count = 0;
+}
+
+void addStat(RunningStat &stat, float value)
+{
+  if (stat.count == 0 || value < stat.min)
+    stat.min = value;
+  if (stat.count == 0 || value > stat.max)
+    stat.max = value;
+  stat.sum += value;
+  stat.count++;
+}
+
+float avgStat(RunningStat &stat)
+{
+  return stat.count > 0 ? stat.sum / stat.count : 0;
+}
+
+enum LogInstrument
+{
+  LOG_SOG,
+  LOG_STW,
+  LOG_AWS,
+  LOG_DPT,
+  LOG_BAT,
+  LOG_MTW,
+  NR_OF_LOG_INSTRUMENTS
+};
+
+const char *logInstrumentNames[NR_OF_LOG_INSTRUMENTS] = {"SOG", "STW", "AWS", "DPT", "BAT", "MTW"};
+
+/*
+  Purpose:  Trip computer and logbook aggregating the instrument data
+            - Running min/max/avg per instrument for the log interval and the voyage
+            - Distance sailed from the RMC positions and the engine hours from $PSTOE
+            - Every LOGBOOK_INTERVAL a compact record is appended to LOGBOOK_FILE
+            - A voyage starts when the SOG gets above VOYAGE_START_SOG and ends after
+              VOYAGE_END_DELAY below it; then a summary is appended to VOYAGE_FILE
+            The SD card is optional, without it the data is still shown on the console.
+            The lines are queued and written by the logbook task on core 0, so opening and
+            closing a file on the SD card never holds up the listener.
+*/
+typedef struct
+{
+  const char *file;
+  const char *header; // written first when the file is new
+  char line[LOGBOOK_LINE_SIZE];
+} LogbookLine;
+
+class TripComputer
+{
+public:
+  TripComputer();
+  bool begin();                // mount the SD card
+  void update(NMEAData &nmea); // aggregate a sent sentence
+  void handle();               // write the records when due
+  void writeLine();            // consumer, the logbook task
+  void print();                // show the current voyage on the console
+
+private:
+  RunningStat interval[NR_OF_LOG_INSTRUMENTS];
+  RunningStat voyage[NR_OF_LOG_INSTRUMENTS];
+  double intervalDistance = 0; // nm
+  double voyageDistance = 0;   // nm
+  double lastLat = 0;
+  double lastLon = 0;
+  bool hasFix = false;
+  char utcDate[7] = {0};      // ddmmyy of the last RMC
+  char utcTime[7] = {0};      // hhmmss of the last RMC
+  char voyageStart[14] = {0}; // ddmmyy,hhmmss when the voyage started
+  float engineHours = 0;
+  float voyageEngineStart = -1;
+  bool underway = false;
+  unsigned long voyageStartTime = 0;
+  unsigned long belowStartSince = 0;
+  unsigned long lastRecord = 0;
+  volatile bool sdReady = false;
+  QueueHandle_t lines = NULL;
+  unsigned long dropped = 0; // lines lost on a full queue
+  void updatePosition(NMEAData &nmea);
+  void updateVoyage(float sog);
+  void writeRecord();
+  void writeSummary();
+  void appendLine(const char *file, const char *header, const char *line);
+};
+
+TripComputer::TripComputer()
+{
+  for (int i = 0; i < NR_OF_LOG_INSTRUMENTS; i++)
+  {
+    resetStat(interval[i]);
+    resetStat(voyage[i]);
+  }
+}
+
+bool TripComputer::begin()
+{
+  logbookSPI.begin(SD_SCK, SD_MISO, SD_MOSI, SD_CS);
+  lines = xQueueCreate(LOGBOOK_QUEUE, sizeof(LogbookLine));
+  sdReady = lines != NULL && SD.begin(SD_CS, logbookSPI);
+#ifdef DEBUG
+  debugWrite(sdReady ? "Logbook initialized..." : "No SD card for the logbook...");
+#endif
+  return sdReady;
+}
+
+void TripComputer::update(NMEAData &nmea)
+{
+  int instrument = -1;
+  float value = 0;
+
+  if (nmea.type == NMEA_RMC && nmeaChar<RMC_STATUS>(nmea) == 'A')
+  {
+    updatePosition(nmea);
+    instrument = LOG_SOG;
+    value = nmeaFloat<RMC_SOG>(nmea);
+    updateVoyage(value);
+  }
+  else if (nmea.type == NMEA_VHW)
+  {
+    instrument = LOG_STW;
+    value = nmeaFloat<VHW_STW>(nmea);
+  }
+  else if (nmea.type == NMEA_VWR)
+  {
+    instrument = LOG_AWS;
+    value = nmeaFloat<VWR_AWS>(nmea);
+  }
+  else if (nmea.type == NMEA_DPT)
+  {
+    instrument = LOG_DPT;
+    value = nmeaFloat<DPT_DEPTH>(nmea);
+  }
+  else if (nmea.type == NMEA_XDR && nmeaText<XDR_NAME>(nmea) == "BATT")
+  {
+    instrument = LOG_BAT;
+    value = nmeaFloat<XDR_VALUE>(nmea);
+  }
+  else if (nmea.type == NMEA_MTW)
+  {
+    instrument = LOG_MTW;
+    value = nmeaFloat<MTW_TEMPERATURE>(nmea);
+  }
+  else if (nmea.type == NMEA_TOE)
+  {
+    engineHours = nmeaFloat<TOE_HOURS>(nmea);
+    if (underway && voyageEngineStart < 0)
+      voyageEngineStart = engineHours;
+  }
+
+  if (instrument >= 0)
+  {
+    addStat(interval[instrument], value);
+    if (underway)
+      addStat(voyage[instrument], value);
+  }
+}
+
+void TripComputer::updatePosition(NMEAData &nmea)
+{
+  strncpy(utcTime, nmeaText<RMC_TIME>(nmea).c_str(), 6);
+  strncpy(utcDate, nmeaText<RMC_DATE>(nmea).c_str(), 6);
+  if (nmeaChar<RMC_STATUS>(nmea) != 'A')
+    return; // no valid fix
+
+  double lat = nmeaDegrees<RMC_LAT>(nmea);
+  double lon = nmeaDegrees<RMC_LON>(nmea);
+  if (hasFix)
+  {
+    double distance = distanceNM(lastLat, lastLon, lat, lon);
+    //*** ignore GPS jitter and jumps after a lost fix
+    if (distance < MIN_POSITION_CHANGE)
+      return;
+    if (distance < MAX_POSITION_JUMP)
+    {
+      intervalDistance += distance;
+      if (underway)
+        voyageDistance += distance;
+    }
+  }
+  lastLat = lat;
+  lastLon = lon;
+  hasFix = true;
+}
+
+void TripComputer::updateVoyage(float sog)
+{
+  if (sog >= VOYAGE_START_SOG)
+  {
+    belowStartSince = 0;
+    if (!underway)
+    {
+      underway = true;
+      voyageStartTime = millis();
+      voyageDistance = 0;
+      voyageEngineStart = engineHours > 0 ? engineHours : -1;
+      snprintf(voyageStart, sizeof(voyageStart), "%s,%s", utcDate, utcTime);
+      for (int i = 0; i < NR_OF_LOG_INSTRUMENTS; i++)
+      {
+        resetStat(voyage[i]);
+      }
+    }
+  }
+  else if (underway)
+  {
+    if (belowStartSince == 0)
+      belowStartSince = millis();
+    else if (millis() - belowStartSince > VOYAGE_END_DELAY)
+    {
+      writeSummary();
+      underway = false;
+    }
+  }
+}
+
+void TripComputer::handle()
+{
+  if (millis() - lastRecord < LOGBOOK_INTERVAL)
+    return;
+  lastRecord = millis();
+  writeRecord();
+  for (int i = 0; i < NR_OF_LOG_INSTRUMENTS; i++)
+  {
+    resetStat(interval[i]);
+  }
+  intervalDistance = 0;
+}
+
+/*
+  A record holds the date, time and position followed by the distance and
+  the avg/min/max of every instrument over the interval i.e.
+  120420,095218,52.85937,5.68080,1.23,4.3/3.9/4.8,...,12.4/12.3/12.5,...,1234.5
+*/
+void TripComputer::writeRecord()
+{
+  char line[LOGBOOK_LINE_SIZE];
+  int len = snprintf(line, LOGBOOK_LINE_SIZE, "%s,%s,%.5f,%.5f,%.2f", utcDate, utcTime,
+                     lastLat, lastLon, intervalDistance);
+  for (int i = 0; i < NR_OF_LOG_INSTRUMENTS && len < LOGBOOK_LINE_SIZE; i++)
+  {
+    len += snprintf(&line[len], LOGBOOK_LINE_SIZE - len, ",%.1f/%.1f/%.1f", avgStat(interval[i]),
+                    interval[i].min, interval[i].max);
+  }
+  if (len < LOGBOOK_LINE_SIZE)
+    snprintf(&line[len], LOGBOOK_LINE_SIZE - len, ",%.1f", engineHours);
+
+  appendLine(LOGBOOK_FILE, "date,time,lat,lon,nm,SOG,STW,AWS,DPT,BAT,MTW,engine", line);
+}
+
+/*
+  A summary holds the start and end, the distance, the duration, the engine hours
+  and the avg/max SOG and the min battery voltage of the voyage
+*/
+void TripComputer::writeSummary()
+{
+  char line[LOGBOOK_LINE_SIZE];
+  float engine = (voyageEngineStart >= 0) ? engineHours - voyageEngineStart : 0;
+  snprintf(line, LOGBOOK_LINE_SIZE, "%s,%s,%s,%.2f,%.2f,%.1f,%.1f,%.1f,%.1f", voyageStart, utcDate,
+           utcTime, voyageDistance, (millis() - voyageStartTime) / 3600000.0, engine,
+           avgStat(voyage[LOG_SOG]), voyage[LOG_SOG].max, voyage[LOG_BAT].min);
+  appendLine(VOYAGE_FILE, "start date,start time,end date,end time,nm,hours,engine,avg SOG,max SOG,min BAT", line);
+}
+
+void TripComputer::appendLine(const char *file, const char *header, const char *line)
+{
+#ifdef DEBUG
+  debugWrite(String(file) + ": " + line);
+#endif
+  if (!sdReady)
+    return;
+  LogbookLine entry;
+  entry.file = file;
+  entry.header = header;
+  strncpy(entry.line, line, LOGBOOK_LINE_SIZE - 1);
+  entry.line[LOGBOOK_LINE_SIZE - 1] = '\0';
+  if (xQueueSend(lines, &entry, 0) != pdTRUE)
+    dropped++;
+}
+
+void TripComputer::writeLine()
+{
+  LogbookLine entry;
+  if (xQueueReceive(lines, &entry, portMAX_DELAY) != pdTRUE || !sdReady)
+    return;
+  bool exists = SD.exists(entry.file);
+  File f = SD.open(entry.file, FILE_APPEND);
+  if (!f)
+  {
+    sdReady = false; // card removed, stop trying
+    return;
+  }
+  if (!exists)
+    f.println(entry.header);
+  f.println(entry.line);
+  f.close();
+}
+
+void TripComputer::print()
+{
+  Serial.printf("Underway: %s since %s\n", underway ? "yes" : "no", voyageStart);
+  Serial.printf("Voyage: %.2f nm, %.1f engine hours\n", voyageDistance,
+                (voyageEngineStart >= 0) ? engineHours - voyageEngineStart : 0);
+  for (int i = 0; i < NR_OF_LOG_INSTRUMENTS; i++)
+  {
+    Serial.printf("%s avg/min/max: %.1f/%.1f/%.1f\n", logInstrumentNames[i], avgStat(voyage[i]),
+                  voyage[i].min, voyage[i].max);
+  }
+  Serial.printf("Logbook on SD: %s, %lu lines dropped\n", sdReady ? "yes" : "no", dropped);
+}
+#endif
+
+/***********************************************************************************
+   Global variables go here
+*/
+NMEAStack NmeaStack;
+
+//*** the parser hands its sentences to the application
+bool acceptSentence(NMEAData &nmea)
+{
+  return Sources.accept(nmea); // duplicates of the selected source are not forwarded
+}
+
+void forwardSentence(NMEAData &nmea)
+{
+  if (NmeaStack.push(nmea) < 0) //push the struct to the stack for later use; i.e. buffer it
+    health.stackOverflows++;
+  evaluateSentence(nmea);
+}
+
+NMEAParser NmeaParser(forwardSentence, acceptSentence, config.talkerId, config.specialty, &config.batteryOffset);
+NMEADecoder NmeaDecoder(&NmeaParser);
+#ifdef STATIC_ARENA
+static_assert(sizeof(NMEAStack) + sizeof(NMEAParser) <= PIPELINE_RAM_BUDGET,
+              "The NMEA stack and parser exceed PIPELINE_RAM_BUDGET");
+#endif
+NMEAData NmeaData;
+#ifdef WIFI_ATTACHED
+NMEANetServer NmeaNet;
+#endif
+#ifdef N2K_ATTACHED
+N2KGateway NmeaN2K;
+#endif
+#ifdef LOGBOOK_ATTACHED
+TripComputer Trip;
+
+void logbookTask(void *parameter)
+{
+  for (;;)
+  {
+    Trip.writeLine();
+  }
+}
+#endif
+
+/*
+  Purpose:  Alarm engine evaluated on every parsed sentence
+            - Anchor watch; the distance from the anchor position against a radius
+            - Shallow and deep water with hysteresis on the converted depth
+            - Low battery with hysteresis on the converted battery voltage
+            - Data loss when the selected position or depth source goes stale
+            A change is queued and sent on the next loop as an ALR sentence, i.e.
+            $AOALR,095218.00,002,A,V,SHALLOW WATER*hh, and shown on the Nextion.
+            Active alarms are repeated every ALARM_REPEAT_INTERVAL.
+ */
+enum AlarmId
+{
+  ALARM_ANCHOR,
+  ALARM_SHALLOW,
+  ALARM_DEEP,
+  ALARM_BATTERY,
+  ALARM_DATALOSS,
+  NR_OF_ALARMS
+};
+
+const char *alarmTexts[NR_OF_ALARMS] = {"ANCHOR DRAG", "SHALLOW WATER", "DEEP WATER", "LOW BATTERY", "DATA LOSS"};
+
+class AlarmEngine
+{
+public:
+  AlarmEngine();
+  void evaluate(NMEAData &nmea); // evaluate the alarms depending on this sentence
+  void handle();                 // check the data loss and send the queued alarms
+  bool setAnchor();              // the current position becomes the anchor position
+  void clearAnchor();
+  bool isActive(AlarmId id);
+  void print();                  // show the alarms on the console
+
+private:
+  bool active[NR_OF_ALARMS];
+  unsigned long lastSent[NR_OF_ALARMS];
+  unsigned int pending = 0; // bit per alarm with a change to send
+  double lat = 0;
+  double lon = 0;
+  bool hasFix = false;
+  const char *positionSource = "RMC"; // sentence of the last fix, checked for data loss
+  double anchorLat = 0;
+  double anchorLon = 0;
+  bool anchorSet = false;
+  char utcTime[11] = "000000.00";
+  unsigned long lastDataLossCheck = 0;
+  void set(AlarmId id, bool on);
+  void threshold(AlarmId id, float value, float limit, float hysteresis, bool above);
+  void send(AlarmId id);
+};
+
+AlarmEngine::AlarmEngine()
+{
+  for (int i = 0; i < NR_OF_ALARMS; i++)
+  {
+    active[i] = false;
+    lastSent[i] = 0;
+  }
+}
+
+void AlarmEngine::set(AlarmId id, bool on)
+{
+  if (active[id] != on)
+  {
+    active[id] = on;
+    pending |= 1 << id;
+  }
+}
+
+/*
+  Switch an alarm on beyond the limit, and only off again beyond the limit plus
+  the hysteresis, so a value around the limit does not keep toggling the alarm.
+  A limit of 0 disables the alarm.
+*/
+void AlarmEngine::threshold(AlarmId id, float value, float limit, float hysteresis, bool above)
+{
+  if (limit <= 0)
+  {
+    set(id, false);
+    return;
+  }
+  if (above)
+  {
+    if (value > limit)
+      set(id, true);
+    else if (value < limit - hysteresis)
+      set(id, false);
+  }
+  else
+  {
+    if (value < limit)
+      set(id, true);
+    else if (value > limit + hysteresis)
+      set(id, false);
+  }
+}
+
+void AlarmEngine::evaluate(NMEAData &nmea)
+{
+  if (nmea.type == NMEA_RMC || nmea.type == NMEA_GLL)
+  {
+    bool rmc = nmea.type == NMEA_RMC;
+    //*** a GPS may send only GLL for the position, the fields sit elsewhere in the sentence
+    snprintf(utcTime, sizeof(utcTime), "%.6s.00",
+             (rmc ? nmeaText<RMC_TIME>(nmea) : nmeaText<GLL_TIME>(nmea)).c_str());
+    if ((rmc ? nmeaChar<RMC_STATUS>(nmea) : nmeaChar<GLL_STATUS>(nmea)) != 'A')
+      return;
+    lat = rmc ? nmeaDegrees<RMC_LAT>(nmea) : nmeaDegrees<GLL_LAT>(nmea);
+    lon = rmc ? nmeaDegrees<RMC_LON>(nmea) : nmeaDegrees<GLL_LON>(nmea);
+    positionSource = rmc ? "RMC" : "GLL";
+    hasFix = true;
+    if (anchorSet)
+    {
+      float distance = distanceNM(anchorLat, anchorLon, lat, lon) * NTK * 1000; // m
+      threshold(ALARM_ANCHOR, distance, config.anchorRadius, config.anchorRadius * ANCHOR_HYSTERESIS, true);
+    }
+  }
+  else if (nmea.type == NMEA_DPT)
+  {
+    float depth = nmeaFloat<DPT_DEPTH>(nmea);
+    threshold(ALARM_SHALLOW, depth, config.shallowAlarm, DEPTH_HYSTERESIS, false);
+    threshold(ALARM_DEEP, depth, config.deepAlarm, DEPTH_HYSTERESIS, true);
+  }
+  else if (nmea.type == NMEA_XDR && nmeaText<XDR_NAME>(nmea) == "BATT")
+  {
+    threshold(ALARM_BATTERY, nmeaFloat<XDR_VALUE>(nmea), config.batteryLow, BATTERY_HYSTERESIS, false);
+  }
+}
+
+void AlarmEngine::handle()
+{
+  unsigned long now = millis();
+  if (now - lastDataLossCheck > SUPERVISOR_INTERVAL)
+  {
+    lastDataLossCheck = now;
+    set(ALARM_DATALOSS, Sources.isStale(positionSource) || Sources.isStale("DBK"));
+  }
+
+  for (int i = 0; i < NR_OF_ALARMS; i++)
+  {
+    if ((pending & (1 << i)) || (active[i] && now - lastSent[i] > ALARM_REPEAT_INTERVAL))
+    {
+      pending &= ~(1 << i);
+      send((AlarmId)i);
+    }
+  }
+}
+
+void AlarmEngine::send(AlarmId id)
+{
+  char alr[NMEA_BUFFER_SIZE + 1];
+  lastSent[id] = millis();
+  if (formatALR(alr, sizeof(alr), config.talkerId, utcTime, id + 1, active[id], alarmTexts[id]) > 0)
+    NmeaParser.parseNMEASentence(alr);
+
+#ifdef NEXTION_ATTACHED
+  NextionEvent event;
+  event.type = NEX_ALARM;
+  event.page = 0;
+  event.component = id;
+  event.pressed = active[id];
+  xQueueSend(nextionEvents, &event, 0);
+#endif
+}
+
+bool AlarmEngine::setAnchor()
+{
+  if (!hasFix)
+    return false;
+  anchorLat = lat;
+  anchorLon = lon;
+  anchorSet = true;
+  return true;
+}
+
+void AlarmEngine::clearAnchor()
+{
+  anchorSet = false;
+  set(ALARM_ANCHOR, false);
+}
+
+bool AlarmEngine::isActive(AlarmId id)
+{
+  return active[id];
+}
+
+void AlarmEngine::print()
+{
+  if (anchorSet)
+    Serial.printf("Anchor: %.5f, %.5f radius %.0f m\n", anchorLat, anchorLon, config.anchorRadius);
+  else
+    Serial.println("Anchor: not set");
+  for (int i = 0; i < NR_OF_ALARMS; i++)
+  {
+    Serial.printf("%s: %s\n", alarmTexts[i], active[i] ? "ACTIVE" : "off");
+  }
+}
+
+AlarmEngine Alarms;
+
+/*
+  Purpose:  Magnetic variation from position and date with a reduced order World Magnetic Model
+            - WMM2020 main field and secular variation up to degree and order 6, in flash
+            - Evaluated only when the position moved VARIATION_DISTANCE or the date changed;
+              the cached value is used for the headings, so no trig per heading sentence
+            - The truncation leaves an error of a few tenths of a degree that hardly changes
+              over a sailing area, so the model is anchored on the home_variation setting, which
+              is the variation at HOME_LAT/HOME_LON on VARIATION_YEAR
+            - Until there is a position fix the home_variation setting is used
+            On every HDM the HDG with the variation and the HDT with the true heading are
+            sent on the next loop, i.e. $AOHDG,123.4,,,1.57,E and $AOHDT,125.0,T
+ */
+typedef struct
+{
+  byte n;
+  byte m;
+  float g;    // nT
+  float h;    // nT
+  float gDot; // nT per year
+  float hDot; // nT per year
+} WMMCoefficient;
+
+const WMMCoefficient wmmCoefficients[] = {
+    {1, 0, -29404.5, 0.0, 6.7, 0.0},
+    {1, 1, -1450.7, 4652.9, 7.7, -25.1},
+    {2, 0, -2500.0, 0.0, -11.5, 0.0},
+    {2, 1, 2982.0, -2991.6, -7.1, -30.2},
+    {2, 2, 1676.8, -734.8, -2.2, -23.9},
+    {3, 0, 1363.9, 0.0, 2.8, 0.0},
+    {3, 1, -2381.0, -82.2, -6.2, 5.7},
+    {3, 2, 1236.2, 241.8, 3.4, -1.0},
+    {3, 3, 525.7, -542.9, -12.2, 1.1},
+    {4, 0, 903.1, 0.0, -1.1, 0.0},
+    {4, 1, 809.4, 282.0, -1.6, 0.2},
+    {4, 2, 86.2, -158.4, -6.0, 6.9},
+    {4, 3, -309.4, 199.8, 5.4, 3.7},
+    {4, 4, 47.9, -350.1, -5.5, -5.6},
+    {5, 0, -234.4, 0.0, -0.3, 0.0},
+    {5, 1, 363.1, 47.7, 0.6, 0.1},
+    {5, 2, 187.8, 208.4, -0.7, 2.5},
+    {5, 3, -140.7, -121.3, 0.1, -0.9},
+    {5, 4, -151.2, 32.2, 1.2, 3.0},
+    {5, 5, 13.7, 99.1, 1.0, 0.5},
+    {6, 0, 65.9, 0.0, -0.6, 0.0},
+    {6, 1, 65.6, -19.1, -0.4, 0.1},
+    {6, 2, 73.0, 25.0, 0.5, -1.8},
+    {6, 3, -121.5, 52.7, 1.4, -1.4},
+    {6, 4, -36.2, -64.4, -1.4, 0.9},
+    {6, 5, 13.5, 9.0, 0.0, 0.1},
+    {6, 6, -64.7, 68.1, 0.8, 1.0}};
+
+class VariationModel
+{
+public:
+  void evaluate(NMEAData &nmea); // follow the position, the date and the magnetic heading
+  void handle();                 // send HDG and HDT for a new heading
+  float getVariation();          // degrees, positive for East
+  static float calculate(double lat, double lon, float year); // the model, degrees
+  void print();                  // show the variation on the console
+
+private:
+  float variation = 0;
+  float offset = 0;          // setting minus the model at the home position
+  float calibratedFor = NAN; // the home_variation setting the offset was calculated for
+  bool hasModel = false;
+  double modelLat = 0;
+  double modelLon = 0;
+  long modelDate = -1; // ddmmyy of the last evaluation
+  float modelYear = 0;
+  float heading = 0;   // last magnetic heading
+  bool pending = false;
+  unsigned long evaluations = 0;
+  void update(double lat, double lon, long date);
+};
+
+/*
+  Declination in degrees at sea level for a geodetic position and a decimal year
+*/
+float VariationModel::calculate(double lat, double lon, float year)
+{
+  const double a = 6378.137;            // WGS84 semi major axis in km
+  const double f = 1 / 298.257223563;
+  const double e2 = f * (2 - f);
+  const double reference = 6371.2;      // geomagnetic reference radius in km
+  double P[WMM_DEGREE + 1][WMM_DEGREE + 1];
+  double x = 0;
+  double y = 0;
+  double z = 0;
+
+  //*** geodetic to geocentric latitude and radius
+  double phi = lat * DEG_TO_RAD;
+  double lambda = lon * DEG_TO_RAD;
+  double rc = a / sqrt(1 - e2 * sin(phi) * sin(phi));
+  double p = rc * cos(phi);
+  double q = rc * (1 - e2) * sin(phi);
+  double r = sqrt(p * p + q * q);
+  double phiC = asin(q / r);
+  double mu = sin(phiC);
+  double c = cos(phiC);
+
+  //*** Schmidt semi normalized associated Legendre functions of sin(phiC)
+  P[0][0] = 1;
+  for (int n = 1; n <= WMM_DEGREE; n++)
+  {
+    P[n][n] = (n == 1) ? c : c * sqrt((2.0 * n - 1) / (2.0 * n)) * P[n - 1][n - 1];
+    for (int m = 0; m < n; m++)
+    {
+      double previous = (n >= 2 && m <= n - 2) ? sqrt((double)(n - 1) * (n - 1) - m * m) * P[n - 2][m] : 0;
+      P[n][m] = ((2.0 * n - 1) * mu * P[n - 1][m] - previous) / sqrt((double)n * n - m * m);
+    }
+  }
+
+  float dt = year - WMM_EPOCH;
+  for (unsigned int i = 0; i < sizeof(wmmCoefficients) / sizeof(wmmCoefficients[0]); i++)
+  {
+    const WMMCoefficient &k = wmmCoefficients[i];
+    int n = k.n;
+    int m = k.m;
+    double g = k.g + dt * k.gDot;
+    double h = k.h + dt * k.hDot;
+    double ratio = pow(reference / r, n + 2);
+    double dP = (-n * mu * P[n][m] + (m < n ? sqrt((double)n * n - m * m) * P[n - 1][m] : 0)) / c;
+    double cm = cos(m * lambda);
+    double sm = sin(m * lambda);
+    x -= ratio * (g * cm + h * sm) * dP;
+    y += ratio * m * (g * sm - h * cm) * P[n][m] / c;
+    z -= (n + 1) * ratio * (g * cm + h * sm) * P[n][m];
+  }
+  //*** back from geocentric to geodetic north
+  double north = x * cos(phiC - phi) - z * sin(phiC - phi);
+  return atan2(y, north) * RAD_TO_DEG;
+}
+
+void VariationModel::update(double lat, double lon, long date)
+{
+  static const int daysBefore[] = {0, 31, 59, 90, 120, 151, 181, 212, 243, 273, 304, 334};
+  int day = date / 10000;
+  int month = constrain((date / 100) % 100, 1, 12);
+  int year = 2000 + date % 100;
+
+  modelLat = lat;
+  modelLon = lon;
+  modelDate = date;
+  modelYear = year + (daysBefore[month - 1] + day - 0.5) / 365.25;
+  variation = calculate(lat, lon, modelYear) + offset;
+  hasModel = true;
+  evaluations++;
+}
+
+void VariationModel::evaluate(NMEAData &nmea)
+{
+  if (calibratedFor != config.homeVariation)
+  {
+    //*** the home_variation setting is new or was changed on the console
+    calibratedFor = config.homeVariation;
+    offset = config.homeVariation - calculate(HOME_LAT, HOME_LON, VARIATION_YEAR);
+    if (hasModel)
+      variation = calculate(modelLat, modelLon, modelYear) + offset;
+  }
+
+  if (nmea.type == NMEA_HDM)
+  {
+    heading = nmeaFloat<HDM_HEADING>(nmea);
+    pending = true;
+  }
+  else if (nmea.type == NMEA_RMC && nmeaChar<RMC_STATUS>(nmea) == 'A' && nmeaText<RMC_DATE>(nmea).length() == 6)
+  {
+    double lat = nmeaDegrees<RMC_LAT>(nmea);
+    double lon = nmeaDegrees<RMC_LON>(nmea);
+    long date = nmeaText<RMC_DATE>(nmea).toInt();
+    if (!hasModel || date != modelDate || distanceNM(lat, lon, modelLat, modelLon) > VARIATION_DISTANCE)
+      update(lat, lon, date);
+  }
+}
+
+void VariationModel::handle()
+{
+  char sentence[NMEA_BUFFER_SIZE + 1];
+  if (!pending)
+    return;
+  pending = false;
+
+  float var = getVariation();
+  if (formatHDG(sentence, sizeof(sentence), config.talkerId, heading, var) > 0)
+    NmeaParser.parseNMEASentence(sentence);
+  float trueHeading = fmod(heading + var + 360, 360);
+  if (formatHDT(sentence, sizeof(sentence), config.talkerId, trueHeading) > 0)
+    NmeaParser.parseNMEASentence(sentence);
+}
+
+float VariationModel::getVariation()
+{
+  return hasModel ? variation : config.homeVariation;
+}
+
+void VariationModel::print()
+{
+  Serial.printf("Variation: %.2f %c\n", fabs(getVariation()), getVariation() < 0 ? 'W' : 'E');
+  if (hasModel)
+    Serial.printf("Model at %.4f, %.4f in %.2f, %lu evaluations\n", modelLat, modelLon, modelYear, evaluations);
+  else
+    Serial.println("No position fix, the home_variation setting is used");
+  Serial.printf("Home variation: %.2f at %.3f, %.3f in %.2f\n", config.homeVariation, HOME_LAT, HOME_LON, VARIATION_YEAR);
+}
+
+VariationModel Variation;
+
+/*
+  Initialize the NMEA Talker port and baudrate
+  on RX/TX port 2 to the multiplexer
+*/
+void initializeTalker()
+{
+  nmeaSerialOut.begin(config.talkerRate, SWSERIAL_8N1, 22, TALKER_PORT, true);
+#ifdef DEBUG
+  debugWrite("Talker initialized...");
+#endif
+}
+
+/*
+  Purpose:  Power manager to spare the battery on the mooring
+            - Active; sentences are coming in, the CPU runs at CPU_FREQ_ACTIVE
+            - Idle; no sentence for POWER_IDLE_TIMEOUT, the CPU runs at CPU_FREQ_IDLE and with
+              light_sleep on it sleeps between the UART events. The start bit on the listener,
+              a touch on the Nextion or the POWER_SLEEP_TIME timer wake it up again.
+            - Low voltage; the battery is below power_low, the reduced output mode. Wi-Fi is
+              switched off, the CPU runs at CPU_FREQ_IDLE and the display stays dimmed.
+              The talker, N2K and the alarms keep running.
+            The display task dims the Nextion after display_dim and puts it to sleep after
+            display_sleep seconds without a touch. The time spent in every state is measured
+            and shown with the power command on the console.
+  NOTE:     While in light sleep the Wi-Fi access point and the N2K controller stop as well,
+            so with Wi-Fi attached it only sleeps in the low voltage mode when Wi-Fi is off.
+ */
+enum PowerState
+{
+  POWER_ACTIVE,
+  POWER_IDLE,
+  POWER_LOW_VOLTAGE,
+  NR_OF_POWER_STATES
+};
+
+enum DisplayState
+{
+  DISPLAY_AWAKE,
+  DISPLAY_DIMMED,
+  DISPLAY_ASLEEP,
+  NR_OF_DISPLAY_STATES
+};
+
+const char *powerStateTexts[NR_OF_POWER_STATES] = {"Active", "Idle", "Low voltage"};
+const char *displayStateTexts[NR_OF_DISPLAY_STATES] = {"Awake", "Dimmed", "Asleep"};
+
+class PowerManager
+{
+public:
+  PowerManager();
+  void begin();
+  void evaluate(NMEAData &nmea);            // follow the battery voltage
+  void handle();                            // switch the power state and sleep when idle
+  void setDisplayState(DisplayState state); // called by the display task
+  bool isLowVoltage();
+  void print();                             // show the time per state on the console
+
+private:
+  PowerState state = POWER_ACTIVE;
+  DisplayState displayState = DISPLAY_AWAKE;
+  bool lowVoltage = false;
+  unsigned long lastCounter = 0;
+  unsigned long lastActivity = 0;
+  unsigned long stateSince = 0;
+  unsigned long displaySince = 0;
+  unsigned long stateTime[NR_OF_POWER_STATES];
+  unsigned long displayTime[NR_OF_DISPLAY_STATES];
+  unsigned long sleeps = 0;
+  unsigned long sleepTime = 0; // ms in light sleep
+  void enter(PowerState newState);
+  void lightSleep();
+  void printTime(const char *name, unsigned long time, unsigned long total);
+};
+
+PowerManager::PowerManager()
+{
+  for (int i = 0; i < NR_OF_POWER_STATES; i++)
+    stateTime[i] = 0;
+  for (int i = 0; i < NR_OF_DISPLAY_STATES; i++)
+    displayTime[i] = 0;
+}
+
+void PowerManager::begin()
+{
+  setCpuFrequencyMhz(CPU_FREQ_ACTIVE);
+  //*** the listener wakeup follows its polarity, see initializeListener()
+#ifdef NEXTION_ATTACHED
+  gpio_wakeup_enable((gpio_num_t)NEXTION_RX, GPIO_INTR_LOW_LEVEL);
+#endif
+  esp_sleep_enable_gpio_wakeup();
+  stateSince = millis();
+  displaySince = stateSince;
+  lastActivity = stateSince;
+}
+
+/*
+  The low voltage mode is left again above power_low plus the hysteresis,
+  a power_low of 0 disables it
+*/
+void PowerManager::evaluate(NMEAData &nmea)
+{
+  if (nmea.type != NMEA_XDR || nmeaText<XDR_NAME>(nmea) != "BATT")
+    return;
+  float voltage = nmeaFloat<XDR_VALUE>(nmea);
+  if (config.powerLow <= 0)
+    lowVoltage = false;
+  else if (voltage < config.powerLow)
+    lowVoltage = true;
+  else if (voltage > config.powerLow + POWER_HYSTERESIS)
+    lowVoltage = false;
+}
+
+void PowerManager::handle()
+{
+  unsigned long now = millis();
+  unsigned long counter = NmeaParser.getCounter();
+  if (counter != lastCounter)
+  {
+    lastCounter = counter;
+    lastActivity = now;
+  }
+
+  bool idle = now - lastActivity > POWER_IDLE_TIMEOUT;
+  PowerState wanted = lowVoltage ? POWER_LOW_VOLTAGE : (idle ? POWER_IDLE : POWER_ACTIVE);
+  if (wanted != state)
+    enter(wanted);
+
+  if (idle && config.lightSleep)
+    lightSleep();
+}
+
+void PowerManager::enter(PowerState newState)
+{
+  unsigned long now = millis();
+  stateTime[state] += now - stateSince;
+  stateSince = now;
+
+  uint32_t frequency = (newState == POWER_ACTIVE) ? CPU_FREQ_ACTIVE : CPU_FREQ_IDLE;
+  if (frequency != getCpuFrequencyMhz())
+  {
+    setCpuFrequencyMhz(frequency);
+    //*** the bit timing of the software serial is calculated from the CPU frequency in begin()
+    nmeaSerialOut.end();
+    initializeTalker();
+  }
+#ifdef WIFI_ATTACHED
+  if (newState == POWER_LOW_VOLTAGE)
+    NmeaNet.end();
+  else if (state == POWER_LOW_VOLTAGE)
+    NmeaNet.begin();
+#endif
+#ifdef DEBUG
+  debugWrite(String("Power state: ") + powerStateTexts[newState]);
+#endif
+  state = newState;
+}
+
+/*
+  Sleep until the next UART event or POWER_SLEEP_TIME, so the supervisor and the
+  alarms keep running. The byte waking it up is lost, the decoder resyncs on the next
+  start delimiter. A wake up by a pin counts as activity, so it stays awake for the
+  sentences that follow.
+*/
+void PowerManager::lightSleep()
+{
+  if (NmeaStack.getIndex() > 0)
+    return; // output waiting
+#ifdef WIFI_ATTACHED
+  if (state != POWER_LOW_VOLTAGE)
+    return; // the access point has to stay awake
+#endif
+  unsigned long start = millis();
+  esp_sleep_enable_timer_wakeup(POWER_SLEEP_TIME * 1000ULL);
+  esp_light_sleep_start();
+  sleepTime += millis() - start;
+  sleeps++;
+  if (esp_sleep_get_wakeup_cause() == ESP_SLEEP_WAKEUP_GPIO)
+    lastActivity = millis();
+}
+
+void PowerManager::setDisplayState(DisplayState newState)
+{
+  unsigned long now = millis();
+  displayTime[displayState] += now - displaySince;
+  displaySince = now;
+  displayState = newState;
+}
+
+bool PowerManager::isLowVoltage()
+{
+  return lowVoltage;
+}
+
+void PowerManager::printTime(const char *name, unsigned long time, unsigned long total)
+{
+  Serial.printf("  %s: %lu s (%.1f%%)\n", name, time / 1000, total > 0 ? 100.0 * time / total : 0.0);
+}
+
+void PowerManager::print()
+{
+  unsigned long now = millis();
+  Serial.printf("Power state: %s at %lu MHz\n", powerStateTexts[state], (unsigned long)getCpuFrequencyMhz());
+  for (int i = 0; i < NR_OF_POWER_STATES; i++)
+  {
+    printTime(powerStateTexts[i], stateTime[i] + (i == state ? now - stateSince : 0), now);
+  }
+  Serial.printf("Light sleep: %lu times, %lu s\n", sleeps, sleepTime / 1000);
+#ifdef NEXTION_ATTACHED
+  Serial.printf("Display: %s\n", displayStateTexts[displayState]);
+  for (int i = 0; i < NR_OF_DISPLAY_STATES; i++)
+  {
+    printTime(displayStateTexts[i], displayTime[i] + (i == displayState ? now - displaySince : 0), now);
+  }
+#endif
+}
+
+PowerManager Power;
+DisplayState displayState = DISPLAY_AWAKE; // state of the Nextion, owned by the display task
+
+void evaluateSentence(NMEAData &nmea)
+{
+  Alarms.evaluate(nmea);
+  Variation.evaluate(nmea);
+  Power.evaluate(nmea);
+}
+
+/*
+  Send a command to the Nextion without waiting for the reply and, unlike
+  sendCommand(), without flushing the events waiting in the receive buffer
+*/
+void nextionCommand(const char *cmd)
+{
+  nexSerial.print(cmd);
+  nexSerial.write(0xFF);
+  nexSerial.write(0xFF);
+  nexSerial.write(0xFF);
+}
+
+void nextionSetText(const char *object, const char *text)
+{
+  char cmd[NEXTION_CMD_BUFFER];
+  snprintf(cmd, NEXTION_CMD_BUFFER, "%s.txt=\"%s\"", object, text);
+  nextionCommand(cmd);
+}
+
+void nextionPage(byte page)
+{
+  char cmd[NEXTION_CMD_BUFFER];
+  snprintf(cmd, NEXTION_CMD_BUFFER, "page %d", page);
+  nextionCommand(cmd);
+  activePage = page;
+}
+
+void nextionDim(int level)
+{
+  char cmd[NEXTION_CMD_BUFFER];
+  dimLevel = constrain(level, DIM_MIN, 100);
+  snprintf(cmd, NEXTION_CMD_BUFFER, "dim=%d", dimLevel);
+  nextionCommand(cmd);
+}
+
+/*
+  Calculate TWS from AWA and SOG as described Starpath TrueWind by, David Burch, 2000
+  TWS= SQRT( SOG^2*AWS^2 + (2*SOG*AWA*COS(AWA/180)))
+*/
+double trueWindSpeed(double sog, double awa, double aws)
+{
+  return sqrt(sog * sog + aws * aws - (2 * sog * aws * cos(awa * PI / 180)));
+}
+
+/*
+  The display values and the sentence ID they come from. When the selected source
+  of a value goes stale, the placeholder is shown instead of freezing on the last number
+  and the Nextion components showing the value are greyed out.
+*/
+typedef struct
+{
+  const char *sentenceId;
+  char *buffer;
+  const char *placeholder;
+  const char *components[2]; // on the HMI pages, NULL if there is only one
+  volatile bool stale;       // set by the supervisor
+  bool greyed;               // as shown, display task only
+} DisplayField;
+
+DisplayField displayFields[] = {
+    {"RMC", nb_SOG, "--.-", {"speed.sog", NULL}, false, false},
+    {"RMC", nb_COG, "---.-", {"course.cog", NULL}, false, false},
+    {"VHW", nb_STW, "--.-", {"speed.stw", NULL}, false, false},
+    {"VWR", nb_AWS, "--.-", {"speed.aws", NULL}, false, false},
+    {"VWR", nb_AWA, "---", {"speed.awa", NULL}, false, false},
+    {"HDM", nb_HDG, "--.-", {"course.hdg", NULL}, false, false},
+    {"DBK", nb_DPT, "--.-", {"course.dpt", NULL}, false, false},
+    {"TOB", nb_BAT, "--.-", {"speed.bat", "trip.bat"}, false, false},
+    {"MTW", nb_MTW, "--.-", {"trip.mtw", NULL}, false, false},
+    {"VLW", nb_LOG, "--.-", {"trip.log", NULL}, false, false},
+    {"VLW", nb_TRP, "--.-", {"course.trp", "trip.trp"}, false, false}};
+
+#define NEXTION_TWS "speed.tws" // TWS is calculated, it is stale when one of its inputs is
+bool twsGreyed = false;          // display task only
+
+/*
+  Set the text color of a component, grey for a stale value
+*/
+void nextionGrey(const char *component, bool grey)
+{
+  char cmd[NEXTION_CMD_BUFFER];
+  snprintf(cmd, NEXTION_CMD_BUFFER, "%s.pco=%u", component, grey ? GREY : WHITE);
+  nextionCommand(cmd);
+}
+
+/*
+  Grey out the stale values and restore the live ones; only a change is sent
+*/
+void greyStaleValues(bool twsStale)
+{
+  for (unsigned int i = 0; i < sizeof(displayFields) / sizeof(displayFields[0]); i++)
+  {
+    DisplayField &field = displayFields[i];
+    bool stale = field.stale;
+    if (stale == field.greyed)
+      continue;
+    for (int c = 0; c < 2 && field.components[c] != NULL; c++)
+      nextionGrey(field.components[c], stale);
+    field.greyed = stale;
+  }
+  if (twsStale != twsGreyed)
+  {
+    nextionGrey(NEXTION_TWS, twsStale);
+    twsGreyed = twsStale;
+  }
+}
+
+/*** Converts and adjusts the incomming values to usable values for the HMI display 
+ * and concatenates these values in one string so it can be send in one command to the 
+ * Nextion HMI in timed intervals of 50ms.
+ * This is due the fact that a timer in the HMI checks on new data and refreshes the 
+ * display. So no need to send more data than you can chew!
+ * A refresh of 20x per second is more then sufficient.
+ * The string is formatted like:
+ * <Sentence ID1>=<Value1>#....<Sentence IDn>=<Value_n>#
+ * Sentence ID = 3 chars i.e. SOG, COG etc
+ * Value can be an integer or float with 1 decimal and max 5 char long incl. delimiter
+ * i.e. SOG=6.4#COG=213.2#BAT=12.5#AWA=37#AWS=15.7#
+ * The order is not applicable, so can be random
+ */
+void displayData()
+{
+  char _BITVAL[255] = {0};
+  char cog[FIELD_BUFFER], awa[FIELD_BUFFER], sog[FIELD_BUFFER], aws[FIELD_BUFFER], bat[FIELD_BUFFER], dpt[FIELD_BUFFER];
+  char trp[FIELD_BUFFER], distance[FIELD_BUFFER], mtw[FIELD_BUFFER], hdg[FIELD_BUFFER], stw[FIELD_BUFFER];
+
+  //*** only copy the values under the lock, the other core spins on it with its
+  //*** interrupts off, so the conversions and the formatting are done outside it
+  portENTER_CRITICAL(&displayMux);
+  memcpy(cog, nb_COG, FIELD_BUFFER);
+  memcpy(awa, nb_AWA, FIELD_BUFFER);
+  memcpy(sog, nb_SOG, FIELD_BUFFER);
+  memcpy(aws, nb_AWS, FIELD_BUFFER);
+  memcpy(bat, nb_BAT, FIELD_BUFFER);
+  memcpy(dpt, nb_DPT, FIELD_BUFFER);
+  memcpy(trp, nb_TRP, FIELD_BUFFER);
+  memcpy(distance, nb_LOG, FIELD_BUFFER);
+  memcpy(mtw, nb_MTW, FIELD_BUFFER);
+  memcpy(hdg, nb_HDG, FIELD_BUFFER);
+  memcpy(stw, nb_STW, FIELD_BUFFER);
+  portEXIT_CRITICAL(&displayMux);
+
+  // if cog is a number
+  if (isNumeric(cog))
+  {
+    strcat(_BITVAL, "COG=");
+    strcat(_BITVAL, cog);
+    strcat(_BITVAL, "#");
+  }
+
+  //set awa if is a number
+  if (isNumeric(awa))
+  {
+    strcat(_BITVAL, "AWA=");
+    strcat(_BITVAL, awa);
+    strcat(_BITVAL, "#");
+  }
+
+  //set sog if is a number
+  if (isNumeric(sog))
+  {
+    strcat(_BITVAL, "SOG=");
+    strcat(_BITVAL, sog);
+    strcat(_BITVAL, "#");
+  }
+
+  // set aws is is a number
+  if (isNumeric(aws))
+  {
+    strcat(_BITVAL, "AWS=");
+    strcat(_BITVAL, aws);
+    strcat(_BITVAL, "#");
+  }
+
+  // set BATT is is a number
+  if (isNumeric(bat))
+  {
+    strcat(_BITVAL, "BAT=");
+    strcat(_BITVAL, bat);
+    strcat(_BITVAL, "#");
+  }
+  // set dpt if is a number
+  if (isNumeric(dpt))
+  {
+    strcat(_BITVAL, "DPT=");
+    strcat(_BITVAL, dpt);
+    strcat(_BITVAL, "#");
+  }
+  // set trp if is a number
+  if (isNumeric(trp))
+  {
+    strcat(_BITVAL, "TRP=");
+    strcat(_BITVAL, trp);
+    strcat(_BITVAL, "#");
+  }
+  // set log if is a number
+  if (isNumeric(distance))
+  {
+    strcat(_BITVAL, "LOG=");
+    strcat(_BITVAL, distance);
+    strcat(_BITVAL, "#");
+  }
+  // set WTR if is a number
+  if (isNumeric(mtw))
+  {
+    strcat(_BITVAL, "MTW=");
+    strcat(_BITVAL, mtw);
+    strcat(_BITVAL, "#");
+  }
+  // set hdg if is a number
+  if (isNumeric(hdg))
+  {
+    strcat(_BITVAL, "HDG=");
+    strcat(_BITVAL, hdg);
+    strcat(_BITVAL, "#");
+  }
+  // set stw if is a number
+  if (isNumeric(stw))
+  {
+    strcat(_BITVAL, "STW=");
+    strcat(_BITVAL, stw);
+    strcat(_BITVAL, "#");
+  }
+  //*** no TWS from a placeholder, that would show the AWS as TWS
+  bool twsStale = !hasValue(sog) || !hasValue(awa) || !hasValue(aws);
+  if (twsStale)
+    strcpy(nb_TWS, "--.-");
+  else
+    sprintf(nb_TWS, "%.1f", trueWindSpeed(atof(sog), atof(awa), atof(aws)));
+  strcat(_BITVAL, "TWS=");
+  strcat(_BITVAL, nb_TWS);
+  strcat(_BITVAL, "#");
+  //*** Nextion display timer max speed is 50ms
+  // so no need to send faster than 50ms otherwise
+  // flooding the serialbuffer
+  if (millis() - tmr1 > config.nextionSndDelay)
+  {
+    tmr1 = millis();
+#ifdef NEXTION_ATTACHED
+
+    if (strcmp(oldVal, _BITVAL) != 0)
+    {
+
+      strcpy(oldVal, _BITVAL);
+
+      dbSerial.print("Sending NMEA data: ");
+      nextionSetText(WINDDISPLAY_NMEA, _BITVAL);
+      dbSerial.println(_BITVAL);
+    }
+    greyStaleValues(twsStale);
+
+#endif
+
+    newData = false;
+  }
+}
+
+/*
+  Copy a field into a display buffer; only FIELD_BUFFER - 1 chars are copied,
+  so the buffer stays terminated
+*/
+void setDisplayValue(char *buffer, const NMEAField &field)
+{
+  strncpy(buffer, field.c_str(), FIELD_BUFFER - 1);
+}
+
+//*** lat,N/S,lon,E/W of the schema fields of a sentence
+template <NMEAFieldId lat, NMEAFieldId lon>
+void savePosition(const NMEAData &nmea)
+{
+  snprintf(lastPosition, sizeof(lastPosition), "%s,%s,%s,%s", nmeaText<lat>(nmea).c_str(),
+           nmeaHemisphere<lat>(nmea).c_str(), nmeaText<lon>(nmea).c_str(), nmeaHemisphere<lon>(nmea).c_str());
+}
+
+/*
+  Keep the position of the last valid fix of an RMC or GLL for the MOB waypoint.
+  Without a fix the status is V and the fields are empty, which the parser stores as "0".
+*/
+void updatePosition(const NMEAData &nmea)
+{
+  if (nmea.type == NMEA_RMC && nmeaChar<RMC_STATUS>(nmea) == 'A')
+    savePosition<RMC_LAT, RMC_LON>(nmea);
+  else if (nmea.type == NMEA_GLL && nmeaChar<GLL_STATUS>(nmea) == 'A')
+    savePosition<GLL_LAT, GLL_LON>(nmea);
+}
+
+/*
+ * Start reading converted NNMEA sentences from the stack
+ * and write them to Serial Port 2 to send them to the 
+ * external NMEA device.
+ * Update the display with the value(s) send
+ */
+byte startTalking()
+{
+  NMEAData nmeaOut;
+
+  //*** for all  NMEAData opjects on the stack
+  //*** NOTE; the stack has a buffer of NMEA_BUFFER_SIZE objects
+  //***       normaly only 1 or 2 should be on the stack
+  //***       if the stack is full your timing is out of control
+
+  if (NmeaStack.pop(nmeaOut))
+  {
+
+    unsigned long writeStart = micros();
+    for (int i = 0; i < (int)nmeaOut.sentence.length(); i++)
+    {
+      nmeaSerialOut.write(nmeaOut.sentence[i]);
+    }
+    Scheduler.sent(nmeaOut, micros() - writeStart);
+#ifdef WIFI_ATTACHED
+    NmeaNet.queue(nmeaOut.sentence.c_str(), nmeaOut.sentence.length());
+#endif
+#ifdef N2K_ATTACHED
+    NmeaN2K.update(nmeaOut);
+#endif
+#ifdef LOGBOOK_ATTACHED
+    Trip.update(nmeaOut);
+#endif
+    if (firstSentenceTime == 0)
+    {
+      firstSentenceTime = millis();
+      Serial.printf("Boot to first forwarded sentence: %lu ms\n", firstSentenceTime);
+    }
+
+#ifdef DEBUG
+    debugWrite(String(" Sending :") + nmeaOut.sentence.c_str());
+#endif
+  }
+#ifdef NEXTION_ATTACHED
+  // check which screens is active and update with data
+  // switch (active_menu_button)
+  // {
+
+  // speeds are checked for values <100; Higher is non existant
+  //*** the conversions are done before taking the lock, see displayData()
+  char trip[FIELD_BUFFER];
+  if (nmeaOut.type == NMEA_VLW)
+  {
+    tripTotal = nmeaFloat<VLW_TRIP>(nmeaOut);
+    snprintf(trip, FIELD_BUFFER, "%.2f", tripTotal - tripOffset);
+  }
+  portENTER_CRITICAL(&displayMux);
+  if (nmeaOut.type == NMEA_RMC)
+  {
+    setDisplayValue(nb_SOG, nmeaText<RMC_SOG>(nmeaOut));
+  }
+  if (nmeaOut.type == NMEA_VHW)
+  {
+    setDisplayValue(nb_STW, nmeaText<VHW_STW>(nmeaOut));
+  }
+  if (nmeaOut.type == NMEA_VWR)
+  {
+    setDisplayValue(nb_AWS, nmeaText<VWR_AWS>(nmeaOut));
+    setDisplayValue(nb_AWA, nmeaText<VWR_ANGLE>(nmeaOut));
+    if (nmeaChar<VWR_SIDE>(nmeaOut) == 'L')
+    {
+      memmove(nb_AWA + 1, nb_AWA, FIELD_BUFFER - 2);
+      nb_AWA[0] = '-';
+    }
+  }
+  if (nmeaOut.type == NMEA_RMC)
+  {
+    setDisplayValue(nb_COG, nmeaText<RMC_COG>(nmeaOut));
+  }
+  if (nmeaOut.type == NMEA_HDG)
+  {
+    setDisplayValue(nb_HDG, nmeaText<HDG_HEADING>(nmeaOut));
+  }
+  if (nmeaOut.type == NMEA_DPT)
+  {
+    setDisplayValue(nb_DPT, nmeaText<DPT_DEPTH>(nmeaOut));
+  }
+
+  if (nmeaOut.type == NMEA_XDR)
+  {
+    if (nmeaText<XDR_NAME>(nmeaOut) == "BATT")
+    {
+      setDisplayValue(nb_BAT, nmeaText<XDR_VALUE>(nmeaOut));
+    }
+  }
+  if (nmeaOut.type == NMEA_MTW)
+  {
+    setDisplayValue(nb_MTW, nmeaText<MTW_TEMPERATURE>(nmeaOut));
+  }
+  if (nmeaOut.type == NMEA_VLW)
+  {
+    setDisplayValue(nb_LOG, nmeaText<VLW_TOTAL>(nmeaOut));
+    memcpy(nb_TRP, trip, FIELD_BUFFER);
+  }
+  portEXIT_CRITICAL(&displayMux);
+
+  Serial.print(nmeaOut.sentence.c_str());
+
+#endif
+
+  updatePosition(nmeaOut);
+
+  return 1;
+}
+
+/*
+  Capture the Man Over Board position and send it as waypoint MOB
+  i.e. $AOWPL,5251.5621,N,00540.8482,E,MOB*hh
+*/
+void captureMOB()
+{
+  char wpl[NMEA_BUFFER_SIZE + 1];
+  mobRequested = false;
+  if (lastPosition[0] == '\0' || formatWPL(wpl, sizeof(wpl), config.talkerId, lastPosition, "MOB") == 0)
+    return;
+  NmeaParser.parseNMEASentence(wpl);
+  Serial.print("MOB position captured: ");
+  Serial.println(lastPosition);
+}
+
+/**********************************************************************************
+  Purpose:  Display task handling the Nextion HMI apart from the NMEA data path
+            - Reading the touch and page events from UART2 without blocking, the
+              Nextion library waits up to NEXTION_RCV_DELAY ms for each reply
+            - Handling the events from a fixed size queue
+            - Refreshing the display data
+  NOTE:     A Nextion return message is terminated by 0xFF 0xFF 0xFF, i.e.
+            0x65 <page> <component> <touch event> 0xFF 0xFF 0xFF for a touch event
+            0x66 <page> 0xFF 0xFF 0xFF for the current page
+*/
+
+/*
+  Decode an incomming byte from the Nextion and queue the event after
+  the 3rd 0xFF terminator
+*/
+void decodeNextionInput(byte cIn)
+{
+  if (nextionIndex < NEXTION_RX_BUFFER)
+    nextionBuffer[nextionIndex++] = cIn;
+  else
+    nextionIndex = NEXTION_RX_BUFFER; // too long, wait for the terminator to resync
+
+  if (cIn != 0xFF)
+  {
+    nextionTerminator = 0;
+    return;
+  }
+  if (++nextionTerminator < 3)
+    return;
+
+  //*** complete message received
+  NextionEvent event;
+  event.type = NEX_NONE;
+  if (nextionBuffer[0] == NEX_RET_TOUCH && nextionIndex == 7)
+  {
+    event.type = NEX_TOUCH;
+    event.page = nextionBuffer[1];
+    event.component = nextionBuffer[2];
+    event.pressed = nextionBuffer[3];
+  }
+  else if (nextionBuffer[0] == NEX_RET_PAGE && nextionIndex == 5)
+  {
+    event.type = NEX_PAGE;
+    event.page = nextionBuffer[1];
+    event.component = 0;
+    event.pressed = 0;
+  }
+  else if (nextionBuffer[0] == NEX_RET_WAKE && nextionIndex == 4)
+  {
+    event.type = NEX_WAKE;
+    event.page = 0;
+    event.component = 0;
+    event.pressed = 0;
+  }
+  else if (nextionBuffer[0] == NEX_RET_TRANSPARENT_READY && nextionIndex == 4)
+  {
+    nextionTransparentReady = true;
+  }
+  //*** all other replies like the command acknowledges are ignored
+  if (event.type != NEX_NONE)
+    xQueueSend(nextionEvents, &event, 0); // if the queue is full the event is lost
+  health.lastNextionReply = millis();       // any reply shows the Nextion is alive
+
+  nextionIndex = 0;
+  nextionTerminator = 0;
+}
+
+void readNextionInput()
+{
+  while (nexSerial.available() > 0)
+  {
+    decodeNextionInput(nexSerial.read());
+  }
+}
+
+/*
+  Purpose:  Trend graphs on the Nextion fed from a history kept on the ESP32
+            - Every second the depth, TWS, SOG and battery shown on the display are
+              sampled, an instrument without new data keeps its last value
+            - Per instrument a ring of TREND_POINTS points at 1 s, 1 min and 10 min; each
+              point of a lower resolution is the average of the points above it
+            - The points are stored scaled to the waveform height, so they are sent as
+              they are. Only the new points are sent; a few with add, more with one addt
+              per channel, i.e. after a page change or another resolution
+            All of it runs in the display task, only the sample is taken under displayMux.
+*/
+enum TrendInstrument
+{
+  TREND_DEPTH,
+  TREND_TWS,
+  TREND_SOG,
+  TREND_BATTERY,
+  NR_OF_TRENDS
+};
+
+enum TrendResolution
+{
+  TREND_1S,
+  TREND_1MIN,
+  TREND_10MIN,
+  NR_OF_TREND_RESOLUTIONS
+};
+
+typedef struct
+{
+  float min; // value at the bottom of the waveform
+  float max; // value at the top of the waveform
+} TrendScale;
+
+//*** per instrument in TrendInstrument order, a channel of the waveform each
+const TrendScale trendScales[NR_OF_TRENDS] = {{0, 30}, {0, 40}, {0, 10}, {11, 15}};
+//*** the nr of points of the resolution above making a point
+const unsigned int trendFactors[NR_OF_TREND_RESOLUTIONS] = {1, 60, 10};
+const char *const trendResolutionNames[NR_OF_TREND_RESOLUTIONS] = {"1 s", "1 min", "10 min"};
+
+class TrendHistory
+{
+public:
+  TrendHistory();
+  void sample();                   // take the 1 s sample when it is time
+  void record(const float *values); // add a 1 s point for all instruments
+  void feed();                     // send the new points when the trend page is shown
+  void nextResolution();
+  void redraw();                   // send all points again
+  unsigned long getCount(TrendResolution resolution); // nr of points recorded
+  byte getPoint(TrendInstrument trend, TrendResolution resolution, unsigned long index);
+
+private:
+  byte points[NR_OF_TRENDS][NR_OF_TREND_RESOLUTIONS][TREND_POINTS];
+  unsigned long count[NR_OF_TREND_RESOLUTIONS];     // nr of points recorded since startup
+  float sums[NR_OF_TRENDS][NR_OF_TREND_RESOLUTIONS]; // of the points making the next one
+  unsigned int parts[NR_OF_TREND_RESOLUTIONS];      // nr of points in sums
+  float last[NR_OF_TRENDS];                         // last value of an instrument
+  unsigned long lastSample = 0;                     // ms
+  byte resolution = TREND_1S;                       // shown on the waveform
+  unsigned long sent = 0;                           // nr of points of resolution on the waveform
+  bool fullRedraw = true;
+  void add(byte level, const float *values);
+  byte scale(int trend, float value);
+  bool sendBatch(byte channel, unsigned long from, unsigned long to);
+};
+
+TrendHistory::TrendHistory()
+{
+  for (int r = 0; r < NR_OF_TREND_RESOLUTIONS; r++)
+  {
+    count[r] = 0;
+    parts[r] = 0;
+    for (int t = 0; t < NR_OF_TRENDS; t++)
+      sums[t][r] = 0;
+  }
+  for (int t = 0; t < NR_OF_TRENDS; t++)
+    last[t] = trendScales[t].min;
+}
+
+byte TrendHistory::scale(int trend, float value)
+{
+  const TrendScale &range = trendScales[trend];
+  float y = (value - range.min) * TREND_HEIGHT / (range.max - range.min);
+  return (byte)constrain(y + 0.5, 0, TREND_HEIGHT);
+}
+
+void TrendHistory::add(byte level, const float *values)
+{
+  unsigned int slot = count[level] % TREND_POINTS;
+  for (int t = 0; t < NR_OF_TRENDS; t++)
+  {
+    points[t][level][slot] = scale(t, values[t]);
+    if (level + 1 < NR_OF_TREND_RESOLUTIONS)
+      sums[t][level + 1] += values[t];
+  }
+  count[level]++;
+
+  if (level + 1 >= NR_OF_TREND_RESOLUTIONS || ++parts[level + 1] < trendFactors[level + 1])
+    return;
+  float averages[NR_OF_TRENDS];
+  for (int t = 0; t < NR_OF_TRENDS; t++)
+  {
+    averages[t] = sums[t][level + 1] / parts[level + 1];
+    sums[t][level + 1] = 0;
+  }
+  parts[level + 1] = 0;
+  add(level + 1, averages);
+}
+
+void TrendHistory::record(const float *values)
+{
+  add(TREND_1S, values);
+}
+
+void TrendHistory::sample()
+{
+  unsigned long now = millis();
+  if (now - lastSample < TREND_SAMPLE_INTERVAL)
+    return;
+  lastSample = now;
+
+  char depth[FIELD_BUFFER], sog[FIELD_BUFFER], awa[FIELD_BUFFER], aws[FIELD_BUFFER], battery[FIELD_BUFFER];
+  portENTER_CRITICAL(&displayMux);
+  memcpy(depth, nb_DPT, FIELD_BUFFER);
+  memcpy(sog, nb_SOG, FIELD_BUFFER);
+  memcpy(awa, nb_AWA, FIELD_BUFFER);
+  memcpy(aws, nb_AWS, FIELD_BUFFER);
+  memcpy(battery, nb_BAT, FIELD_BUFFER);
+  portEXIT_CRITICAL(&displayMux);
+
+  if (hasValue(depth))
+    last[TREND_DEPTH] = atof(depth);
+  if (hasValue(sog))
+    last[TREND_SOG] = atof(sog);
+  if (hasValue(battery))
+    last[TREND_BATTERY] = atof(battery);
+  if (hasValue(sog) && hasValue(awa) && hasValue(aws))
+    last[TREND_TWS] = trueWindSpeed(atof(sog), atof(awa), atof(aws));
+  record(last);
+}
+
+/*
+  addt <id>,<channel>,<qty> makes the Nextion answer 0xFE when it is ready for
+  the qty data bytes
+*/
+bool TrendHistory::sendBatch(byte channel, unsigned long from, unsigned long to)
+{
+  char cmd[NEXTION_CMD_BUFFER];
+  snprintf(cmd, NEXTION_CMD_BUFFER, "addt %d,%d,%lu", NEXTION_TREND_ID, channel, to - from);
+  nextionTransparentReady = false;
+  nextionCommand(cmd);
+  unsigned long start = millis();
+  while (!nextionTransparentReady)
+  {
+    if (millis() - start > NEXTION_ADDT_TIMEOUT)
+      return false;
+    vTaskDelay(1);
+    readNextionInput();
+  }
+  for (unsigned long i = from; i < to; i++)
+    nexSerial.write(points[channel][resolution][i % TREND_POINTS]);
+  return true;
+}
+
+void TrendHistory::feed()
+{
+  //*** the Nextion clears the waveform when it leaves the page
+  if (activePage != PAGE_TREND)
+  {
+    fullRedraw = true;
+    return;
+  }
+  char cmd[NEXTION_CMD_BUFFER];
+  unsigned long available = count[resolution];
+  if (fullRedraw)
+  {
+    fullRedraw = false;
+    nextionSetText(NEXTION_TREND_RES, trendResolutionNames[resolution]);
+    snprintf(cmd, NEXTION_CMD_BUFFER, "cle %d,255", NEXTION_TREND_ID);
+    nextionCommand(cmd);
+    sent = 0;
+  }
+  if (available - sent > TREND_POINTS)
+    sent = available - TREND_POINTS; // older points are overwritten in the ring
+  if (available == sent)
+    return;
+
+  if (available - sent <= TREND_ADD_LIMIT)
+  {
+    for (unsigned long i = sent; i < available; i++)
+    {
+      for (byte channel = 0; channel < NR_OF_TRENDS; channel++)
+      {
+        snprintf(cmd, NEXTION_CMD_BUFFER, "add %d,%d,%d", NEXTION_TREND_ID, channel,
+                 points[channel][resolution][i % TREND_POINTS]);
+        nextionCommand(cmd);
+      }
+    }
+  }
+  else
+  {
+    for (byte channel = 0; channel < NR_OF_TRENDS; channel++)
+    {
+      if (!sendBatch(channel, sent, available))
+      {
+        fullRedraw = true; // try again on the next run
+        return;
+      }
+    }
+  }
+  sent = available;
+}
+
+void TrendHistory::nextResolution()
+{
+  resolution = (resolution + 1) % NR_OF_TREND_RESOLUTIONS;
+  fullRedraw = true;
+}
+
+void TrendHistory::redraw()
+{
+  fullRedraw = true;
+}
+
+unsigned long TrendHistory::getCount(TrendResolution resolution)
+{
+  return count[resolution];
+}
+
+byte TrendHistory::getPoint(TrendInstrument trend, TrendResolution resolution, unsigned long index)
+{
+  return points[trend][resolution][index % TREND_POINTS];
+}
+
+TrendHistory Trends;
+
+void handleNextionEvent(NextionEvent &event)
+{
+  if (event.type == NEX_ALARM)
+  {
+    //*** wake up the display and show the alarm, or hide it when it is over
+    char cmd[NEXTION_CMD_BUFFER];
+    if (event.pressed)
+    {
+      lastTouch = millis();
+      nextionCommand("sleep=0");
+      nextionDim(100);
+      nextionSetText(NEXTION_ALARM, alarmTexts[event.component]);
+    }
+    else
+      nextionSetText(NEXTION_ALARM, "");
+    snprintf(cmd, NEXTION_CMD_BUFFER, "vis %s,%d", NEXTION_ALARM, event.pressed ? 1 : 0);
+    nextionCommand(cmd);
+    return;
+  }
+  if (event.type == NEX_PAGE)
+  {
+    activePage = event.page;
+    return;
+  }
+  if (event.type == NEX_TOUCH || event.type == NEX_WAKE)
+    lastTouch = millis();
+  //*** only act on a release, like the buttons in the HMI do
+  if (event.type != NEX_TOUCH || event.pressed != NEX_RELEASE)
+    return;
+
+  activePage = event.page;
+  switch (event.component)
+  {
+  case BTN_SPEED:
+  case BTN_HOME:
+    activePage = PAGE_SPEED;
+    break;
+  case BTN_COURSE:
+    activePage = PAGE_COURSE;
+    break;
+  case BTN_TRIP:
+    activePage = PAGE_TRIP;
+    break;
+  case BTN_SETTINGS:
+    activePage = PAGE_SETTINGS;
+    break;
+  case BTN_TREND:
+    activePage = PAGE_TREND;
+    break;
+  case BTN_TREND_RES:
+    Trends.nextResolution();
+    break;
+  case BTN_DIMUP:
+    dimLevel = constrain(dimLevel + DIM_STEP, DIM_MIN, 100);
+    break;
+  case BTN_DIMDOWN:
+    dimLevel = constrain(dimLevel - DIM_STEP, DIM_MIN, 100);
+    break;
+  case BTN_RESET:
+    tripOffset = tripTotal;
+    break;
+  case BTN_MOB:
+    //*** the MOB position is captured in the data path on the next loop
+    mobRequested = true;
+    break;
+  }
+}
+
+/*
+  Initialize the Nextion like nexInit() does, but without restarting the
+  debug Serial port, and show the splash screen if requested.
+  This runs in the display task, so the delays do not hold up the NMEA data.
+*/
+void initializeDisplay(bool splash)
+{
+  nexSerial.begin(9600);
+  sendCommand("");
+  sendCommand("bkcmd=1");
+  bool ok = recvRetCommandFinished(NEXTION_RCV_DELAY);
+  sendCommand("page 0");
+  ok = recvRetCommandFinished(NEXTION_RCV_DELAY) && ok;
+  if (ok)
+  {
+    dbSerial.println("Initialisation succesful....");
+  }
+  else
+  {
+    dbSerial.println("Initialisation failed...");
+    dbSerial.println("Resetting Nextion...");
+    sendCommand("rest");
+    vTaskDelay(NEXTION_RESET_DELAY / portTICK_PERIOD_MS);
+  }
+
+  nextionCommand("bkcmd=0"); // no replies on commands from now on, only the events
+  nextionCommand("thup=1");  // a touch wakes the display from sleep
+  if (splash)
+  {
+    dbSerial.println(" Writing version to splash: ");
+    nextionSetText("version", PROGRAM_VERSION);
+    vTaskDelay(SPLASH_DELAY / portTICK_PERIOD_MS);
+  }
+  dbSerial.println("Switcing to page 1: ");
+  nextionPage(PAGE_SPEED);
+  oldVal[0] = '\0'; // send all data again
+  //*** the HMI starts with all values in its normal color
+  for (unsigned int i = 0; i < sizeof(displayFields) / sizeof(displayFields[0]); i++)
+    displayFields[i].greyed = false;
+  twsGreyed = false;
+  Trends.redraw();
+  health.lastNextionReply = millis();
+  lastTouch = millis();
+  displayState = DISPLAY_AWAKE;
+  Power.setDisplayState(DISPLAY_AWAKE);
+}
+
+/*
+  Dim the display and put it to sleep after a while without a touch, in the low
+  voltage mode it stays dimmed. The dim level chosen with the buttons is kept for
+  when it wakes up again.
+*/
+void handleDisplayPower()
+{
+  unsigned long idle = (millis() - lastTouch) / 1000; // s
+  DisplayState wanted = DISPLAY_AWAKE;
+  if (config.displaySleep > 0 && idle >= config.displaySleep)
+    wanted = DISPLAY_ASLEEP;
+  else if ((config.displayDim > 0 && idle >= config.displayDim) || Power.isLowVoltage())
+    wanted = DISPLAY_DIMMED;
+  if (wanted == displayState)
+    return;
+
+  char cmd[NEXTION_CMD_BUFFER];
+  switch (wanted)
+  {
+  case DISPLAY_AWAKE:
+  case DISPLAY_DIMMED:
+    if (displayState == DISPLAY_ASLEEP)
+    {
+      nextionCommand("sleep=0");
+      oldVal[0] = '\0'; // send all data again
+      Trends.redraw();
+    }
+    snprintf(cmd, NEXTION_CMD_BUFFER, "dim=%d", wanted == DISPLAY_AWAKE ? dimLevel : DIM_MIN);
+    nextionCommand(cmd);
+    break;
+  default:
+    nextionCommand("sleep=1");
+    break;
+  }
+  displayState = wanted;
+  Power.setDisplayState(wanted);
+}
+
+/*
+  The display task runs on core 0, the NMEA data path in loop() on core 1
+*/
+void displayTask(void *parameter)
+{
+  NextionEvent event;
+  unsigned long lastProbe = 0;
+
+  esp_task_wdt_add(NULL);
+  initializeDisplay(true);
+  for (;;)
+  {
+    esp_task_wdt_reset();
+    if (displayResetRequested)
+    {
+      displayResetRequested = false;
+      initializeDisplay(false);
+    }
+    //*** with bkcmd=0 the Nextion is silent, so ask for the page to see it is alive
+    //*** a sleeping Nextion does not answer, so it is not probed
+    if (displayState == DISPLAY_ASLEEP)
+      health.lastNextionReply = millis();
+    else if (millis() - lastProbe > DISPLAY_PROBE_INTERVAL)
+    {
+      lastProbe = millis();
+      nextionCommand("sendme");
+    }
+    readNextionInput();
+    while (xQueueReceive(nextionEvents, &event, 0) == pdTRUE)
+    {
+      handleNextionEvent(event);
+    }
+    handleDisplayPower();
+    Trends.sample();
+    if (displayState != DISPLAY_ASLEEP)
+    {
+      displayData();
+      Trends.feed();
+    }
+    vTaskDelay(DISPLAY_TASK_DELAY / portTICK_PERIOD_MS);
+  }
+}
+
+
+/**********************************************************************************
+  Purpose:  Helper class reading NMEA data from the serial port as a part of the multiplexer application
+            - Reading NMEA0183 v1.5 data without a checksum,
+*/
+
+/*
+  Purpose:  Time stamped receive ring of the listener
+            - The UART event task reads the bytes as soon as the driver reports them and
+              stores them with the time of the event
+            - A UART error gets a record of its own, with its time and in the order the
+              driver reported it, instead of being attached to whatever byte is read next
+            - loop() decodes from the ring; an error or lost bytes make the decoder resync
+            - The driver reports the bytes per FIFO block or after an idle time. While
+              capturing it reports every byte (setRxFIFOFull(1) and setRxTimeout(1)), then
+              a time is the one of the stop bit plus the latency of the event task,
+              typically some tens of us
+  NOTE:     The ring has a single producer (the UART event task) and a single consumer
+            (loop() on core 1), so the indexes are the only shared state.
+ */
+#define LISTENER_FRAME_ERROR 0x01
+#define LISTENER_PARITY_ERROR 0x02
+#define LISTENER_OVERRUN 0x04
+#define LISTENER_BREAK 0x08
+#define LISTENER_GAP 0x10     // records were dropped before this one
+#define LISTENER_NO_DATA 0x20 // a UART error without a data byte
+#define LISTENER_RESYNC (LISTENER_FRAME_ERROR | LISTENER_PARITY_ERROR | LISTENER_OVERRUN | LISTENER_GAP)
+
+typedef struct
+{
+  uint32_t time; // us
+  uint8_t data;
+  uint8_t flags;
+} ListenerRecord;
+
+class ListenerRing
+{
+public:
+  void put(uint32_t time, uint8_t data, uint8_t flags); // producer, the UART event task
+  bool get(ListenerRecord &record);                     // consumer, loop()
+  void clear();                                         // consumer, drop the waiting records
+  unsigned long getDrops();
+
+private:
+  ListenerRecord ring[LISTENER_RING_SIZE];
+  std::atomic<uint32_t> head{0};
+  std::atomic<uint32_t> tail{0};
+  bool gap = false;
+  unsigned long drops = 0;
+};
+
+void ListenerRing::put(uint32_t time, uint8_t data, uint8_t flags)
+{
+  uint32_t h = head.load(std::memory_order_relaxed);
+  if (h - tail.load(std::memory_order_acquire) >= LISTENER_RING_SIZE)
+  {
+    drops++;
+    gap = true;
+    return;
+  }
+  ListenerRecord &record = ring[h & (LISTENER_RING_SIZE - 1)];
+  record.time = time;
+  record.data = data;
+  record.flags = flags | (gap ? LISTENER_GAP : 0);
+  gap = false;
+  head.store(h + 1, std::memory_order_release);
+}
+
+bool ListenerRing::get(ListenerRecord &record)
+{
+  uint32_t t = tail.load(std::memory_order_relaxed);
+  if (t == head.load(std::memory_order_acquire))
+    return false;
+  record = ring[t & (LISTENER_RING_SIZE - 1)];
+  tail.store(t + 1, std::memory_order_release);
+  return true;
+}
+
+void ListenerRing::clear()
+{
+  tail.store(head.load(std::memory_order_acquire), std::memory_order_release);
+}
+
+unsigned long ListenerRing::getDrops()
+{
+  return drops;
+}
+
+ListenerRing Listener;
+
+#ifdef CAPTURE_ATTACHED
+/*
+  Purpose:  Raw byte capture of the listener for bus diagnostics
+            - Every record loop() takes from the listener ring is teed into a lock-free
+              ring, with the time and the errors of the UART event task; the forwarding
+              itself is not touched. When the ring is full, records are dropped and the
+              next record is marked with LISTENER_GAP.
+            - The capture task on core 0 drains the ring to the USB Serial port or to the
+              capture file on the SD card.
+            The stream and the file start with CAPTURE_MAGIC and the listener baudrate (uint32),
+            followed by frames of up to CAPTURE_FRAME_RECORDS records. A frame is the sync
+            bytes 0xA5 0xC3, the nr of records (uint16), the records of 6 bytes; time in us
+            (uint32), data byte and flags, and a CRC-16/CCITT (uint16) over the nr and the
+            records, all little endian. Every frame is written at once, so the console text
+            on the USB Serial port only ends up between the frames; the sync bytes are no
+            ASCII and the CRC rejects a false sync in the records.
+            tools/capture_decode.py decodes them on a host.
+  NOTE:     The ring has a single producer (loop() on core 1) and a single consumer
+            (the capture task), so the indexes are the only shared state.
+ */
+#define CAPTURE_SYNC_1 0xA5
+#define CAPTURE_SYNC_2 0xC3
+#define CAPTURE_RECORD_SIZE 6
+#define CAPTURE_FRAME_HEADER 4 // sync bytes and the nr of records
+#define CAPTURE_FRAME_SIZE (CAPTURE_FRAME_HEADER + CAPTURE_FRAME_RECORDS * CAPTURE_RECORD_SIZE + 2)
+
+enum CaptureTarget
+{
+  CAPTURE_OFF,
+  CAPTURE_SERIAL,
+  CAPTURE_SD
+};
+
+//*** CRC-16/CCITT-FALSE; polynomial 0x1021, start 0xFFFF
+uint16_t captureCrc(const uint8_t *data, size_t len)
+{
+  uint16_t crc = 0xFFFF;
+  for (size_t i = 0; i < len; i++)
+  {
+    crc ^= (uint16_t)data[i] << 8;
+    for (int bit = 0; bit < 8; bit++)
+      crc = (crc & 0x8000) ? (crc << 1) ^ 0x1021 : crc << 1;
+  }
+  return crc;
+}
+
+class RawCapture
+{
+public:
+  void start(CaptureTarget target);      // from the console
+  void stop();
+  bool isActive();
+  void put(const ListenerRecord &record); // producer, the listener
+  void drain();                          // consumer, the capture task
+  void print();                          // show the capture status on the console
+
+private:
+  ListenerRecord ring[CAPTURE_RING_SIZE];
+  std::atomic<uint32_t> head{0};
+  std::atomic<uint32_t> tail{0};
+  volatile CaptureTarget target = CAPTURE_OFF; // wanted by the console
+  CaptureTarget current = CAPTURE_OFF;         // in use by the capture task
+  bool gap = false;
+  unsigned long records = 0;
+  unsigned long drops = 0;
+  uint8_t frame[CAPTURE_FRAME_SIZE];
+  unsigned long lastSync = 0;
+#ifdef LOGBOOK_ATTACHED
+  File file;
+#endif
+  bool open(CaptureTarget newTarget);
+  void close();
+  void write(const uint8_t *data, size_t len);
+};
+
+void RawCapture::start(CaptureTarget newTarget)
+{
+  target = newTarget;
+  //*** an event per byte for accurate time stamps
+  Serial1.setRxFIFOFull(1);
+  Serial1.setRxTimeout(1);
+}
+
+void RawCapture::stop()
+{
+  target = CAPTURE_OFF;
+}
+
+bool RawCapture::isActive()
+{
+  return target != CAPTURE_OFF;
+}
+
+void RawCapture::put(const ListenerRecord &record)
+{
+  if (target == CAPTURE_OFF)
+    return;
+  uint32_t h = head.load(std::memory_order_relaxed);
+  if (h - tail.load(std::memory_order_acquire) >= CAPTURE_RING_SIZE)
+  {
+    drops++;
+    gap = true;
+    return;
+  }
+  ListenerRecord &entry = ring[h & (CAPTURE_RING_SIZE - 1)];
+  entry = record;
+  if (gap)
+    entry.flags |= LISTENER_GAP;
+  gap = false;
+  head.store(h + 1, std::memory_order_release);
+  records++;
+}
+
+bool RawCapture::open(CaptureTarget newTarget)
+{
+  uint8_t header[sizeof(CAPTURE_MAGIC) + 3];
+  uint32_t baudrate = config.listenerRate;
+
+#ifdef LOGBOOK_ATTACHED
+  if (newTarget == CAPTURE_SD)
+  {
+    file = SD.open(CAPTURE_FILE, FILE_WRITE);
+    if (!file)
+      return false;
+  }
+#else
+  if (newTarget == CAPTURE_SD)
+    return false;
+#endif
+  //*** only records from now on
+  tail.store(head.load(std::memory_order_acquire), std::memory_order_release);
+  current = newTarget;
+  memcpy(header, CAPTURE_MAGIC, sizeof(CAPTURE_MAGIC) - 1);
+  for (int i = 0; i < 4; i++)
+    header[sizeof(CAPTURE_MAGIC) - 1 + i] = (baudrate >> (8 * i)) & 0xFF;
+  write(header, sizeof(header));
+  return true;
+}
+
+void RawCapture::close()
+{
+#ifdef LOGBOOK_ATTACHED
+  if (current == CAPTURE_SD)
+    file.close();
+#endif
+  current = CAPTURE_OFF;
+}
+
+void RawCapture::write(const uint8_t *data, size_t len)
+{
+  if (current == CAPTURE_SERIAL)
+    Serial.write(data, len);
+#ifdef LOGBOOK_ATTACHED
+  else if (current == CAPTURE_SD)
+    file.write(data, len);
+#endif
+}
+
+/*
+  Write the records in the ring to the target in frames; a change of target by the
+  console is picked up here, so the file is only touched by the capture task
+*/
+void RawCapture::drain()
+{
+  CaptureTarget wanted = target;
+  if (wanted != current)
+  {
+    close();
+    if (wanted != CAPTURE_OFF && !open(wanted))
+      target = CAPTURE_OFF;
+  }
+  if (current == CAPTURE_OFF)
+    return;
+
+  uint32_t h = head.load(std::memory_order_acquire);
+  uint32_t t = tail.load(std::memory_order_relaxed);
+  while (t != h)
+  {
+    uint16_t n = 0;
+    size_t len = CAPTURE_FRAME_HEADER;
+    for (; t != h && n < CAPTURE_FRAME_RECORDS; t++, n++)
+    {
+      const ListenerRecord &record = ring[t & (CAPTURE_RING_SIZE - 1)];
+      for (int i = 0; i < 4; i++)
+        frame[len++] = (record.time >> (8 * i)) & 0xFF;
+      frame[len++] = record.data;
+      frame[len++] = record.flags;
+    }
+    tail.store(t, std::memory_order_release);
+    frame[0] = CAPTURE_SYNC_1;
+    frame[1] = CAPTURE_SYNC_2;
+    frame[2] = n & 0xFF;
+    frame[3] = n >> 8;
+    uint16_t crc = captureCrc(&frame[2], len - 2);
+    frame[len++] = crc & 0xFF;
+    frame[len++] = crc >> 8;
+    write(frame, len);
+  }
+#ifdef LOGBOOK_ATTACHED
+  if (current == CAPTURE_SD && millis() - lastSync > CAPTURE_SYNC_INTERVAL)
+  {
+    lastSync = millis();
+    file.flush();
+  }
+#endif
+}
+
+void RawCapture::print()
+{
+  const char *targets[] = {"off", "Serial", "SD " CAPTURE_FILE};
+  Serial.printf("Capture: %s\n", targets[target]);
+  Serial.printf("Records: %lu\n", records);
+  Serial.printf("Dropped: %lu\n", drops);
+}
+
+RawCapture Capture;
+
+/*
+  The capture task runs on core 0 next to the display task
+*/
+void captureTask(void *parameter)
+{
+  for (;;)
+  {
+    Capture.drain();
+    vTaskDelay(CAPTURE_TASK_DELAY / portTICK_PERIOD_MS);
+  }
+}
+#endif
+
+/*
+  Clear the input buffer; drop the records waiting in the listener ring
+*/
+void clearNMEAInputBuffer()
+{
+  Listener.clear();
+}
+
+/*
+  Called from the UART event task when the driver has data; all bytes of the event
+  get the time of the event
+*/
+void listenerReceive()
+{
+  uint32_t now = micros();
+  for (int n = Serial1.available(); n > 0; n--)
+    Listener.put(now, Serial1.read(), 0);
+}
+
+/*
+  Called from the UART event task on a receive error. After an overrun or framing
+  error the sentence being received is corrupt, the decoder resyncs on the error record
+*/
+void listenerError(hardwareSerial_error_t error)
+{
+  uint8_t flags;
+  switch (error)
+  {
+  case UART_FRAME_ERROR:
+    flags = LISTENER_FRAME_ERROR;
+    break;
+  case UART_PARITY_ERROR:
+    flags = LISTENER_PARITY_ERROR;
+    break;
+  case UART_BREAK_ERROR:
+    flags = LISTENER_BREAK;
+    break;
+  default:
+    flags = LISTENER_OVERRUN;
+    break;
+  }
+  health.uartErrors++;
+  Listener.put(micros(), 0, flags | LISTENER_NO_DATA);
+}
+
+/*
+* Initializes UART 2 for incomming NMEA0183 data from the Robertson network
+*/
+void initializeListener()
+{
+
+  Serial1.setRxBufferSize(LISTENER_BUFFER);
+  Serial1.onReceive(listenerReceive);
+  Serial1.onReceiveError(listenerError);
+  Serial1.begin(config.listenerRate, SERIAL_8N1, LISTENER_RX, LISTENER_TX, config.listenerInvert);
+  //*** a start bit wakes up from light sleep; high on the pin when inverted
+  gpio_wakeup_enable((gpio_num_t)LISTENER_RX, config.listenerInvert ? GPIO_INTR_HIGH_LEVEL : GPIO_INTR_LOW_LEVEL);
+#ifdef CAPTURE_ATTACHED
+  if (Capture.isActive())
   {
-    strcat(_BITVAL, "BAT=");
-    strcat(_BITVAL, nb_BAT);
-    strcat(_BITVAL, "#");
+    Serial1.setRxFIFOFull(1);
+    Serial1.setRxTimeout(1);
   }
-  // set dpt if is a number
-  if (isNumeric(nb_DPT))
+#endif
+  //clearNMEAInputBuffer();
+#ifdef DEBUG
+  debugWrite("Listener initialized...");
+#endif
+}
+
+/*
+  Purpose:  Detection of the listener baudrate and polarity, so a 38400 Bd AIS or a
+            non inverted GPS works without changing the settings
+            - The sync is checked per LISTENER_SYNC_WINDOW; bytes or UART errors without
+              a single sentence mean the baudrate or the polarity is wrong
+            - Then the UART is stopped and the edges on the RX pin are sampled in an
+              interrupt, up to DETECT_EDGES edges or DETECT_WINDOW ms
+            - NMEADetector in lib/NMEAListener scores every candidate baudrate and
+              polarity on the edge times
+            - The best candidate with DETECT_MIN_SCORE and DETECT_MIN_FRAMES is locked
+              into the settings, without a lock after DETECT_ATTEMPTS windows the
+              listener continues with the settings it had
+*/
+//*** the edges sampled by the interrupt; the time in us, the levels alternate from startLevel
+volatile uint32_t detectTimes[DETECT_EDGES];
+volatile int detectCount = 0;
+
+void IRAM_ATTR detectEdge()
+{
+  int n = detectCount;
+  if (n >= DETECT_EDGES)
+    return;
+  detectTimes[n] = micros();
+  detectCount = n + 1;
+}
+
+class ListenerDetector
+{
+public:
+  void handle();    // check the sync and run the detection windows
+  void detect();    // start a detection now
+  bool isDetecting();
+  void print();
+
+private:
+  NMEADetector core;
+  bool detecting = false;
+  byte attempts = 0;
+  byte startLevel = 0;             // level on the pin when the window started
+  unsigned long windowStart = 0;   // ms
+  unsigned long lastBytes = 0;     // health counters at the start of the sync window
+  unsigned long lastErrors = 0;
+  unsigned long lastSentences = 0;
+  unsigned long syncLost = 0;
+  unsigned long locks = 0;
+  unsigned long failures = 0;
+  void finishWindow();
+  void restartMonitor();
+};
+
+void ListenerDetector::restartMonitor()
+{
+  windowStart = millis();
+  lastBytes = health.listenerBytes;
+  lastErrors = health.uartErrors;
+  lastSentences = NmeaDecoder.getSentences();
+}
+
+void ListenerDetector::detect()
+{
+  Serial1.end();
+  pinMode(LISTENER_RX, INPUT);
+  detectCount = 0;
+  startLevel = digitalRead(LISTENER_RX);
+  attachInterrupt(digitalPinToInterrupt(LISTENER_RX), detectEdge, CHANGE);
+  windowStart = millis();
+  detecting = true;
+  attempts++;
+}
+
+void ListenerDetector::finishWindow()
+{
+  detachInterrupt(digitalPinToInterrupt(LISTENER_RX));
+  DetectResult best;
+  if (core.evaluate((const uint32_t *)detectTimes, detectCount, startLevel, best))
   {
-    strcat(_BITVAL, "DPT=");
-    strcat(_BITVAL, nb_DPT);
-    strcat(_BITVAL, "#");
+    config.listenerRate = best.rate;
+    config.listenerInvert = best.inverted;
+    locks++;
+    Serial.printf("Listener locked on %lu Bd %s, %u%% of %u frames\n", best.rate,
+                  best.inverted ? "inverted" : "normal", best.score, best.frames);
   }
-  // set trp if is a number
-  if (isNumeric(nb_TRP))
+  else if (attempts < DETECT_ATTEMPTS)
   {
-    strcat(_BITVAL, "TRP=");
-    strcat(_BITVAL, nb_TRP);
-    strcat(_BITVAL, "#");
+    detect(); // another window
+    return;
   }
-  // set log if is a number
-  if (isNumeric(nb_LOG))
+  else
+    failures++;
+
+  detecting = false;
+  attempts = 0;
+  initializeListener();
+  NmeaDecoder.resync();
+  health.lastByteTime = millis();
+  restartMonitor();
+}
+
+void ListenerDetector::handle()
+{
+  unsigned long now = millis();
+  if (detecting)
   {
-    strcat(_BITVAL, "LOG=");
-    strcat(_BITVAL, nb_LOG);
-    strcat(_BITVAL, "#");
+    if (detectCount >= DETECT_EDGES || now - windowStart > DETECT_WINDOW)
+      finishWindow();
+    return;
   }
-  // set WTR if is a number
-  if (isNumeric(nb_MTW))
+  if (now - windowStart < LISTENER_SYNC_WINDOW)
+    return;
+
+  unsigned long bytes = health.listenerBytes - lastBytes;
+  unsigned long errors = health.uartErrors - lastErrors;
+  unsigned long sentences = NmeaDecoder.getSentences() - lastSentences;
+  restartMonitor();
+  if (config.listenerAuto && sentences == 0 && (bytes >= LISTENER_SYNC_BYTES || errors >= LISTENER_SYNC_ERRORS))
   {
-    strcat(_BITVAL, "MTW=");
-    strcat(_BITVAL, nb_MTW);
-    strcat(_BITVAL, "#");
+    syncLost++;
+    detect();
   }
-  // set hdg if is a number
-  if (isNumeric(nb_HDG))
+}
+
+bool ListenerDetector::isDetecting()
+{
+  return detecting;
+}
+
+void ListenerDetector::print()
+{
+  Serial.printf("Listener: %lu Bd %s, auto detection %s%s\n", config.listenerRate,
+                config.listenerInvert ? "inverted" : "normal", config.listenerAuto ? "on" : "off",
+                detecting ? ", detecting" : "");
+  Serial.printf("Sync lost %lu, locks %lu, no lock %lu\n", syncLost, locks, failures);
+  for (unsigned int c = 0; c < NR_OF_DETECT_CANDIDATES; c++)
   {
-    strcat(_BITVAL, "HDG=");
-    strcat(_BITVAL, nb_HDG);
-    strcat(_BITVAL, "#");
+    const DetectResult &result = core.getResult(c);
+    if (result.rate > 0)
+      Serial.printf("  %6lu Bd %-8s %3u%% of %u frames\n", result.rate,
+                    result.inverted ? "inverted" : "normal", result.score, result.frames);
   }
-  // set stw if is a number
-  if (isNumeric(nb_STW))
+}
+
+ListenerDetector Detector;
+
+/*
+ * Start listeneing for incomming NNMEA sentences
+ */
+void startListening()
+{
+#ifdef DEBUG
+  debugWrite("Listening....");
+#endif
+
+  ListenerRecord record;
+  while (Listener.get(record))
   {
-    strcat(_BITVAL, "STW=");
-    strcat(_BITVAL, nb_STW);
-    strcat(_BITVAL, "#");
+#ifdef CAPTURE_ATTACHED
+    Capture.put(record);
+#endif
+    if (record.flags & LISTENER_RESYNC)
+    {
+      NmeaDecoder.resync();
+    }
+    if (record.flags & LISTENER_NO_DATA)
+      continue;
+    health.lastByteTime = millis();
+    health.listenerBytes++;
+    NmeaDecoder.decode(record.data);
   }
-  // Calculate TWS from AWA and SOG as described Starpath TrueWind by, David Burch, 2000
-  // TWS= SQRT( SOG^2*AWS^2 + (2*SOG*AWA*COS(AWA/180)))
-  double sog, awa, aws, tws = 0.0;
-  sog = atof(nb_SOG);
-  awa = atof(nb_AWA);
-  aws = atof(nb_AWS);
-  tws = sqrt(sog * sog + aws * aws - (2 * sog * aws * cos((double)awa * PI / 180)));
-  sprintf(nb_TWS, "%.1f", tws);
-  strcat(_BITVAL, "TWS=");
-  strcat(_BITVAL, nb_TWS);
-  strcat(_BITVAL, "#");
-  //*** Nextion display timer max speed is 50ms
-  // so no need to send faster than 50ms otherwise
-  // flooding the serialbuffer
-  if (millis() - tmr1 > NEXTION_SND_DELAY)
+}
+
+#ifdef NEXTION_ATTACHED
+/*
+  Called by the supervisor; a value of a stale source shows the placeholder and is
+  greyed out by the display task until its source is live again
+*/
+void checkStaleDisplay()
+{
+  for (unsigned int i = 0; i < sizeof(displayFields) / sizeof(displayFields[0]); i++)
   {
-    tmr1 = millis();
+    bool stale = Sources.isStale(displayFields[i].sentenceId);
+    if (stale)
+    {
+      portENTER_CRITICAL(&displayMux);
+      strcpy(displayFields[i].buffer, displayFields[i].placeholder);
+      portEXIT_CRITICAL(&displayMux);
+    }
+    displayFields[i].stale = stale;
+  }
+}
+#endif
+
+/*
+  Follow the largest free block and the fragmentation of the heap; the low
+  watermark of the free heap itself is kept by the ESP32
+*/
+void sampleHeap()
+{
+  uint32_t freeHeap = ESP.getFreeHeap();
+  uint32_t largestBlock = ESP.getMaxAllocHeap();
+  if (largestBlock < health.minLargestBlock)
+    health.minLargestBlock = largestBlock;
+  if (freeHeap > 0)
+  {
+    byte fragmentation = 100 - (uint64_t)largestBlock * 100 / freeHeap;
+    if (fragmentation > health.maxFragmentation)
+      health.maxFragmentation = fragmentation;
+  }
+}
+
+/*
+  Supervise the pipeline stages and restart the ones that got stuck.
+  A stage that hangs completely is caught by the task watchdog, which restarts the ESP32.
+*/
+void supervisePipeline()
+{
+  unsigned long now = millis();
+  if (now - lastSupervision < SUPERVISOR_INTERVAL)
+    return;
+  lastSupervision = now;
+
+  sampleHeap();
+
+  //*** listener; no input for a long time, restart the UART unless it is being detected
+  if (now - health.lastByteTime > LISTENER_SILENCE_TIMEOUT && !Detector.isDetecting())
+  {
+    health.lastByteTime = now;
+    health.listenerResets++;
+    Serial1.end();
+    initializeListener();
+    NmeaDecoder.resync();
+  }
+
+  //*** talker; a stack staying full means the talker does not get its data out
+  if (NmeaStack.getIndex() >= (int)config.stackSize)
+  {
+    if (stackFullSince == 0)
+      stackFullSince = now;
+    else if (now - stackFullSince > TALKER_STALL_TIMEOUT)
+    {
+      stackFullSince = 0;
+      health.talkerResets++;
+      NmeaStack.clear();
+      nmeaSerialOut.end();
+      initializeTalker();
+    }
+  }
+  else
+    stackFullSince = 0;
+
+#ifdef NEXTION_ATTACHED
+  //*** display; no replies on the probes, re-initialize it in the display task
+  if (health.lastNextionReply > 0 && now - health.lastNextionReply > DISPLAY_STALL_TIMEOUT)
+  {
+    health.lastNextionReply = now;
+    health.displayResets++;
+    displayResetRequested = true;
+  }
+
+  checkStaleDisplay();
+#endif
+}
+
+/*
+  Purpose:  Line based command console on the USB Serial port to change the settings
+            at sea without reflashing. Commands:
+            - show                  lists all settings
+            - set <key> <value>     changes a setting and applies it right away
+            - save                  stores the settings in NVS
+            - defaults              removes the stored settings and applies the defaults
+            - status                shows the startup times and the pipeline health
+            - alarms                shows the state of the alarms
+            - anchor [off]          sets the anchor watch on the current position or switches it off
+            - sources               shows the talkers per sentence and which one is selected
+            - trip                  shows the current voyage of the trip computer
+            - power                 shows the power state and the time spent per state
+            - capture [serial|sd|off] starts or stops the raw capture of the listener
+            - variation             shows the magnetic variation and where it comes from
+            - memory                shows the heap and the static RAM per subsystem
+            - latency [reset]       shows the talker latency and deadline misses per priority class
+            - listener [detect]     shows the listener baudrate and polarity detection or starts it
+            Lines are collected without blocking so the NMEA data keeps flowing.
+*/
+#define CONSOLE_BUFFER 64
+
+char consoleBuffer[CONSOLE_BUFFER] = {0};
+byte consoleIndex = 0;
+
+/*
+  Static RAM per subsystem, known at compile time. Buffers the libraries
+  allocate on the heap, like the UART and Wi-Fi buffers, are not included.
+  The stacks of our tasks are allocated on the heap by xTaskCreate, so they
+  are listed apart.
+*/
+typedef struct
+{
+  const char *name;
+  size_t size;
+} MemoryUse;
+
+const MemoryUse memoryUse[] = {
+    {"Listener", sizeof(NmeaDecoder) + sizeof(Listener)},
+    {"Detector", sizeof(Detector) + sizeof(detectTimes)},
+    {"Stack", sizeof(NmeaStack)},
+    {"Parser", sizeof(NmeaParser) + sizeof(NmeaData)},
+    {"Sources", sizeof(Sources)},
+    {"Scheduler", sizeof(Scheduler)},
+    {"Alarms", sizeof(Alarms)},
+    {"Variation", sizeof(Variation)},
+    {"Power", sizeof(Power)},
+    {"Config", sizeof(config) + sizeof(health)},
+    {"Console", sizeof(consoleBuffer)},
+#ifdef NEXTION_ATTACHED
+    {"Display", FIELD_BUFFER * 13 + sizeof(oldVal) + sizeof(nextionBuffer)},
+    {"Trends", sizeof(Trends)},
+#endif
+#ifdef WIFI_ATTACHED
+    {"Network", sizeof(NmeaNet)},
+#endif
+#ifdef N2K_ATTACHED
+    {"NMEA2000", sizeof(NmeaN2K)},
+#endif
+#ifdef LOGBOOK_ATTACHED
+    {"Logbook", sizeof(Trip)},
+#endif
+#ifdef CAPTURE_ATTACHED
+    {"Capture", sizeof(Capture)},
+#endif
+};
+
+const MemoryUse taskStacks[] = {
 #ifdef NEXTION_ATTACHED
+    {"Display", DISPLAY_TASK_STACK},
+#endif
+#ifdef LOGBOOK_ATTACHED
+    {"Logbook", LOGBOOK_TASK_STACK},
+#endif
+#ifdef CAPTURE_ATTACHED
+    {"Capture", CAPTURE_TASK_STACK},
+#endif
+    {"", 0}, // keeps the table valid without tasks
+};
+
+void printMemory()
+{
+  size_t total = 0;
+  uint32_t freeHeap = ESP.getFreeHeap();
+  Serial.printf("Heap: %u free of %u, lowest %u\n", freeHeap, ESP.getHeapSize(), ESP.getMinFreeHeap());
+  Serial.printf("Largest block: %u, smallest seen %u\n", ESP.getMaxAllocHeap(), health.minLargestBlock);
+  Serial.printf("Fragmentation: %u%%, highest seen %u%%\n",
+                freeHeap > 0 ? (unsigned int)(100 - (uint64_t)ESP.getMaxAllocHeap() * 100 / freeHeap) : 0,
+                health.maxFragmentation);
+#ifdef STATIC_ARENA
+  Serial.println("Static RAM (static arena build):");
+#else
+  Serial.println("Static RAM (String fields are on the heap as well):");
+#endif
+  for (unsigned int i = 0; i < sizeof(memoryUse) / sizeof(memoryUse[0]); i++)
+  {
+    Serial.printf("  %s: %u\n", memoryUse[i].name, (unsigned int)memoryUse[i].size);
+    total += memoryUse[i].size;
+  }
+  Serial.printf("  Total: %u\n", (unsigned int)total);
+  Serial.println("Task stacks (on the heap):");
+  total = 0;
+  for (unsigned int i = 0; taskStacks[i].size > 0; i++)
+  {
+    Serial.printf("  %s: %u\n", taskStacks[i].name, (unsigned int)taskStacks[i].size);
+    total += taskStacks[i].size;
+  }
+  Serial.printf("  Total: %u\n", (unsigned int)total);
+}
+
+/*
+  Re-initialize the ports affected by a changed setting
+*/
+void applyConfig(byte apply)
+{
+  if (apply & APPLY_LISTENER)
+  {
+    Serial1.end();
+    initializeListener();
+  }
+  if (apply & APPLY_TALKER)
+  {
+    nmeaSerialOut.end();
+    initializeTalker();
+  }
+}
+
+void printConfigItem(const ConfigItem &item)
+{
+  Serial.print(item.key);
+  Serial.print(" = ");
+  switch (item.type)
+  {
+  case CFG_ULONG:
+    Serial.println(*(unsigned long *)item.value);
+    break;
+  case CFG_FLOAT:
+    Serial.println(*(float *)item.value, 2);
+    break;
+  case CFG_TEXT:
+    Serial.println((char *)item.value);
+    break;
+  }
+}
+
+/*
+  Change a setting by its key; returns false if the key or value is invalid
+*/
+bool setConfigItem(const char *key, const char *value)
+{
+  for (unsigned int i = 0; i < NR_OF_CONFIG_ITEMS; i++)
+  {
+    const ConfigItem &item = configItems[i];
+    if (strcmp(item.key, key) != 0)
+      continue;
+
+    if (item.type == CFG_TEXT)
+    {
+      if (strlen(value) >= item.size)
+        return false;
+      strcpy((char *)item.value, value);
+    }
+    else
+    {
+      char *end;
+      float number = strtod(value, &end);
+      if (end == value || *end != '\0' || number < item.min || number > item.max)
+        return false;
+      if (item.type == CFG_ULONG)
+        *(unsigned long *)item.value = (unsigned long)number;
+      else
+        *(float *)item.value = number;
+    }
+    applyConfig(item.apply);
+    printConfigItem(item);
+    return true;
+  }
+  return false;
+}
+
+void executeCommand(char *line)
+{
+  char *command = strtok(line, " ");
+  if (command == NULL)
+    return;
+
+  if (strcmp(command, "show") == 0)
+  {
+    for (unsigned int i = 0; i < NR_OF_CONFIG_ITEMS; i++)
+    {
+      printConfigItem(configItems[i]);
+    }
+  }
+  else if (strcmp(command, "set") == 0)
+  {
+    char *key = strtok(NULL, " ");
+    char *value = strtok(NULL, "");
+    if (key == NULL || value == NULL || !setConfigItem(key, value))
+      Serial.println("Invalid setting");
+  }
+  else if (strcmp(command, "status") == 0)
+  {
+    Serial.printf("Pipeline ready: %lu ms after boot\n", pipelineReadyTime);
+    Serial.printf("First sentence: %lu ms after boot\n", firstSentenceTime);
+    Serial.printf("Uptime: %lu s\n", millis() / 1000);
+    Serial.printf("Sentences parsed: %lu\n", NmeaParser.getCounter());
+    Serial.printf("Oversize lines: %lu\n", NmeaDecoder.getOversizeLines());
+    Serial.printf("Stack overflows: %lu\n", health.stackOverflows);
+    Serial.printf("UART errors: %lu\n", health.uartErrors);
+    Serial.printf("Listener ring drops: %lu\n", Listener.getDrops());
+    Serial.printf("Listener resets: %lu\n", health.listenerResets);
+    Serial.printf("Talker resets: %lu\n", health.talkerResets);
+    Serial.printf("Display resets: %lu\n", health.displayResets);
+    Serial.printf("Heap: %u free, lowest %u, largest block %u, fragmentation max %u%%\n", ESP.getFreeHeap(),
+                  ESP.getMinFreeHeap(), ESP.getMaxAllocHeap(), health.maxFragmentation);
+  }
+  else if (strcmp(command, "alarms") == 0)
+  {
+    Alarms.print();
+  }
+  else if (strcmp(command, "anchor") == 0)
+  {
+    char *action = strtok(NULL, " ");
+    if (action != NULL && strcmp(action, "off") == 0)
+    {
+      Alarms.clearAnchor();
+      Serial.println("Anchor watch off");
+    }
+    else if (Alarms.setAnchor())
+      Serial.println("Anchor watch set on the current position");
+    else
+      Serial.println("No position fix for the anchor watch");
+  }
+  else if (strcmp(command, "sources") == 0)
+  {
+    Sources.print();
+  }
+  else if (strcmp(command, "power") == 0)
+  {
+    Power.print();
+  }
+  else if (strcmp(command, "variation") == 0)
+  {
+    Variation.print();
+  }
+  else if (strcmp(command, "memory") == 0)
+  {
+    printMemory();
+  }
+  else if (strcmp(command, "latency") == 0)
+  {
+    char *action = strtok(NULL, " ");
+    if (action != NULL && strcmp(action, "reset") == 0)
+      Scheduler.reset();
+    Scheduler.print();
+  }
+  else if (strcmp(command, "listener") == 0)
+  {
+    char *action = strtok(NULL, " ");
+    if (action != NULL && strcmp(action, "detect") == 0)
+    {
+      if (!Detector.isDetecting())
+        Detector.detect();
+      Serial.println("Detecting the listener baudrate and polarity");
+    }
+    else
+      Detector.print();
+  }
+#ifdef CAPTURE_ATTACHED
+  else if (strcmp(command, "capture") == 0)
+  {
+    char *action = strtok(NULL, " ");
+    if (action == NULL)
+      Capture.print();
+    else if (strcmp(action, "serial") == 0)
+    {
+      Serial.println("Capturing to Serial");
+      Capture.start(CAPTURE_SERIAL); // the binary stream follows on this port
+    }
+    else if (strcmp(action, "sd") == 0)
+    {
+      Capture.start(CAPTURE_SD);
+      Serial.println("Capturing to " CAPTURE_FILE);
+    }
+    else if (strcmp(action, "off") == 0)
+    {
+      Capture.stop();
+      //*** back to the default FIFO interrupt level
+      Serial1.end();
+      initializeListener();
+      Serial.println("Capture off");
+    }
+    else
+      Serial.println("Invalid capture target");
+  }
+#endif
+#ifdef LOGBOOK_ATTACHED
+  else if (strcmp(command, "trip") == 0)
+  {
+    Trip.print();
+  }
+#endif
+  else if (strcmp(command, "save") == 0)
+  {
+    saveConfig();
+    Serial.println("Settings saved");
+  }
+  else if (strcmp(command, "defaults") == 0)
+  {
+    clearConfig();
+    applyConfig(APPLY_LISTENER | APPLY_TALKER);
+    Serial.println("Defaults restored");
+  }
+  else
+  {
+    Serial.println("Commands: show, set <key> <value>, save, defaults, status, alarms, anchor [off], sources, trip, power, capture [serial|sd|off], variation, memory, latency [reset], listener [detect]");
+  }
+}
+
+/*
+  Read the available console characters and execute a command on every new line
+*/
+void handleConsole()
+{
+  while (Serial.available() > 0)
+  {
+    char c = Serial.read();
+    if (c == '\r' || c == '\n')
+    {
+      if (consoleIndex > 0)
+      {
+        consoleBuffer[consoleIndex] = '\0';
+        executeCommand(consoleBuffer);
+        consoleIndex = 0;
+      }
+    }
+    else if (consoleIndex < CONSOLE_BUFFER - 1)
+    {
+      consoleBuffer[consoleIndex++] = c;
+    }
+  }
+}
+
+#ifdef TEST
+
+String NmeaStream[10] = {
+    "$IIVWR,151,R,02.4,N,,,,",
+    "$IIMTW,12.2,C",
+    "!AIVDM,1,1,,A,13aL<mhP000J9:PN?<jf4?vLP88B,0*2B",
+    "$IIDBK,A,0014.4,f,,,,",
+    "$IIVLW,1149.1,N,001.07,N",
+    "$GPGLL,5251.3091,N,00541.8037,E,151314.000,A,D*5B",
+    "$GPRMC,095218.000,A,5251.5621,N,00540.8482,E,4.25,201.77,120420,,,D*6D",
+    "$PSTOB,13.0,v",
+    "$IIVWR,151,R,02.3,N,,,,",
+    "$IIVHW,,,000,M,01.57,N,,"};
 
-    if (strcmp(oldVal, _BITVAL) != 0)
-    {
+int softIndex = 0;
+long softTimerOld = 0;
+long softTimerNow;
 
-      strcpy(oldVal, _BITVAL);
+void runSoftGenerator()
+{
+  softTimerNow = millis();
 
-      dbSerial.print("Sending NMEA data: ");
-      nmeaTxt.setText(_BITVAL);
-      dbSerial.println(_BITVAL);
-    }
+  if (softIndex < 10)
+  {
 
-#endif
+    NmeaParser.parseNMEASentence(NmeaStream[softIndex++].c_str());
 
-    newData = false;
+    delay(200);
   }
+  else
+    softIndex = 0;
 }
 
 /*
- * Start reading converted NNMEA sentences from the stack
- * and write them to Serial Port 2 to send them to the 
- * external NMEA device.
- * Update the display with the value(s) send
- */
-byte startTalking()
-{
-  NMEAData nmeaOut;
-
-  //*** for all  NMEAData opjects on the stack
-  //*** NOTE; the stack has a buffer of NMEA_BUFFER_SIZE objects
-  //***       normaly only 1 or 2 should be on the stack
-  //***       if the stack is full your timing is out of control
+  Parser self test, run once at startup in TEST mode
+  - Differential check; every corpus line is fed byte by byte through NmeaDecoder.decode()
+    and the parser, and the output is compared with a straightforward reference.
+    Parser optimizations must keep the output bytes identical.
+  - Schema; the typed fields of parsed sentences.
+  - Scheduler; the order sentences leave the stack in.
+  - Trends; the downsampling of the trend history.
+  - Listener; the baudrate and polarity detection on synthetic lines.
+  - Fuzzing; random and mutated corpus lines must never break the invariants
+    of the input buffer, the fields array and the stack.
+  The results are printed on the Serial console.
+*/
+#define FUZZ_ITERATIONS 20000
+#define FUZZ_MAX_LENGTH 120
 
-  if (NmeaStack.getIndex() > 0)
-  {
-    nmeaOut = NmeaStack.pop();
 
-    for (int i = 0; i < (int)nmeaOut.sentence.length(); i++)
-    {
-      nmeaSerialOut.write(nmeaOut.sentence[i]);
-    }
+unsigned int testFailures = 0;
 
-#ifdef DEBUG
-    debugWrite(" Sending :" + nmeaOut.sentence);
-#endif
+/*
+  Reference for the checksum; XOR of all chars between the start delimiter and the end
+*/
+String referenceChecksum(String str)
+{
+  byte cs = 0;
+  for (unsigned int n = 1; n < str.length(); n++)
+  {
+    cs ^= str[n];
   }
-#ifdef NEXTION_ATTACHED
-  // check which screens is active and update with data
-  // switch (active_menu_button)
-  // {
+  char hex[4];
+  sprintf(hex, "*%02x", cs);
+  return String(hex);
+}
 
-  // speeds are checked for values <100; Higher is non existant
-  if (nmeaOut.fields[0] == _RMC)
+/*
+  Reference output for a pass through sentence; the sentence as received with a
+  checksum added if there was none, and terminated
+*/
+String referenceOutput(String sentence)
+{
+  if (sentence.indexOf('*') < 1)
+    sentence += referenceChecksum(sentence);
+  return sentence + NMEA_TERMINATOR;
+}
+
+/*
+  Feed raw bytes to the decoder and collect the sentences it produced
+*/
+String decodeTestInput(const char *input, byte *nrOfSentences)
+{
+  String output = "";
+  *nrOfSentences = 0;
+  for (int i = 0; input[i] != '\0'; i++)
   {
-    memcpy(nb_SOG, &nmeaOut.fields[7], FIELD_BUFFER - 1);
+    NmeaDecoder.decode(input[i]);
   }
-  if (nmeaOut.fields[0] == _VHW)
+  NMEAData out;
+  while (NmeaStack.pop(out))
   {
-    memcpy(nb_STW, &nmeaOut.fields[5], FIELD_BUFFER - 1);
+    output = out.sentence.c_str();
+    (*nrOfSentences)++;
   }
-  if (nmeaOut.fields[0] == _VWR)
+  return output;
+}
+
+void runDifferentialTest()
+{
+  for (unsigned int i = 0; i < sizeof(parserCorpus) / sizeof(parserCorpus[0]); i++)
   {
-    memcpy(nb_AWS, &nmeaOut.fields[3], FIELD_BUFFER - 1);
-    memcpy(nb_AWA, &nmeaOut.fields[1], FIELD_BUFFER - 1);
-    if (nmeaOut.fields[2] == "L")
+    const ParserTestCase &test = parserCorpus[i];
+    String expected = "";
+    if (test.expected == NULL)
     {
-      memmove(nb_AWA + 1, nb_AWA, FIELD_BUFFER - 2);
-      nb_AWA[0] = '-';
+      //*** the sentence runs from the last start delimiter up to the terminator
+      String input = test.input;
+      int start = -1;
+      for (unsigned int j = 0; j < input.length(); j++)
+      {
+        if (input[j] == '$' || input[j] == '!' || input[j] == '~')
+          start = j;
+      }
+      int end = input.indexOf('\r', start);
+      expected = referenceOutput(input.substring(start, end));
+    }
+    else if (test.expected[0] != '\0')
+    {
+      expected = String(test.expected) + referenceChecksum(test.expected) + NMEA_TERMINATOR;
+    }
+
+    byte nrOfSentences = 0;
+    String output = decodeTestInput(test.input, &nrOfSentences);
+    if (output != expected || nrOfSentences > 1)
+    {
+      testFailures++;
+      Serial.printf("FAIL corpus %d: got '%s' expected '%s'\n", i, output.c_str(), expected.c_str());
     }
   }
-  if (nmeaOut.fields[0] == _RMC)
-  {
-    memcpy(nb_COG, &nmeaOut.fields[8], FIELD_BUFFER - 1);
-  }
-  if (nmeaOut.fields[0] == _hDG)
+}
+
+/*
+  Check the invariants after every fuzz line; the decoder must always stay within its
+  buffer, the parser within its fields and the output within the NMEA length
+*/
+void checkInvariants(unsigned long iteration)
+{
+  bool ok = NmeaDecoder.isConsistent();
+  NMEAData out;
+  while (NmeaStack.pop(out))
   {
-    memcpy(nb_HDG, &nmeaOut.fields[1], FIELD_BUFFER - 1);
+    ok = ok && out.nrOfFields <= MAX_NMEA_FIELDS && out.sentence.length() <= NMEA_BUFFER_SIZE + 5;
   }
-  if (nmeaOut.fields[0] == _dPT)
+  if (!ok)
   {
-    memcpy(nb_DPT, &nmeaOut.fields[1], FIELD_BUFFER - 1);
+    testFailures++;
+    Serial.printf("FAIL fuzz iteration %lu\n", iteration);
   }
+}
+
+void runFuzzTest()
+{
+  //*** bytes with a meaning for the decoder get a higher chance
+  const char special[] = "$!~*,\r\n";
+  const unsigned int corpusSize = sizeof(parserCorpus) / sizeof(parserCorpus[0]);
 
-  if (nmeaOut.fields[0] == _xDR)
+  randomSeed(FUZZ_ITERATIONS);
+  for (unsigned long i = 0; i < FUZZ_ITERATIONS; i++)
   {
-    if (nmeaOut.fields[4] == "BATT")
+    if (i % 1000 == 0)
+      esp_task_wdt_reset();
+
+    if (i % 2 == 0)
+    {
+      //*** random bytes
+      int length = random(1, FUZZ_MAX_LENGTH);
+      for (int j = 0; j < length; j++)
+      {
+        char c = (random(4) == 0) ? special[random(sizeof(special) - 1)] : (char)random(1, 256);
+        NmeaDecoder.decode(c);
+      }
+    }
+    else
     {
-      memcpy(nb_BAT, &nmeaOut.fields[2], FIELD_BUFFER - 1);
+      //*** a corpus line with some bytes replaced, inserted or removed
+      const char *line = parserCorpus[random(corpusSize)].input;
+      int mutations = random(1, 4);
+      for (int j = 0; line[j] != '\0'; j++)
+      {
+        if (mutations > 0 && random(20) == 0)
+        {
+          mutations--;
+          switch (random(3))
+          {
+          case 0:
+            NmeaDecoder.decode(special[random(sizeof(special) - 1)]);
+            break;
+          case 1:
+            NmeaDecoder.decode(line[j]);
+            NmeaDecoder.decode(line[j]);
+            break;
+          default:
+            break; // byte removed
+          }
+        }
+        else
+          NmeaDecoder.decode(line[j]);
+      }
     }
+    checkInvariants(i);
   }
-  if (nmeaOut.fields[0] == _MTW)
+  //*** make sure the next test starts clean
+  NmeaDecoder.decode('\r');
+  checkInvariants(FUZZ_ITERATIONS);
+}
+
+/*
+  Reference declinations of the degree 6 model, calculated on a host with an independent
+  implementation of the WMM equations, and the HDG and HDT made from an HDM
+*/
+typedef struct
+{
+  double lat;
+  double lon;
+  float year;
+  float variation;
+} VariationTestCase;
+
+const VariationTestCase variationCorpus[] = {
+    {52.853, 5.71, 2020.36, 1.997},
+    {51.0, 1.5, 2024.5, 1.547},
+    {60.0, -20.0, 2022.0, -9.505},
+    {-33.9, 18.4, 2023.0, -27.114},
+    {37.8, -122.4, 2021.0, 13.151},
+    {0.0, 120.0, 2020.0, 0.262}};
+
+void runVariationTest()
+{
+  for (unsigned int i = 0; i < sizeof(variationCorpus) / sizeof(variationCorpus[0]); i++)
   {
-    memcpy(nb_MTW, &nmeaOut.fields[1], FIELD_BUFFER - 1);
+    const VariationTestCase &test = variationCorpus[i];
+    float variation = VariationModel::calculate(test.lat, test.lon, test.year);
+    if (fabs(variation - test.variation) > 0.01)
+    {
+      testFailures++;
+      Serial.printf("FAIL variation %d: got %.3f expected %.3f\n", i, variation, test.variation);
+    }
   }
-  if (nmeaOut.fields[0] == _VLW)
+
+  //*** both are control sentences, so the HDG parsed first comes first
+  char hdg[NMEA_BUFFER_SIZE + 1];
+  char hdt[NMEA_BUFFER_SIZE + 1];
+  float variation = Variation.getVariation();
+  formatHDG(hdg, sizeof(hdg), config.talkerId, 123.4, variation);
+  formatHDT(hdt, sizeof(hdt), config.talkerId, fmod(123.4 + variation + 360, 360));
+  byte nrOfSentences = 0;
+  decodeTestInput("$IIHDM,123.4,M\r\n", &nrOfSentences);
+  Variation.handle();
+  NMEAData out;
+  NmeaStack.pop(out);
+  String outHDG = out.sentence.c_str();
+  NmeaStack.pop(out);
+  String outHDT = out.sentence.c_str();
+  if (outHDG != String(hdg) + NMEA_TERMINATOR || outHDT != String(hdt) + NMEA_TERMINATOR)
   {
-    memcpy(nb_LOG, &nmeaOut.fields[1], FIELD_BUFFER - 1);
-    memcpy(nb_TRP, &nmeaOut.fields[3], FIELD_BUFFER - 1);
+    testFailures++;
+    Serial.printf("FAIL heading: got '%s' and '%s'\n", outHDG.c_str(), outHDT.c_str());
   }
-
-  Serial.print(nmeaOut.sentence);
-
-#endif
-
-  return 1;
 }
 
-/**********************************************************************************
-  Purpose:  Helper class reading NMEA data from the serial port as a part of the multiplexer application
-            - Reading NMEA0183 v1.5 data without a checksum,
-*/
-
 /*
-Cleasr the inputbuffer by reading until empty, since Serial.flush does not this anymore
+  Schema check; the typed fields of a parsed sentence, the fields outside the schema
+  are not stored and the sentence type of a converted sentence follows the conversion
 */
-void clearNMEAInputBuffer()
+void runSchemaTest()
 {
-
-  while (Serial1.available() > 0)
+  byte nrOfSentences = 0;
+  decodeTestInput("", &nrOfSentences); // an empty stack
+  const char *input = "$GPRMC,095218.000,A,5251.5621,N,00540.8482,E,4.25,201.77,120420,,,D\r\n$IIDBK,A,0014.4,f,,,,\r\n"
+                      "$GPGLL,5251.3091,N,00541.8037,E,151314.000,A,D\r\n";
+  for (const char *c = input; *c != '\0'; c++)
+    NmeaDecoder.decode(*c);
+  NMEAData rmc, dpt, gll;
+  NmeaStack.pop(rmc);
+  NmeaStack.pop(dpt);
+  NmeaStack.pop(gll);
+  bool ok = rmc.type == NMEA_RMC && rmc.nrOfFields == 13 && nmeaChar<RMC_STATUS>(rmc) == 'A' &&
+            fabs(nmeaFloat<RMC_SOG>(rmc) - 4.25) < 0.001 && fabs(nmeaFloat<RMC_COG>(rmc) - 201.77) < 0.001 &&
+            fabs(nmeaDegrees<RMC_LAT>(rmc) - 52.85937) < 0.0001 && nmeaText<RMC_DATE>(rmc) == "120420" &&
+            rmc.fields[12].length() == 0;
+  ok = ok && dpt.type == NMEA_DPT && fabs(nmeaFloat<DPT_DEPTH>(dpt) - 4.4) < 0.001;
+  ok = ok && gll.type == NMEA_GLL && nmeaChar<GLL_STATUS>(gll) == 'A' &&
+       fabs(nmeaDegrees<GLL_LAT>(gll) - 52.85515) < 0.0001 && fabs(nmeaDegrees<GLL_LON>(gll) - 5.69673) < 0.0001 &&
+       nmeaText<GLL_TIME>(gll) == "151314.000";
+  if (!ok)
   {
-    Serial1.read();
+    testFailures++;
+    Serial.printf("FAIL schema: '%s' '%s'\n", rmc.sentence.c_str(), dpt.sentence.c_str());
   }
 }
 
 /*
-* Initializes UART 2 for incomming NMEA0183 data from the Robertson network
+  MOB position check; an RMC or GLL without a fix may not replace the last fix,
+  so the MOB waypoint keeps the earlier position
 */
-void initializeListener()
+void runPositionTest()
 {
-
-  Serial1.begin(LISTENER_RATE, SERIAL_8N1, LISTENER_RX, LISTENER_TX, true);
-  //clearNMEAInputBuffer();
-#ifdef DEBUG
-  debugWrite("Listener initialized...");
-#endif
+  char saved[sizeof(lastPosition)];
+  memcpy(saved, lastPosition, sizeof(lastPosition));
+  byte nrOfSentences = 0;
+  decodeTestInput("", &nrOfSentences); // an empty stack
+  const char *input = "$GPRMC,095218.000,A,5251.5621,N,00540.8482,E,4.25,201.77,120420,,,D\r\n"
+                      "$GPRMC,095219.000,V,,,,,,,120420,,,N\r\n"
+                      "$GPGLL,5251.3091,N,00541.8037,E,151314.000,V,N\r\n";
+  for (const char *c = input; *c != '\0'; c++)
+    NmeaDecoder.decode(*c);
+  NMEAData nmea;
+  lastPosition[0] = '\0';
+  while (NmeaStack.pop(nmea))
+    updatePosition(nmea);
+  char wpl[NMEA_BUFFER_SIZE + 1];
+  formatWPL(wpl, sizeof(wpl), "AO", lastPosition, "MOB");
+  if (strcmp(lastPosition, "5251.5621,N,00540.8482,E") != 0 || strncmp(wpl, "$AOWPL,5251.5621,N,00540.8482,E,MOB*", 36) != 0)
+  {
+    testFailures++;
+    Serial.printf("FAIL position: '%s' '%s'\n", lastPosition, wpl);
+  }
+  memcpy(lastPosition, saved, sizeof(lastPosition));
 }
 
 /*
-  Decode the incomming character and test if it is valid NMEA data.
-  If true than put it the NMEA buffer and call NMEAParser object
-  to process incomming and complete MNEA sentence
+  Scheduler check; sentences leave the stack earliest deadline first, and on a full
+  stack a control sentence takes the place of a background one
 */
-void decodeNMEAInput(char cIn)
+#define GSV_TEST "$GPGSV,3,1,11,03,03,111,00,04,15,270,00,06,01,010,00,13,06,292,00\r\n"
+
+void runSchedulerTest()
 {
-  switch (cIn)
+  const char *input = GSV_TEST "!AIVDM,1,1,,A,13aL<mhP000J9:PN?<jf4?vLP88B,0*2B\r\n"
+                               "$GPRMC,095218.000,A,5251.5621,N,00540.8482,E,4.25,201.77,120420,,,D\r\n"
+                               "$IIVWR,151,R,02.4,N,,,,\r\n";
+  const char *expected[] = {"$IIVWR", "$GPRMC", "$GPGSV", "!AIVDM"};
+  for (const char *c = input; *c != '\0'; c++)
+    NmeaDecoder.decode(*c);
+  NMEAData out;
+  for (unsigned int i = 0; i < sizeof(expected) / sizeof(expected[0]); i++)
   {
-  case '~':
-    // reserved by NMEA
-  case '!':
-    //for AIS info
-  case '$':
-    // for general NMEA info
-    nmeaStatus = RECEIVING;
-    nmeaIndex = 0;
-    break;
-  case '*':
-    if (nmeaStatus == RECEIVING)
+    NmeaStack.pop(out);
+    if (out.fields[0] != expected[i])
     {
-      nmeaStatus = CHECKSUMMING;
+      testFailures++;
+      Serial.printf("FAIL scheduler %d: got '%s' expected '%s'\n", i, out.fields[0].c_str(), expected[i]);
     }
-    break;
-  case '\n':
-  case '\r':
-    // in old v1.5 version, NMEA Data may not be checksummed!
-    if (nmeaStatus == RECEIVING || nmeaStatus == CHECKSUMMING)
-    {
-      nmeaDataReady = true;
-      nmeaStatus = TERMINATING;
-    }
-    else
-      nmeaStatus = INVALID;
+  }
 
-    break;
+  unsigned long overflows = health.stackOverflows;
+  for (unsigned int i = 0; i < config.stackSize; i++)
+  {
+    for (const char *c = GSV_TEST; *c != '\0'; c++)
+      NmeaDecoder.decode(*c);
   }
-  switch (nmeaStatus)
+  for (const char *c = "$IIVWR,151,R,02.4,N,,,,\r\n"; *c != '\0'; c++)
+    NmeaDecoder.decode(*c);
+  int count = NmeaStack.getIndex();
+  NmeaStack.pop(out);
+  if (out.fields[0] != "$IIVWR" || count != (int)config.stackSize || health.stackOverflows != overflows + 1)
   {
-  case INVALID:
-    // do nothing
-    nmeaIndex = 0;
-    nmeaDataReady = false;
-    break;
-  case RECEIVING:
-  case CHECKSUMMING:
-    nmeaBuffer[nmeaIndex] = cIn;
-    nmeaIndex++;
-    break;
-  case TERMINATING:
-
-    nmeaStatus = INVALID;
-    if (nmeaDataReady)
-    {
-      nmeaDataReady = false;
-
-      // Clear the remaining buffer content with '\0'
-      for (int y = nmeaIndex + 1; y < NMEA_BUFFER_SIZE + 1; y++)
-      {
-        nmeaBuffer[y] = '\0';
-      }
-#ifdef DEBUG
-      debugWrite(nmeaBuffer);
-#endif
-      NmeaParser.parseNMEASentence(nmeaBuffer);
-
-      //clear the NMEAbuffer with 0
-      memset(nmeaBuffer, 0, NMEA_BUFFER_SIZE + 1);
-      nmeaIndex = 0;
-    }
-
-    break;
+    testFailures++;
+    Serial.printf("FAIL scheduler full stack: got '%s' of %d\n", out.fields[0].c_str(), count);
   }
+  NmeaStack.clear();
 }
 
 /*
- * Start listeneing for incomming NNMEA sentences
- */
-void startListening()
+  Trend check; 10 minutes of 1 s points give 10 points of 1 min and one of 10 min,
+  each the average of the points above it
+*/
+void runTrendTest()
 {
-#ifdef DEBUG
-  debugWrite("Listening....");
-#endif
-
-  while (Serial1.available() > 0 && nmeaStatus != TERMINATING)
+  static TrendHistory trends; // not the one of the display task
+  for (int i = 0; i < 600; i++)
   {
-    decodeNMEAInput(Serial1.read());
+    float values[NR_OF_TRENDS] = {i < 300 ? 10.0f : 20.0f, 0.0f, 5.0f, 13.0f};
+    trends.record(values);
+  }
+  bool ok = trends.getCount(TREND_1S) == 600 && trends.getCount(TREND_1MIN) == 10 && trends.getCount(TREND_10MIN) == 1 &&
+            trends.getPoint(TREND_DEPTH, TREND_1MIN, 4) == 67 && trends.getPoint(TREND_DEPTH, TREND_1MIN, 5) == 133 &&
+            trends.getPoint(TREND_DEPTH, TREND_10MIN, 0) == 100 && trends.getPoint(TREND_SOG, TREND_10MIN, 0) == 100 &&
+            trends.getPoint(TREND_BATTERY, TREND_1S, 599) == 100;
+  if (!ok)
+  {
+    testFailures++;
+    Serial.printf("FAIL trend: %lu/%lu/%lu points, depth %d\n", trends.getCount(TREND_1S), trends.getCount(TREND_1MIN),
+                  trends.getCount(TREND_10MIN), trends.getPoint(TREND_DEPTH, TREND_10MIN, 0));
   }
 }
 
-#ifdef TEST
+/*
+  Listener detection check; the synthetic lines of lib/NMEAListener at several baudrates
+  and polarities, some with glitches or jitter, must lock on the baudrate and polarity
+  they were made with. The edge list starts in the middle of a frame, like a detection
+  window would.
+*/
+void runListenerTest()
+{
+  static uint32_t times[DETECT_EDGES];
+  static NMEADetector detector; // not the one of the listener
+  for (unsigned int i = 0; i < sizeof(listenerCorpus) / sizeof(listenerCorpus[0]); i++)
+  {
+    const ListenerTestCase &test = listenerCorpus[i];
+    byte startLevel;
+    int n = synthesizeLine(test, times, DETECT_EDGES, startLevel);
+    DetectResult best;
+    bool locked = detector.evaluate(times, n, startLevel, best);
+    if (!locked || best.rate != test.rate || best.inverted != test.inverted)
+    {
+      testFailures++;
+      Serial.printf("FAIL listener %d: got %lu Bd %s %u%% of %u frames\n", i, best.rate,
+                    best.inverted ? "inverted" : "normal", best.score, best.frames);
+    }
+  }
 
-String NmeaStream[10] = {
-    "$IIVWR,151,R,02.4,N,,,,",
-    "$IIMTW,12.2,C",
-    "!AIVDM,1,1,,A,13aL<mhP000J9:PN?<jf4?vLP88B,0*2B",
-    "$IIDBK,A,0014.4,f,,,,",
-    "$IIVLW,1149.1,N,001.07,N",
-    "$GPGLL,5251.3091,N,00541.8037,E,151314.000,A,D*5B",
-    "$GPRMC,095218.000,A,5251.5621,N,00540.8482,E,4.25,201.77,120420,,,D*6D",
-    "$PSTOB,13.0,v",
-    "$IIVWR,151,R,02.3,N,,,,",
-    "$IIVHW,,,000,M,01.57,N,,"};
+  //*** a line stuck at one level gives no lock
+  DetectResult best;
+  if (detector.evaluate(times, 0, HIGH, best))
+  {
+    testFailures++;
+    Serial.println("FAIL listener: locked without edges");
+  }
+}
 
-int softIndex = 0;
-long softTimerOld = 0;
-long softTimerNow;
+/*
+  Soak test; the corpus over and over through the decoder and the parser. At the end
+  the free heap may not be lower than after the warm up. The other tasks, Wi-Fi and
+  the display use the heap while the soak runs, so the free heap moves a bit; a leak
+  of a single byte per sentence is far above the tolerance. The exact check, no
+  allocation at all in the STATIC_ARENA build, is the native soak in test/test_soak.
+*/
+#ifndef SOAK_SENTENCES
+#define SOAK_SENTENCES 100000UL
+#endif
+#define SOAK_WARMUP 1000
+#define SOAK_HEAP_TOLERANCE 4096 // B
 
-void runSoftGenerator()
+void runSoakTest()
 {
-  softTimerNow = millis();
+  const unsigned int corpusSize = sizeof(parserCorpus) / sizeof(parserCorpus[0]);
+  uint32_t startHeap = 0;
+  uint32_t lowHeap = UINT32_MAX;
+  NMEAData out;
 
-  if (softIndex < 10)
+  for (unsigned long i = 0; i < SOAK_SENTENCES; i++)
   {
+    for (const char *c = parserCorpus[i % corpusSize].input; *c != '\0'; c++)
+    {
+      NmeaDecoder.decode(*c);
+    }
+    while (NmeaStack.pop(out))
+      ;
 
-    NmeaParser.parseNMEASentence(NmeaStream[softIndex++]);
-
-    delay(200);
+    if (i == SOAK_WARMUP)
+      startHeap = ESP.getFreeHeap();
+    else if (i > SOAK_WARMUP && i % 1000 == 0)
+    {
+      esp_task_wdt_reset();
+      uint32_t freeHeap = ESP.getFreeHeap();
+      if (freeHeap < lowHeap)
+        lowHeap = freeHeap;
+    }
   }
-  else
-    softIndex = 0;
+  uint32_t endHeap = ESP.getFreeHeap();
+  if (endHeap + SOAK_HEAP_TOLERANCE < startHeap)
+  {
+    testFailures++;
+    Serial.printf("FAIL soak: heap %u after warm up, lowest %u, at the end %u\n", startHeap, lowHeap, endHeap);
+  }
+  Serial.printf("Soak test: %lu sentences, heap %u -> %u, lowest %u\n", (unsigned long)SOAK_SENTENCES, startHeap,
+                endHeap, lowHeap);
 }
 
-#endif
+void runParserSelfTest()
+{
+  unsigned long start = millis();
+  testFailures = 0;
+  runDifferentialTest();
+  runVariationTest();
+  runSchemaTest();
+  runPositionTest();
+  runSchedulerTest();
+  runTrendTest();
+  runListenerTest();
+  runFuzzTest();
+  runSoakTest();
+  Serial.printf("Parser self test: %u failures in %lu ms\n", testFailures, millis() - start);
+}
 
-void setup()
+#if defined(CAPTURE_ATTACHED) && defined(LOGBOOK_ATTACHED)
+/*
+  Replay the capture file on the SD card through the decoder and the parser. Like the
+  listener, the decoder resyncs after a UART error or lost bytes. A frame with a wrong
+  sync, length or CRC is skipped a byte at a time up to the next good frame. The
+  sentences coming out are printed, so a decoder issue seen on the bus can
+  be reproduced.
+*/
+void replayCapture()
 {
-  // put your setup code here, to run once:
+  uint8_t header[sizeof(CAPTURE_MAGIC) + 3];
+  uint8_t frame[CAPTURE_FRAME_SIZE];
+  unsigned long nrOfRecords = 0;
+  unsigned long nrOfSentences = 0;
+  unsigned long skipped = 0;
+  NMEAData nmea;
 
-#ifdef NEXTION_ATTACHED
-  if (nexInit())
+  File f = SD.open(CAPTURE_FILE, FILE_READ);
+  if (!f)
+    return;
+  if (f.read(header, sizeof(header)) != sizeof(header) ||
+      memcmp(header, CAPTURE_MAGIC, sizeof(CAPTURE_MAGIC) - 1) != 0)
   {
-    dbSerial.println("Initialisation succesful....");
+    f.close();
+    return;
   }
-  else
+  size_t offset = sizeof(header);
+  while (f.seek(offset) && f.read(frame, CAPTURE_FRAME_HEADER) == CAPTURE_FRAME_HEADER)
   {
-    dbSerial.println("Initialisation failed...");
-    dbSerial.println("Resetting Nextion...");
-    sendCommand("rest");
-    delay(3000);
+    size_t n = frame[2] | frame[3] << 8;
+    size_t len = CAPTURE_FRAME_HEADER + n * CAPTURE_RECORD_SIZE + 2;
+    if (frame[0] != CAPTURE_SYNC_1 || frame[1] != CAPTURE_SYNC_2 || n == 0 || n > CAPTURE_FRAME_RECORDS ||
+        f.read(&frame[CAPTURE_FRAME_HEADER], len - CAPTURE_FRAME_HEADER) != len - CAPTURE_FRAME_HEADER ||
+        captureCrc(&frame[2], len - 4) != (frame[len - 2] | frame[len - 1] << 8))
+    {
+      offset++;
+      skipped++;
+      continue;
+    }
+    offset += len;
+    for (size_t i = 0; i < n; i++)
+    {
+      const uint8_t *record = &frame[CAPTURE_FRAME_HEADER + i * CAPTURE_RECORD_SIZE];
+      if (record[5] & LISTENER_RESYNC)
+      {
+        NmeaDecoder.resync();
+      }
+      if (!(record[5] & LISTENER_NO_DATA))
+        NmeaDecoder.decode(record[4]);
+      while (NmeaStack.pop(nmea))
+      {
+        Serial.print(nmea.sentence.c_str());
+        nrOfSentences++;
+      }
+      if (++nrOfRecords % 1000 == 0)
+        esp_task_wdt_reset();
+    }
   }
+  f.close();
+  Serial.printf("Capture replay: %lu records, %lu sentences, %lu bytes skipped\n", nrOfRecords, nrOfSentences,
+                skipped);
+}
+#endif
+
+#endif
 
-  delay(150);
-  dbSerial.print(" Writing version to splash: ");
-  versionTxt.setText(PROGRAM_VERSION);
-  delay(5000);
-  dbSerial.print("Switcing to page 1: ");
-  sendCommand("page 1");
-  recvRetCommandFinished(NEXTION_RCV_DELAY);
+void setup()
+{
+  // put your setup code here, to run once:
+  //*** the NMEA pipeline comes first, so after a brown-out the autopilot
+  //*** and plotter get their data again within milliseconds
+  Serial.begin(SAMPLERATE); // console and debug info
+  esp_task_wdt_init(WDT_TIMEOUT, true);
+  esp_task_wdt_add(NULL); // the loop task
+  loadConfig();
+  initializeListener();
+  initializeTalker();
+#ifdef N2K_ATTACHED
+  NmeaN2K.begin();
+#endif
+  pipelineReadyTime = millis();
+#ifdef LOGBOOK_ATTACHED
+  if (Trip.begin())
+    xTaskCreatePinnedToCore(logbookTask, "logbook", LOGBOOK_TASK_STACK, NULL, 1, NULL, 0);
+#endif
 
+#ifdef NEXTION_ATTACHED
   // restet the HMI to default values
   memcpy(nb_AWA, "---", 4);
   memcpy(nb_COG, "---.-", 6);
@@ -1094,18 +5004,33 @@ void setup()
   memcpy(nb_HDG, "--.-", 5);
   memcpy(nb_STW, "--.-", 5);
   memcpy(nb_TWS, "--.-", 5);
-  displayData();
+
+  //*** the display and its splash screen are initialized by the display task
+  nextionEvents = xQueueCreate(NEXTION_EVENT_QUEUE, sizeof(NextionEvent));
+  xTaskCreatePinnedToCore(displayTask, "display", DISPLAY_TASK_STACK, NULL, 1, &displayTaskHandle, 0);
+#endif
+#ifdef CAPTURE_ATTACHED
+  xTaskCreatePinnedToCore(captureTask, "capture", CAPTURE_TASK_STACK, NULL, 1, NULL, 0);
 #endif
 
-  initializeListener();
-  initializeTalker();
+#ifdef WIFI_ATTACHED
+  NmeaNet.begin();
+#endif
+  Power.begin();
+  Serial.printf("NMEA pipeline ready after %lu ms\n", pipelineReadyTime);
 
-  nmeaSerialOut.begin(38400, SWSERIAL_8N1, 22, TALKER_PORT, true);
+#ifdef TEST
+  runParserSelfTest();
+#if defined(CAPTURE_ATTACHED) && defined(LOGBOOK_ATTACHED)
+  replayCapture();
+#endif
+#endif
 }
 
 void loop()
 {
   // put your main code here, to run repeatedly:
+  esp_task_wdt_reset();
 
 #ifdef TEST
   runSoftGenerator();
@@ -1113,11 +5038,32 @@ void loop()
 
   startListening();
 
-#ifdef DISPLAY_ATTACHED
-  buttonPressed();
-#endif
+  Detector.handle();
+
+  Alarms.handle();
+
+  Variation.handle();
+
+  handleConsole();
+
+  if (mobRequested)
+    captureMOB();
 
   startTalking();
 
-  displayData();
+#ifdef WIFI_ATTACHED
+  NmeaNet.handle();
+#endif
+
+#ifdef N2K_ATTACHED
+  NmeaN2K.handle();
+#endif
+
+#ifdef LOGBOOK_ATTACHED
+  Trip.handle();
+#endif
+
+  supervisePipeline();
+
+  Power.handle();
 }
@@ -0,0 +1,111 @@
+/*
+  Project:  NMEAtor ESP32 - native tests of the listener detector
+  Purpose:  The baudrate and polarity detection on synthetic edge lists
+            - Every line of the listener corpus locks on its own baudrate and polarity,
+              the clean ones, the ones with glitches and the jittered 115200 Bd lines
+            - A glitch or jitter may not move the estimate of a bit much
+            - No lock without edges or on noise
+  Usage:    pio test -e native -f test_listener
+*/
+#include <stdio.h>
+#include <unity.h>
+#include <NMEAListenerCorpus.h>
+
+static NMEADetector detector;
+static uint32_t times[DETECT_EDGES];
+
+void setUp()
+{
+}
+
+void tearDown()
+{
+}
+
+void test_corpus()
+{
+  for (unsigned int i = 0; i < sizeof(listenerCorpus) / sizeof(listenerCorpus[0]); i++)
+  {
+    const ListenerTestCase &test = listenerCorpus[i];
+    uint8_t startLevel;
+    int n = synthesizeLine(test, times, DETECT_EDGES, startLevel);
+    DetectResult best;
+    bool locked = detector.evaluate(times, n, startLevel, best);
+    char message[80];
+    snprintf(message, sizeof(message), "corpus %u: got %lu Bd %s %u%% of %u frames", i, best.rate,
+             best.inverted ? "inverted" : "normal", best.score, best.frames);
+    TEST_ASSERT_TRUE_MESSAGE(locked, message);
+    TEST_ASSERT_EQUAL_UINT_MESSAGE(test.rate, best.rate, message);
+    TEST_ASSERT_TRUE_MESSAGE(best.inverted == test.inverted, message);
+  }
+}
+
+//*** the lock does not depend on where in the line the window starts
+void test_window_start()
+{
+  const ListenerTestCase test = {115200, false, 2, 10};
+  static uint32_t line[DETECT_EDGES];
+  uint8_t startLevel;
+  int n = synthesizeLine(test, line, DETECT_EDGES, startLevel);
+  for (int skip = 0; skip < 40; skip++)
+  {
+    DetectResult best;
+    bool locked = detector.evaluate(line + skip, n - skip, skip % 2 == 0 ? startLevel : !startLevel, best);
+    char message[32];
+    snprintf(message, sizeof(message), "skip %d", skip);
+    TEST_ASSERT_TRUE_MESSAGE(locked && best.rate == test.rate && !best.inverted, message);
+  }
+}
+
+//*** a single glitch used to be the shortest pulse and rejected the right baudrate
+void test_single_glitch()
+{
+  const ListenerTestCase test = {9600, false, 0, 0};
+  uint8_t startLevel;
+  int n = synthesizeLine(test, times, DETECT_EDGES - 2, startLevel);
+  //*** a 2 us spike in the middle of the longest pulse
+  int longest = 1;
+  for (int i = 1; i < n; i++)
+  {
+    if (times[i] - times[i - 1] > times[longest] - times[longest - 1])
+      longest = i;
+  }
+  uint32_t middle = (times[longest - 1] + times[longest]) / 2;
+  memmove(&times[longest + 2], &times[longest], (n - longest) * sizeof(times[0]));
+  times[longest] = middle;
+  times[longest + 1] = middle + 2;
+  DetectResult best;
+  TEST_ASSERT_TRUE(detector.evaluate(times, n + 2, startLevel, best));
+  TEST_ASSERT_EQUAL_UINT(9600, best.rate);
+  TEST_ASSERT_FALSE(best.inverted);
+}
+
+void test_no_lock()
+{
+  DetectResult best;
+  TEST_ASSERT_FALSE(detector.evaluate(times, 0, HIGH, best));
+  TEST_ASSERT_FALSE(detector.evaluate(times, 1, HIGH, best));
+
+  //*** random pulses of 1 to 100 us are no NMEA line
+  uint32_t random = 1;
+  uint32_t t = 1000;
+  for (int i = 0; i < DETECT_EDGES; i++)
+  {
+    random ^= random << 13;
+    random ^= random >> 17;
+    random ^= random << 5;
+    t += 1 + random % 100;
+    times[i] = t;
+  }
+  TEST_ASSERT_FALSE(detector.evaluate(times, DETECT_EDGES, HIGH, best));
+}
+
+int main()
+{
+  UNITY_BEGIN();
+  RUN_TEST(test_corpus);
+  RUN_TEST(test_window_start);
+  RUN_TEST(test_single_glitch);
+  RUN_TEST(test_no_lock);
+  return UNITY_END();
+}
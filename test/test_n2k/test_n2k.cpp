@@ -0,0 +1,354 @@
+/*
+  Project:  NMEAtor ESP32 - native tests of the NMEA2000 library
+  Purpose:  The PGN encoders and the framing of NMEAN2KCore on a host
+            - CAN ids, padding and the fast-packet split of a long PGN, reassembled
+              by a straightforward reference and compared with the encoder output
+            - A fast-packet PGN is queued whole or not at all
+            - The send intervals, the data timeout and the address claim
+            - The frames through a SocketCAN vcan0 interface, from the sentences
+              of the parser to the reassembled PGNs on the receiving socket;
+              ignored when there is no vcan0:
+                ip link add dev vcan0 type vcan && ip link set up vcan0
+  Usage:    pio test -e native -f test_n2k
+*/
+#include <net/if.h>
+#include <poll.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <linux/can.h>
+#include <linux/can/raw.h>
+#include <unity.h>
+#include <NMEADecoder.h>
+#include <NMEAN2KCore.h>
+
+#define TEST_UNIQUE 0x12345 // unique number in the NAME
+#define VCAN_INTERFACE "vcan0"
+#define VCAN_TIMEOUT 500 // ms to wait for a frame that should be there
+
+static NMEAData lastData;
+
+static void collect(NMEAData &nmea)
+{
+  lastData = nmea;
+}
+
+static char talkerId[3] = "AO";
+static char specialty[] = "";
+static float batteryOffset = 0.0;
+static NMEAParser parser(collect, NULL, talkerId, specialty, &batteryOffset);
+static NMEADecoder decoder(&parser);
+
+//*** the NMEAData of one sentence, through the decoder and the parser
+static NMEAData &parse(const char *sentence)
+{
+  for (const char *c = sentence; *c != '\0'; c++)
+    decoder.decode(*c);
+  decoder.decode('\r');
+  decoder.decode('\n');
+  return lastData;
+}
+
+static uint32_t canId(byte priority, unsigned long pgn, byte source)
+{
+  return ((uint32_t)priority << 26) | (pgn << 8) | source;
+}
+
+static unsigned long pgnOf(uint32_t id)
+{
+  return (id >> 8) & 0x3FFFF;
+}
+
+/*
+  Reference fast-packet reassembly; returns true when the PGN is complete
+*/
+struct Reassembly
+{
+  byte seq;
+  byte len;
+  byte next; // frame counter expected next
+  byte received;
+  byte data[N2K_MAX_DATA];
+};
+
+static bool reassemble(Reassembly &r, const byte *frame)
+{
+  byte counter = frame[0] & 0x1F;
+  if (counter == 0)
+  {
+    r.seq = frame[0] >> 5;
+    r.len = frame[1];
+    r.next = 1;
+    r.received = (r.len < 6) ? r.len : 6;
+    memcpy(r.data, &frame[2], r.received);
+  }
+  else
+  {
+    TEST_ASSERT_EQUAL_UINT(r.seq, frame[0] >> 5);
+    TEST_ASSERT_EQUAL_UINT(r.next, counter);
+    byte chunk = (r.len - r.received < 7) ? r.len - r.received : 7;
+    memcpy(&r.data[r.received], &frame[1], chunk);
+    r.received += chunk;
+    r.next++;
+  }
+  return r.received == r.len;
+}
+
+//*** all frames the core has queued
+static int takeFrames(NMEAN2KCore &core, N2KFrame *frames, int max)
+{
+  int n = 0;
+  const N2KFrame *frame;
+  while ((frame = core.peek()) != NULL)
+  {
+    TEST_ASSERT_TRUE(n < max);
+    frames[n++] = *frame;
+    core.pop();
+  }
+  return n;
+}
+
+void setUp()
+{
+  decoder.resync();
+}
+
+void tearDown()
+{
+}
+
+void test_address_claim()
+{
+  NMEAN2KCore core;
+  core.begin(TEST_UNIQUE);
+  N2KFrame frames[N2K_FRAME_QUEUE];
+  TEST_ASSERT_EQUAL_INT(1, takeFrames(core, frames, N2K_FRAME_QUEUE));
+  TEST_ASSERT_EQUAL_UINT32(canId(6, 60928UL | 0xFF, N2K_SOURCE_ADDRESS), frames[0].id);
+  uint64_t name = 0;
+  for (int i = 7; i >= 0; i--)
+    name = (name << 8) | frames[0].data[i];
+  TEST_ASSERT_TRUE(name == core.getName());
+  TEST_ASSERT_EQUAL_UINT32(TEST_UNIQUE, (uint32_t)(name & 0x1FFFFF));
+  TEST_ASSERT_EQUAL_UINT32(N2K_MANUFACTURER, (uint32_t)((name >> 21) & 0x7FF));
+
+  //*** an ISO request for the address claim is answered
+  N2KFrame request = {canId(6, 59904UL | 0xFF, 10), 3, {0x00, 0xEE, 0x00}};
+  core.receive(request);
+  TEST_ASSERT_EQUAL_INT(1, takeFrames(core, frames, N2K_FRAME_QUEUE));
+
+  //*** a device with a higher NAME on our address loses, one with a lower NAME wins
+  N2KFrame claim = {canId(6, 60928UL | 0xFF, N2K_SOURCE_ADDRESS), 8, {0}};
+  memset(claim.data, 0xFF, 8);
+  core.receive(claim);
+  TEST_ASSERT_EQUAL_UINT(N2K_SOURCE_ADDRESS, core.getAddress());
+  TEST_ASSERT_EQUAL_INT(1, takeFrames(core, frames, N2K_FRAME_QUEUE));
+  memset(claim.data, 0x00, 8);
+  core.receive(claim);
+  TEST_ASSERT_EQUAL_UINT(N2K_SOURCE_ADDRESS + 1, core.getAddress());
+  TEST_ASSERT_EQUAL_INT(1, takeFrames(core, frames, N2K_FRAME_QUEUE));
+  TEST_ASSERT_EQUAL_UINT32(canId(6, 60928UL | 0xFF, N2K_SOURCE_ADDRESS + 1), frames[0].id);
+}
+
+void test_single_frame()
+{
+  NMEAN2KCore core;
+  byte data[5] = {1, 2, 3, 4, 5};
+  core.sendPgn(127250, 2, data, sizeof(data));
+  N2KFrame frames[N2K_FRAME_QUEUE];
+  TEST_ASSERT_EQUAL_INT(1, takeFrames(core, frames, N2K_FRAME_QUEUE));
+  TEST_ASSERT_EQUAL_UINT32(canId(2, 127250, N2K_SOURCE_ADDRESS), frames[0].id);
+  TEST_ASSERT_EQUAL_UINT(8, frames[0].len);
+  const byte expected[8] = {1, 2, 3, 4, 5, 0xFF, 0xFF, 0xFF}; // padded
+  TEST_ASSERT_EQUAL_MEMORY(expected, frames[0].data, 8);
+}
+
+void test_fast_packet()
+{
+  NMEAN2KCore core;
+  N2KFrame frames[N2K_FRAME_QUEUE];
+  byte data[N2K_MAX_DATA];
+  for (int i = 0; i < N2K_MAX_DATA; i++)
+    data[i] = 0x10 + i;
+
+  //*** every length from 9 up to N2K_MAX_DATA, the sequence counter wraps after 8
+  for (byte len = 9; len <= N2K_MAX_DATA; len++)
+  {
+    core.sendPgn(128275, 6, data, len);
+    int n = takeFrames(core, frames, N2K_FRAME_QUEUE);
+    TEST_ASSERT_EQUAL_INT(1 + (len - 6 + 6) / 7, n);
+    Reassembly r;
+    for (int i = 0; i < n; i++)
+    {
+      TEST_ASSERT_EQUAL_UINT32(canId(6, 128275, N2K_SOURCE_ADDRESS), frames[i].id);
+      TEST_ASSERT_EQUAL_UINT(8, frames[i].len);
+      TEST_ASSERT_EQUAL_INT(i == n - 1, reassemble(r, frames[i].data));
+    }
+    TEST_ASSERT_EQUAL_UINT((len - 9) % 8, r.seq);
+    TEST_ASSERT_EQUAL_UINT(len, r.len);
+    TEST_ASSERT_EQUAL_MEMORY(data, r.data, len);
+    //*** the rest of the last frame is padding
+    byte used = (len - 6) % 7 == 0 ? 7 : (len - 6) % 7;
+    for (int i = 1 + used; i < 8; i++)
+      TEST_ASSERT_EQUAL_HEX8(0xFF, frames[n - 1].data[i]);
+  }
+}
+
+void test_queue_full()
+{
+  NMEAN2KCore core;
+  byte data[14] = {0};
+  for (int i = 0; i < N2K_FRAME_QUEUE - 2; i++)
+    core.sendPgn(127250, 2, data, 8);
+  TEST_ASSERT_EQUAL_UINT(N2K_FRAME_QUEUE - 2, core.getQueued());
+
+  //*** 3 frames do not fit in 2; none are queued, all are counted as dropped
+  core.sendPgn(128275, 6, data, sizeof(data));
+  TEST_ASSERT_EQUAL_UINT(N2K_FRAME_QUEUE - 2, core.getQueued());
+  TEST_ASSERT_EQUAL_UINT(3, core.getDropped());
+  core.sendPgn(127250, 2, data, 8);
+  core.sendPgn(127250, 2, data, 8);
+  core.sendPgn(127250, 2, data, 8);
+  TEST_ASSERT_EQUAL_UINT(N2K_FRAME_QUEUE, core.getQueued());
+  TEST_ASSERT_EQUAL_UINT(4, core.getDropped());
+}
+
+void test_schedule()
+{
+  NMEAN2KCore core;
+  N2KFrame frames[N2K_FRAME_QUEUE];
+  unsigned long now = 10000;
+
+  //*** nothing before there is data
+  core.schedule(now);
+  TEST_ASSERT_EQUAL_UINT(0, core.getQueued());
+
+  core.update(parse("$IIHDM,90.0,M"), now);
+  core.schedule(now);
+  TEST_ASSERT_EQUAL_INT(1, takeFrames(core, frames, N2K_FRAME_QUEUE));
+  TEST_ASSERT_EQUAL_UINT32(canId(2, 127250, N2K_SOURCE_ADDRESS), frames[0].id);
+  TEST_ASSERT_EQUAL_UINT(0, frames[0].data[0]); // sid
+  uint16_t heading = frames[0].data[1] | (frames[0].data[2] << 8);
+  TEST_ASSERT_UINT_WITHIN(1, 15708, heading); // 0.0001 rad
+
+  //*** again after the 100 ms interval with the next sid, not before
+  core.schedule(now + 99);
+  TEST_ASSERT_EQUAL_UINT(0, core.getQueued());
+  core.schedule(now + 100);
+  TEST_ASSERT_EQUAL_INT(1, takeFrames(core, frames, N2K_FRAME_QUEUE));
+  TEST_ASSERT_EQUAL_UINT(1, frames[0].data[0]);
+
+  //*** no longer once the value is too old
+  core.schedule(now + N2K_DATA_TIMEOUT + 1);
+  TEST_ASSERT_EQUAL_UINT(0, core.getQueued());
+}
+
+void test_vcan()
+{
+  int tx = socket(PF_CAN, SOCK_RAW, CAN_RAW);
+  int rx = socket(PF_CAN, SOCK_RAW, CAN_RAW);
+  struct ifreq ifr;
+  memset(&ifr, 0, sizeof(ifr));
+  strncpy(ifr.ifr_name, VCAN_INTERFACE, IFNAMSIZ - 1);
+  if (tx < 0 || rx < 0 || ioctl(tx, SIOCGIFINDEX, &ifr) < 0)
+  {
+    if (tx >= 0)
+      close(tx);
+    if (rx >= 0)
+      close(rx);
+    TEST_IGNORE_MESSAGE("no " VCAN_INTERFACE " interface");
+  }
+  struct sockaddr_can address;
+  memset(&address, 0, sizeof(address));
+  address.can_family = AF_CAN;
+  address.can_ifindex = ifr.ifr_ifindex;
+  TEST_ASSERT_EQUAL_INT(0, bind(tx, (struct sockaddr *)&address, sizeof(address)));
+  TEST_ASSERT_EQUAL_INT(0, bind(rx, (struct sockaddr *)&address, sizeof(address)));
+
+  //*** the sentences of the parser through the core onto the bus
+  const char *sentences[] = {"$IIVLW,1234.5,N,12.3,N", "$IIMTW,12.5,C", "$IIDPT,4.4,0.5"};
+  N2KValues values;
+  NMEAN2KCore core;
+  core.begin(TEST_UNIQUE);
+  for (unsigned int i = 0; i < sizeof(sentences) / sizeof(sentences[0]); i++)
+  {
+    NMEAData &nmea = parse(sentences[i]);
+    core.update(nmea, 1000);
+    for (unsigned int s = 0; s < sizeof(n2kSentences) / sizeof(n2kSentences[0]); s++)
+    {
+      if (n2kSentences[s].type == nmea.type)
+        n2kSentences[s].handler(values, nmea);
+    }
+  }
+  core.schedule(1000);
+  int sent = 0;
+  const N2KFrame *frame;
+  while ((frame = core.peek()) != NULL)
+  {
+    struct can_frame out;
+    memset(&out, 0, sizeof(out));
+    out.can_id = frame->id | CAN_EFF_FLAG;
+    out.can_dlc = frame->len;
+    memcpy(out.data, frame->data, frame->len);
+    TEST_ASSERT_EQUAL_INT(sizeof(out), write(tx, &out, sizeof(out)));
+    core.pop();
+    sent++;
+  }
+
+  //*** the PGNs reassembled from the bus equal the encoder output
+  const unsigned long expectedPgns[] = {60928, 128267, 128275, 130310};
+  bool seen[4] = {false};
+  Reassembly r;
+  for (int received = 0; received < sent; received++)
+  {
+    struct pollfd p = {rx, POLLIN, 0};
+    TEST_ASSERT_TRUE_MESSAGE(poll(&p, 1, VCAN_TIMEOUT) > 0, "frame missing on " VCAN_INTERFACE);
+    struct can_frame in;
+    TEST_ASSERT_EQUAL_INT(sizeof(in), read(rx, &in, sizeof(in)));
+    TEST_ASSERT_TRUE(in.can_id & CAN_EFF_FLAG);
+    uint32_t id = in.can_id & CAN_EFF_MASK;
+    TEST_ASSERT_EQUAL_UINT(N2K_SOURCE_ADDRESS, id & 0xFF);
+    unsigned long pgn = pgnOf(id);
+    if (pgn == (60928UL | 0xFF))
+    {
+      seen[0] = true;
+      continue;
+    }
+    const byte *data = in.data;
+    byte len = in.can_dlc;
+    if (pgn == 128275)
+    {
+      if (!reassemble(r, in.data))
+        continue;
+      data = r.data;
+      len = r.len;
+    }
+    for (unsigned int i = 0; i < N2K_PGNS; i++)
+    {
+      if (n2kPgns[i].pgn != pgn)
+        continue;
+      byte expected[N2K_MAX_DATA];
+      TEST_ASSERT_EQUAL_UINT(n2kPgns[i].encoder(values, 0, expected), len);
+      TEST_ASSERT_EQUAL_MEMORY(expected, data, len);
+      TEST_ASSERT_EQUAL_UINT(n2kPgns[i].priority, id >> 26);
+    }
+    for (int i = 1; i < 4; i++)
+      seen[i] = seen[i] || pgn == expectedPgns[i];
+  }
+  for (int i = 0; i < 4; i++)
+    TEST_ASSERT_TRUE_MESSAGE(seen[i], "PGN missing");
+  TEST_ASSERT_UINT_WITHIN(1, 2286294, (uint32_t)values.log); // 1234.5 nm in m
+  close(tx);
+  close(rx);
+}
+
+int main()
+{
+  UNITY_BEGIN();
+  RUN_TEST(test_address_claim);
+  RUN_TEST(test_single_frame);
+  RUN_TEST(test_fast_packet);
+  RUN_TEST(test_queue_full);
+  RUN_TEST(test_schedule);
+  RUN_TEST(test_vcan);
+  return UNITY_END();
+}
@@ -0,0 +1,263 @@
+/*
+  Project:  NMEAtor ESP32 - native loopback tests of the network talker core
+  Purpose:  The ring buffer and NMEANetCore on the host sockets over 127.0.0.1
+            - TCP clients get every sentence in order, UDP gets them in batches
+            - A client that stops reading is evicted while the others keep up
+            - Disconnected clients free their slot, extra clients are refused
+  Usage:    pio test -e native -f test_net
+*/
+#include <poll.h>
+#include <stdio.h>
+#include <string>
+#include <unity.h>
+#include <NMEANetCore.h>
+
+#define TEST_PORT_BASE 20110 // a free port near NMEA_NET_PORT, per process
+#define RECEIVE_TIMEOUT 500  // ms to wait for data that should be there
+
+static NMEANetCore net;
+static uint16_t port;
+static unsigned long now = 0; // ms, goes on over the tests like millis()
+
+void setUp()
+{
+  port = TEST_PORT_BASE + getpid() % 1000;
+  TEST_ASSERT_TRUE(net.begin(port, inet_addr("127.0.0.1")));
+}
+
+void tearDown()
+{
+  net.end();
+}
+
+static int connectClient()
+{
+  struct sockaddr_in server;
+  memset(&server, 0, sizeof(server));
+  server.sin_family = AF_INET;
+  server.sin_port = htons(port);
+  server.sin_addr.s_addr = inet_addr("127.0.0.1");
+  int fd = socket(AF_INET, SOCK_STREAM, 0);
+  TEST_ASSERT_TRUE(fd >= 0);
+  TEST_ASSERT_EQUAL_INT(0, connect(fd, (struct sockaddr *)&server, sizeof(server)));
+  return fd;
+}
+
+static int udpReceiver()
+{
+  struct sockaddr_in local;
+  memset(&local, 0, sizeof(local));
+  local.sin_family = AF_INET;
+  local.sin_port = htons(port);
+  local.sin_addr.s_addr = inet_addr("127.0.0.1");
+  int fd = socket(AF_INET, SOCK_DGRAM, 0);
+  TEST_ASSERT_TRUE(fd >= 0);
+  TEST_ASSERT_EQUAL_INT(0, bind(fd, (struct sockaddr *)&local, sizeof(local)));
+  return fd;
+}
+
+//*** what is there within timeout ms, a closed connection ends it early
+static std::string receive(int fd, int timeout = RECEIVE_TIMEOUT)
+{
+  std::string data;
+  struct pollfd p = {fd, POLLIN, 0};
+  char block[2048];
+  while (poll(&p, 1, timeout) > 0)
+  {
+    ssize_t len = recv(fd, block, sizeof(block), MSG_DONTWAIT);
+    if (len <= 0)
+      break;
+    data.append(block, len);
+    if (timeout > 20)
+      timeout = 20; // the rest comes right after
+  }
+  return data;
+}
+
+static bool isClosed(int fd)
+{
+  struct pollfd p = {fd, POLLIN, 0};
+  char c;
+  return poll(&p, 1, RECEIVE_TIMEOUT) > 0 && recv(fd, &c, 1, MSG_DONTWAIT) <= 0;
+}
+
+static std::string sentence(int n)
+{
+  char text[32];
+  snprintf(text, sizeof(text), "$IIMTW,%05d,C\r\n", n);
+  return text;
+}
+
+void test_ring()
+{
+  NMEARing ring;
+  const char *data;
+  char block[NET_CLIENT_BUFFER];
+  memset(block, 'x', sizeof(block));
+
+  TEST_ASSERT_TRUE(ring.put(block, NET_CLIENT_BUFFER - 10));
+  TEST_ASSERT_FALSE(ring.put("0123456789A", 11)); // a sentence is never split
+  TEST_ASSERT_EQUAL_UINT(NET_CLIENT_BUFFER - 10, ring.getCount());
+  ring.consume(NET_CLIENT_BUFFER - 20);
+  TEST_ASSERT_TRUE(ring.put("0123456789ABCDEF", 16)); // wraps around the end
+  TEST_ASSERT_EQUAL_UINT(10 + 10, ring.peek(&data)); // contiguous up to the end
+  TEST_ASSERT_EQUAL_MEMORY("xxxxxxxxxx0123456789", data, 20);
+  ring.consume(20);
+  TEST_ASSERT_EQUAL_UINT(6, ring.peek(&data));
+  TEST_ASSERT_EQUAL_MEMORY("ABCDEF", data, 6);
+  ring.consume(6);
+  TEST_ASSERT_EQUAL_UINT(0, ring.peek(&data));
+}
+
+void test_tcp_client()
+{
+  int fd = connectClient();
+  net.handle(now);
+  TEST_ASSERT_EQUAL_UINT(1, net.getClients());
+
+  std::string expected;
+  for (int n = 0; n < 5; n++)
+  {
+    expected += sentence(n);
+    net.queue(sentence(n).c_str(), sentence(n).size());
+  }
+  net.handle(now += NET_FLUSH_DELAY);
+  std::string received = receive(fd);
+  TEST_ASSERT_EQUAL_STRING(expected.c_str(), received.c_str());
+  close(fd);
+}
+
+void test_udp_batch()
+{
+  int fd = udpReceiver();
+  net.handle(now += NET_FLUSH_DELAY); // a batch was just sent
+  std::string expected;
+  for (int n = 0; n < 3; n++)
+  {
+    expected += sentence(n);
+    net.queue(sentence(n).c_str(), sentence(n).size());
+  }
+  //*** nothing before the flush delay, all in one packet after it
+  net.handle(now += 1);
+  std::string early = receive(fd, 50);
+  TEST_ASSERT_EQUAL_STRING("", early.c_str());
+  net.handle(now += NET_FLUSH_DELAY);
+  char packet[NET_BATCH_SIZE + 1];
+  ssize_t len = recv(fd, packet, sizeof(packet), 0);
+  TEST_ASSERT_EQUAL_INT(expected.size(), len);
+  TEST_ASSERT_EQUAL_MEMORY(expected.data(), packet, len);
+
+  //*** a full batch goes out without waiting and a packet never exceeds NET_BATCH_SIZE
+  size_t queued = 0;
+  for (int n = 0; queued <= NET_BATCH_SIZE; n++)
+  {
+    net.queue(sentence(n).c_str(), sentence(n).size());
+    queued += sentence(n).size();
+  }
+  len = recv(fd, packet, sizeof(packet), MSG_DONTWAIT);
+  TEST_ASSERT_TRUE(len > 0 && len <= NET_BATCH_SIZE);
+  close(fd);
+}
+
+void test_overflow_evicted()
+{
+  unsigned long evicted = net.getEvicted();
+  int fd = connectClient();
+  net.handle(now);
+  //*** more than the ring holds without a chance to send
+  for (int n = 0; n * sentence(n).size() <= NET_CLIENT_BUFFER; n++)
+    net.queue(sentence(n).c_str(), sentence(n).size());
+  TEST_ASSERT_EQUAL_UINT(evicted + 1, net.getEvicted());
+  TEST_ASSERT_EQUAL_UINT(0, net.getClients());
+  TEST_ASSERT_TRUE(isClosed(fd));
+  close(fd);
+}
+
+void test_stalled_client_evicted()
+{
+  unsigned long evicted = net.getEvicted();
+  int fast = connectClient();
+  net.handle(now);
+  int slow = socket(AF_INET, SOCK_STREAM, 0);
+  int size = 4096; // a small window fills quickly
+  setsockopt(slow, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+  struct sockaddr_in server;
+  memset(&server, 0, sizeof(server));
+  server.sin_family = AF_INET;
+  server.sin_port = htons(port);
+  server.sin_addr.s_addr = inet_addr("127.0.0.1");
+  TEST_ASSERT_EQUAL_INT(0, connect(slow, (struct sockaddr *)&server, sizeof(server)));
+  net.handle(now);
+  TEST_ASSERT_EQUAL_UINT(2, net.getClients());
+
+  //*** the slow client never reads; once the socket is full it stalls and is
+  //*** evicted, the fast client gets every sentence in order
+  std::string expected;
+  std::string received;
+  int n = 0;
+  while (net.getEvicted() == evicted && n < 10000000)
+  {
+    //*** a batch per handle() call, as much as a client may get at once
+    for (size_t queued = 0; queued + sentence(n).size() <= NET_BATCH_SIZE; n++)
+    {
+      expected += sentence(n);
+      net.queue(sentence(n).c_str(), sentence(n).size());
+      queued += sentence(n).size();
+    }
+    net.handle(now += NET_EVICT_TIMEOUT / 4);
+    received += receive(fast, 0);
+  }
+  TEST_ASSERT_EQUAL_UINT(evicted + 1, net.getEvicted());
+  TEST_ASSERT_EQUAL_UINT(1, net.getClients());
+  for (int more = 0; more < 10; more++, n++)
+  {
+    expected += sentence(n);
+    net.queue(sentence(n).c_str(), sentence(n).size());
+    net.handle(now += NET_FLUSH_DELAY);
+  }
+  received += receive(fast);
+  TEST_ASSERT_EQUAL_UINT(expected.size(), received.size());
+  TEST_ASSERT_TRUE(expected == received);
+  close(fast);
+  close(slow);
+}
+
+void test_disconnect()
+{
+  unsigned long evicted = net.getEvicted();
+  int fd = connectClient();
+  net.handle(now);
+  TEST_ASSERT_EQUAL_UINT(1, net.getClients());
+  close(fd);
+  net.queue(sentence(0).c_str(), sentence(0).size());
+  net.handle(now += NET_FLUSH_DELAY);
+  TEST_ASSERT_EQUAL_UINT(0, net.getClients());
+  TEST_ASSERT_EQUAL_UINT(evicted, net.getEvicted());
+}
+
+void test_max_clients()
+{
+  int fds[MAX_NET_CLIENTS + 1];
+  for (int i = 0; i <= MAX_NET_CLIENTS; i++)
+  {
+    fds[i] = connectClient();
+    net.handle(now);
+  }
+  TEST_ASSERT_EQUAL_UINT(MAX_NET_CLIENTS, net.getClients());
+  TEST_ASSERT_TRUE(isClosed(fds[MAX_NET_CLIENTS]));
+  for (int i = 0; i <= MAX_NET_CLIENTS; i++)
+    close(fds[i]);
+}
+
+int main()
+{
+  UNITY_BEGIN();
+  RUN_TEST(test_ring);
+  RUN_TEST(test_tcp_client);
+  RUN_TEST(test_udp_batch);
+  RUN_TEST(test_overflow_evicted);
+  RUN_TEST(test_stalled_client_evicted);
+  RUN_TEST(test_disconnect);
+  RUN_TEST(test_max_clients);
+  return UNITY_END();
+}
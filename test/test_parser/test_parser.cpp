@@ -0,0 +1,252 @@
+/*
+  Project:  NMEAtor ESP32 - native tests of the NMEA0183 library
+  Purpose:  The decoder, the parser and the formatter on a host, with the address
+            and undefined behaviour sanitizers of the native environment
+            - Differential check; every corpus line is fed byte by byte through the
+              decoder and the parser, and the output is compared with a
+              straightforward reference
+            - Fuzzing; random and mutated corpus lines must never break the invariants
+              of the input buffer, the fields array and the sentence length
+            - The talker ID, the specialty tags and the filter given to the parser
+  Usage:    pio test -e native -f test_parser
+*/
+#include <string>
+#include <unity.h>
+#include <NMEADecoder.h>
+#include <NMEACorpus.h>
+
+#define FUZZ_ITERATIONS 200000
+#define FUZZ_MAX_LENGTH 120
+
+static std::string output;           // last sentence handled
+static NMEAData lastData;
+static unsigned int nrOfSentences = 0;
+static bool invariantsOk = true;
+static bool dropAll = false;
+
+static void collect(NMEAData &nmea)
+{
+  invariantsOk = invariantsOk && nmea.nrOfFields <= MAX_NMEA_FIELDS &&
+                 nmea.sentence.length() <= NMEA_BUFFER_SIZE + 5;
+  output = nmea.sentence.c_str();
+  lastData = nmea;
+  nrOfSentences++;
+}
+
+static bool accept(NMEAData &)
+{
+  return !dropAll;
+}
+
+static char talkerId[3] = "AO";
+static char specialty[] = "$IIDBK$PSTOB";
+static float batteryOffset = 0.2;
+static NMEAParser parser(collect, accept, talkerId, specialty, &batteryOffset);
+static NMEADecoder decoder(&parser);
+
+void setUp()
+{
+  output.clear();
+  nrOfSentences = 0;
+  invariantsOk = true;
+  dropAll = false;
+  decoder.resync();
+}
+
+void tearDown()
+{
+}
+
+/*
+  Reference for the checksum; XOR of all chars between the start delimiter and the end
+*/
+static std::string referenceChecksum(const std::string &str)
+{
+  unsigned char cs = 0;
+  for (size_t n = 1; n < str.size(); n++)
+    cs ^= str[n];
+  char hex[4];
+  snprintf(hex, sizeof(hex), "*%02x", cs);
+  return hex;
+}
+
+/*
+  Reference output for a pass through sentence; the sentence as received with a
+  checksum added if there was none, and terminated
+*/
+static std::string referenceOutput(std::string sentence)
+{
+  size_t star = sentence.find('*');
+  if (star == std::string::npos || star < 1)
+    sentence += referenceChecksum(sentence);
+  return sentence + NMEA_TERMINATOR;
+}
+
+static void decodeInput(const char *input)
+{
+  for (int i = 0; input[i] != '\0'; i++)
+    decoder.decode(input[i]);
+}
+
+void test_corpus()
+{
+  for (unsigned int i = 0; i < sizeof(parserCorpus) / sizeof(parserCorpus[0]); i++)
+  {
+    const ParserTestCase &test = parserCorpus[i];
+    std::string expected;
+    if (test.expected == NULL)
+    {
+      //*** the sentence runs from the last start delimiter up to the terminator
+      std::string input = test.input;
+      size_t start = input.find_last_of("$!~");
+      expected = referenceOutput(input.substr(start, input.find('\r', start) - start));
+    }
+    else if (test.expected[0] != '\0')
+      expected = test.expected + referenceChecksum(test.expected) + NMEA_TERMINATOR;
+
+    setUp();
+    decodeInput(test.input);
+    char message[32];
+    snprintf(message, sizeof(message), "corpus %u", i);
+    TEST_ASSERT_EQUAL_STRING_MESSAGE(expected.c_str(), output.c_str(), message);
+    TEST_ASSERT_TRUE_MESSAGE(nrOfSentences <= 1, message);
+  }
+}
+
+//*** after a restart or a dropped line no byte of the previous line may show up
+void test_stale_bytes()
+{
+  unsigned long oversizeLines = decoder.getOversizeLines();
+  decodeInput("$IIXXX,0123456789012345678901234567890123456789012345678901234567890123456789012345678901234567890123456789");
+  decodeInput("$IIMTW,12.2,C\r\n");
+  TEST_ASSERT_EQUAL_UINT(1, nrOfSentences);
+  TEST_ASSERT_EQUAL_UINT(oversizeLines + 1, decoder.getOversizeLines());
+  TEST_ASSERT_EQUAL_STRING("$IIMTW,12.2,C*12\r\n", output.c_str());
+  TEST_ASSERT_EQUAL_UINT(3, lastData.nrOfFields);
+
+  setUp();
+  decodeInput("$IIMTW,12.2,C$IIHDM,1,M\r\n");
+  TEST_ASSERT_EQUAL_STRING("$IIHDM,1,M*3d\r\n", output.c_str());
+  TEST_ASSERT_EQUAL_UINT(3, lastData.nrOfFields);
+  TEST_ASSERT_EQUAL_STRING("1", nmeaText<HDM_HEADING>(lastData).c_str());
+}
+
+void test_resync()
+{
+  decodeInput("$IIMTW,12.");
+  decoder.resync();
+  decodeInput("2,C\r\n");
+  TEST_ASSERT_EQUAL_UINT(0, nrOfSentences);
+  TEST_ASSERT_TRUE(decoder.isConsistent());
+}
+
+void test_settings()
+{
+  decodeInput("$IIDBK,A,0014.4,f,,,,\r\n");
+  TEST_ASSERT_EQUAL_STRING("$AODPT", lastData.fields[0].c_str());
+  TEST_ASSERT_EQUAL_INT(NMEA_DPT, lastData.type);
+
+  //*** the settings may change while running
+  strcpy(talkerId, "EP");
+  batteryOffset = 0.0;
+  decodeInput("$PSTOB,13.0,v\r\n");
+  TEST_ASSERT_EQUAL_STRING("$EPXDR", lastData.fields[0].c_str());
+  TEST_ASSERT_EQUAL_STRING((referenceOutput("$EPXDR,U,13.0,V,BATT")).c_str(), output.c_str());
+  strcpy(talkerId, "AO");
+  batteryOffset = 0.2;
+
+  //*** a tag which is not a specialty passes unchanged
+  setUp();
+  specialty[0] = '\0';
+  decodeInput("$IIDBK,A,0014.4,f,,,,\r\n");
+  strcpy(specialty, "$IIDBK$PSTOB");
+  TEST_ASSERT_EQUAL_STRING("$IIDBK", lastData.fields[0].c_str());
+}
+
+void test_filter()
+{
+  unsigned long counter = parser.getCounter();
+  dropAll = true;
+  decodeInput("$IIMTW,12.2,C\r\n");
+  TEST_ASSERT_EQUAL_UINT(0, nrOfSentences);
+  TEST_ASSERT_EQUAL_UINT(counter, parser.getCounter());
+  TEST_ASSERT_TRUE(decoder.getSentences() > 0);
+}
+
+void test_formatter()
+{
+  char sentence[NMEA_BUFFER_SIZE + 1];
+  TEST_ASSERT_EQUAL_UINT(17, formatDPT(sentence, sizeof(sentence), "AO", "4.4", 0.0));
+  TEST_ASSERT_EQUAL_STRING("$AODPT,4.4,0.0*4e", sentence);
+  formatHDG(sentence, sizeof(sentence), "EP", 123.4, -1.57);
+  TEST_ASSERT_EQUAL_STRING((std::string("$EPHDG,123.4,,,1.57,W") + referenceChecksum("$EPHDG,123.4,,,1.57,W")).c_str(), sentence);
+  //*** on overflow the buffer holds an empty string
+  char small[12];
+  TEST_ASSERT_EQUAL_UINT(0, formatDPT(small, sizeof(small), "AO", "4.4", 0.0));
+  TEST_ASSERT_EQUAL_STRING("", small);
+}
+
+void test_fuzz()
+{
+  //*** bytes with a meaning for the decoder get a higher chance
+  const char special[] = "$!~*,\r\n";
+  const unsigned int corpusSize = sizeof(parserCorpus) / sizeof(parserCorpus[0]);
+
+  srand(FUZZ_ITERATIONS);
+  for (unsigned long i = 0; i < FUZZ_ITERATIONS; i++)
+  {
+    if (i % 2 == 0)
+    {
+      //*** random bytes
+      int length = 1 + rand() % FUZZ_MAX_LENGTH;
+      for (int j = 0; j < length; j++)
+        decoder.decode(rand() % 4 == 0 ? special[rand() % (sizeof(special) - 1)] : (char)(1 + rand() % 255));
+    }
+    else
+    {
+      //*** a corpus line with some bytes replaced, inserted or removed
+      const char *line = parserCorpus[rand() % corpusSize].input;
+      int mutations = 1 + rand() % 3;
+      for (int j = 0; line[j] != '\0'; j++)
+      {
+        if (mutations > 0 && rand() % 20 == 0)
+        {
+          mutations--;
+          switch (rand() % 3)
+          {
+          case 0:
+            decoder.decode(special[rand() % (sizeof(special) - 1)]);
+            break;
+          case 1:
+            decoder.decode(line[j]);
+            decoder.decode(line[j]);
+            break;
+          default:
+            break; // byte removed
+          }
+        }
+        else
+          decoder.decode(line[j]);
+      }
+    }
+    if (!decoder.isConsistent() || !invariantsOk)
+    {
+      char message[40];
+      snprintf(message, sizeof(message), "fuzz iteration %lu", i);
+      TEST_FAIL_MESSAGE(message);
+    }
+  }
+}
+
+int main()
+{
+  UNITY_BEGIN();
+  RUN_TEST(test_corpus);
+  RUN_TEST(test_stale_bytes);
+  RUN_TEST(test_resync);
+  RUN_TEST(test_settings);
+  RUN_TEST(test_filter);
+  RUN_TEST(test_formatter);
+  RUN_TEST(test_fuzz);
+  return UNITY_END();
+}
@@ -0,0 +1,164 @@
+/*
+  Project:  NMEAtor ESP32 - native soak test of the NMEA0183 library
+  Purpose:  Millions of sentences through the decoder and the parser on a host
+            - The STATIC_ARENA build may not allocate at all; every malloc is counted
+              with the hooks of the address sanitizer
+            - The heap in use may not move between the end of the warm up and the end
+            - Every round of the corpus gives the same bytes and the same nr of sentences
+            On the target the same soak runs in the TEST build, but the other tasks use
+            the heap as well, so there it has a tolerance.
+  Usage:    pio test -e native -f test_soak
+            Build with i.e. -DSOAK_SENTENCES=50000000 for a longer soak.
+*/
+#include <unity.h>
+#include <NMEADecoder.h>
+#include <NMEACorpus.h>
+
+#ifndef __has_feature
+#define __has_feature(x) 0
+#endif
+#if defined(__SANITIZE_ADDRESS__) || __has_feature(address_sanitizer)
+//*** from sanitizer/allocator_interface.h, which not every compiler ships
+extern "C" size_t __sanitizer_get_current_allocated_bytes();
+extern "C" int __sanitizer_install_malloc_and_free_hooks(void (*malloc_hook)(const volatile void *, size_t),
+                                                         void (*free_hook)(const volatile void *));
+#define SOAK_MALLOC_HOOKS 1
+#else
+#include <malloc.h>
+#endif
+
+#ifndef SOAK_SENTENCES
+#define SOAK_SENTENCES 5000000UL
+#endif
+#define SOAK_WARMUP 1000
+#define SOAK_QUEUE 4 // sentences of one corpus line waiting, like the stack
+
+static const unsigned int corpusSize = sizeof(parserCorpus) / sizeof(parserCorpus[0]);
+static NMEAData queue[SOAK_QUEUE];
+static unsigned int queued = 0;
+static unsigned long dropped = 0;
+static bool invariantsOk = true;
+static volatile unsigned long allocations = 0;
+
+#ifdef SOAK_MALLOC_HOOKS
+static void countMalloc(const volatile void *, size_t)
+{
+  allocations++;
+}
+
+static void countFree(const volatile void *)
+{
+}
+
+static size_t heapInUse()
+{
+  return __sanitizer_get_current_allocated_bytes();
+}
+#else
+static size_t heapInUse()
+{
+  return mallinfo2().uordblks;
+}
+#endif
+
+//*** the copy into a fixed slot like NMEAStack::push()
+static void push(NMEAData &nmea)
+{
+  invariantsOk = invariantsOk && nmea.nrOfFields <= MAX_NMEA_FIELDS &&
+                 nmea.sentence.length() <= NMEA_BUFFER_SIZE + 5;
+  if (queued < SOAK_QUEUE)
+    queue[queued++] = nmea;
+  else
+    dropped++;
+}
+
+static char talkerId[3] = "AO";
+static char specialty[] = "$IIDBK$PSTOB";
+static float batteryOffset = 0.2;
+static NMEAParser parser(push, NULL, talkerId, specialty, &batteryOffset);
+static NMEADecoder decoder(&parser);
+
+void setUp()
+{
+}
+
+void tearDown()
+{
+}
+
+//*** FNV-1a over the bytes of the sentences that came out
+static uint32_t hashSentences(uint32_t hash)
+{
+  for (unsigned int n = 0; n < queued; n++)
+  {
+    for (const char *c = queue[n].sentence.c_str(); *c != '\0'; c++)
+      hash = (hash ^ (uint8_t)*c) * 16777619UL;
+  }
+  queued = 0;
+  return hash;
+}
+
+void test_soak()
+{
+  uint32_t firstRound = 0;
+  uint32_t round = 2166136261UL;
+  unsigned long sentences = 0;
+  unsigned long roundSentences = 0;
+  unsigned long firstRoundSentences = 0;
+  size_t startHeap = 0;
+
+  for (unsigned long i = 0; i < SOAK_SENTENCES; i++)
+  {
+    if (i == SOAK_WARMUP)
+    {
+      startHeap = heapInUse();
+#ifdef SOAK_MALLOC_HOOKS
+      __sanitizer_install_malloc_and_free_hooks(countMalloc, countFree);
+#endif
+    }
+    for (const char *c = parserCorpus[i % corpusSize].input; *c != '\0'; c++)
+      decoder.decode(*c);
+    sentences += queued;
+    roundSentences += queued;
+    round = hashSentences(round);
+
+    if (i % corpusSize == corpusSize - 1)
+    {
+      if (i == corpusSize - 1)
+      {
+        firstRound = round;
+        firstRoundSentences = roundSentences;
+      }
+      else if (round != firstRound || roundSentences != firstRoundSentences)
+      {
+        char message[64];
+        snprintf(message, sizeof(message), "round ending at %lu differs from the first", i);
+        TEST_FAIL_MESSAGE(message);
+      }
+      round = 2166136261UL;
+      roundSentences = 0;
+    }
+    if (!invariantsOk || !decoder.isConsistent())
+    {
+      char message[40];
+      snprintf(message, sizeof(message), "invariants broken at %lu", i);
+      TEST_FAIL_MESSAGE(message);
+    }
+  }
+  unsigned long soakAllocations = allocations; // printing allocates
+  size_t endHeap = heapInUse();
+
+  printf("Soak test: %lu lines, %lu sentences, %lu allocations, heap in use %zu -> %zu\n",
+         (unsigned long)SOAK_SENTENCES, sentences, soakAllocations, startHeap, endHeap);
+  TEST_ASSERT_EQUAL_UINT(0, dropped);
+  TEST_ASSERT_EQUAL_UINT(0, soakAllocations);
+  TEST_ASSERT_EQUAL_UINT(startHeap, endHeap);
+  TEST_ASSERT_EQUAL_UINT(sentences, parser.getCounter());
+}
+
+int main()
+{
+  UNITY_BEGIN();
+  RUN_TEST(test_soak);
+  return UNITY_END();
+}
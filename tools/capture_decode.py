@@ -0,0 +1,204 @@
+#!/usr/bin/env python3
+"""
+  Project:  NMEAtor ESP32 - raw capture decoder
+  Purpose:  Decode a raw listener capture made with the console command
+            'capture serial' or 'capture sd' and show the timing on the bus:
+            - every sentence with its start time, duration and the gap to the previous one
+            - the min/avg/max time between two bytes, compared with the time of a
+              byte at the captured baudrate
+            - UART errors and bytes lost by the capture
+            With --corpus the sentences are printed as C strings for the parserCorpus
+            in lib/NMEA0183/NMEACorpus.h, with --bytes every byte is listed.
+
+  Usage:    capture_decode.py [--bytes] [--corpus] <capture file or - for stdin>
+            A Serial capture may start with console text and console text may sit
+            between the frames; everything before the NMEACAP2 header is skipped and
+            after it the decoder resyncs on the sync bytes of the next frame with a
+            good CRC.
+"""
+import argparse
+import binascii
+import struct
+import sys
+
+MAGIC = b"NMEACAP2"
+SYNC = b"\xa5\xc3"
+FRAME_HEADER = struct.Struct("<2sH")  # sync bytes, nr of records
+FRAME_RECORDS = 64  # CAPTURE_FRAME_RECORDS
+RECORD = struct.Struct("<IBB")  # time in us, data byte, flags
+CRC = struct.Struct("<H")  # CRC-16/CCITT over the nr of records and the records
+
+FRAME_ERROR = 0x01
+PARITY_ERROR = 0x02
+OVERRUN = 0x04
+BREAK = 0x08
+GAP = 0x10
+NO_DATA = 0x20  # a UART error without a data byte
+FLAG_NAMES = ((FRAME_ERROR, "FRAME"), (PARITY_ERROR, "PARITY"),
+              (OVERRUN, "OVERRUN"), (BREAK, "BREAK"), (GAP, "GAP"))
+
+
+def flag_text(flags):
+    return "|".join(name for bit, name in FLAG_NAMES if flags & bit)
+
+
+def printable(data):
+    return "".join(chr(b) if 32 <= b < 127 else "\\x%02x" % b for b in data)
+
+
+def c_string(data):
+    text = ""
+    for b in data:
+        if b == 13:
+            text += "\\r"
+        elif b == 10:
+            text += "\\n"
+        elif b in (34, 92):
+            text += "\\" + chr(b)
+        elif 32 <= b < 127:
+            text += chr(b)
+        else:
+            text += "\\x%02x\"\"" % b  # end the literal so the next char is no hex digit
+    return text
+
+
+def read_frames(raw, offset):
+    """Yield the records of every frame with a good CRC, and the nr of bytes skipped"""
+    skipped = 0
+    while True:
+        start = raw.find(SYNC, offset)
+        if start < 0 or start + FRAME_HEADER.size > len(raw):
+            return
+        skipped += start - offset
+        count = FRAME_HEADER.unpack_from(raw, start)[1]
+        end = start + FRAME_HEADER.size + count * RECORD.size
+        if (count == 0 or count > FRAME_RECORDS or end + CRC.size > len(raw) or
+                binascii.crc_hqx(raw[start + len(SYNC):end], 0xFFFF) != CRC.unpack_from(raw, end)[0]):
+            offset = start + 1  # a false sync in text or records, or a damaged frame
+            skipped += 1
+            continue
+        yield [RECORD.unpack_from(raw, start + FRAME_HEADER.size + i * RECORD.size) for i in range(count)], skipped
+        skipped = 0
+        offset = end + CRC.size
+
+
+def read_capture(raw):
+    """Return the baudrate, the list of (time us, byte, flags) records and the nr of bytes skipped"""
+    start = raw.find(MAGIC)
+    if start < 0:
+        sys.exit("No capture header found")
+    offset = start + len(MAGIC)
+    baudrate = struct.unpack_from("<I", raw, offset)[0]
+    offset += 4
+    records = []
+    skipped = 0
+    last = None
+    epoch = 0
+    for frame, skip in read_frames(raw, offset):
+        skipped += skip
+        for time, data, flags in frame:
+            # micros() wraps after ~71 minutes
+            if last is not None and time + epoch < last:
+                epoch += 1 << 32
+            last = time + epoch
+            records.append((last, data, flags))
+    return baudrate, records, skipped
+
+
+def split_sentences(records):
+    """Group the records like decodeNMEAInput() does; from a start delimiter up to a terminator"""
+    sentences = []
+    current = None
+    for record in records:
+        data = record[1]
+        if record[2] & NO_DATA:
+            if current:
+                current.append(record)  # the error belongs to the sentence being received
+            continue
+        if data in b"$!~":
+            if current:
+                sentences.append(current)  # no terminator, a new start delimiter
+            current = [record]
+        elif current is not None:
+            current.append(record)
+            if data in b"\r\n":
+                sentences.append(current)
+                current = None
+        elif data == 10 and sentences and sentences[-1][-1][1] == 13:
+            sentences[-1].append(record)  # the <LF> of a <CR><LF> pair
+    if current:
+        sentences.append(current)
+    return sentences
+
+
+def stats(values):
+    if not values:
+        return "-"
+    return "min %d / avg %d / max %d us" % (min(values), sum(values) / len(values), max(values))
+
+
+def main():
+    parser = argparse.ArgumentParser(description="Decode a raw NMEAtor listener capture")
+    parser.add_argument("file", help="capture file, or - for stdin")
+    parser.add_argument("--bytes", action="store_true", help="list every byte")
+    parser.add_argument("--corpus", action="store_true", help="print the sentences as parserCorpus entries")
+    args = parser.parse_args()
+
+    raw = sys.stdin.buffer.read() if args.file == "-" else open(args.file, "rb").read()
+    baudrate, records, skipped = read_capture(raw)
+    if not records:
+        sys.exit("Capture is empty")
+    byte_time = 10e6 / baudrate if baudrate else 0  # start, 8 data and a stop bit
+    t0 = records[0][0]
+
+    if args.bytes:
+        previous = t0
+        for time, data, flags in records:
+            if flags & NO_DATA:
+                print("%12.3f ms %+8d us  ----        %s" % ((time - t0) / 1000.0, time - previous, flag_text(flags)))
+            else:
+                print("%12.3f ms %+8d us  0x%02x %-6s %s" % ((time - t0) / 1000.0, time - previous, data,
+                                                          printable([data]), flag_text(flags)))
+            previous = time
+
+    sentences = split_sentences(records)
+    if args.corpus:
+        for sentence in sentences:
+            print('    {"%s", NULL},' % c_string([r[1] for r in sentence if not r[2] & NO_DATA]))
+        return
+
+    inter_byte = []
+    inter_sentence = []
+    previous_end = None
+    for sentence in sentences:
+        start = sentence[0][0]
+        end = sentence[-1][0]
+        data = [r for r in sentence if not r[2] & NO_DATA]
+        gaps = [b[0] - a[0] for a, b in zip(data, data[1:])]
+        inter_byte.extend(gaps)
+        gap = start - previous_end if previous_end is not None else 0
+        if previous_end is not None:
+            inter_sentence.append(gap)
+        previous_end = end
+        flags = 0
+        for record in sentence:
+            flags |= record[2]
+        print("%12.3f ms  %3d bytes in %7.1f ms  gap %8.1f ms  max byte gap %6d us  %-8s %s" % (
+            (start - t0) / 1000.0, len(data), (end - start) / 1000.0, gap / 1000.0,
+            max(gaps) if gaps else 0, flag_text(flags),
+            printable(b for _, b, f in sentence if not f & NO_DATA and b not in b"\r\n")))
+
+    errors = {name: sum(1 for r in records if r[2] & bit) for bit, name in FLAG_NAMES}
+    print()
+    print("Baudrate:        %d (%.0f us per byte)" % (baudrate, byte_time))
+    print("Bytes:           %d in %.1f s" % (sum(1 for r in records if not r[2] & NO_DATA),
+                                             (records[-1][0] - t0) / 1e6))
+    print("Skipped:         %d bytes of console text or damaged frames" % skipped)
+    print("Sentences:       %d" % len(sentences))
+    print("Inter byte:      %s" % stats(inter_byte))
+    print("Inter sentence:  %s" % stats(inter_sentence))
+    print("Errors:          %s" % ", ".join("%s %d" % item for item in errors.items()))
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,176 @@
+/*
+  Project:  NMEAtor ESP32 - fuzz target of the NMEA0183 library
+  Purpose:  Feed arbitrary bytes through the decoder and the parser on a host
+            - The invariants of the decoder buffer, the fields and the sentence
+              length are checked after every byte
+            - Differential check; every sentence coming out is compared with the
+              output of a straightforward reference of the framing rules
+            - A violation aborts, so the fuzzer keeps the input
+            The specialty conversions are off, so every sentence passes unchanged.
+
+  Usage, from the project directory:
+    libFuzzer with the address and undefined behaviour sanitizers
+      clang++ -std=gnu++17 -DSTATIC_ARENA -g -O1 -fsanitize=fuzzer,address,undefined \
+              -Ilib/NMEA0183 tools/fuzz/fuzz_nmea.cpp -o fuzz_nmea
+      ./fuzz_nmea -max_len=512 fuzz_corpus tools/fuzz/corpus
+    AFL++
+      AFL_USE_ASAN=1 AFL_USE_UBSAN=1 afl-clang-fast++ -std=gnu++17 -DSTATIC_ARENA -DFUZZ_STANDALONE \
+              -Ilib/NMEA0183 tools/fuzz/fuzz_nmea.cpp -o fuzz_nmea_afl
+      afl-fuzz -i tools/fuzz/corpus -o fuzz_findings -- ./fuzz_nmea_afl @@
+    Replay of the corpus or a crash with any compiler
+      g++ -std=gnu++17 -DSTATIC_ARENA -DFUZZ_STANDALONE -g -fsanitize=address,undefined \
+              -Ilib/NMEA0183 tools/fuzz/fuzz_nmea.cpp -o fuzz_nmea_replay
+      ./fuzz_nmea_replay tools/fuzz/corpus/corpus_*
+  The seeds in tools/fuzz/corpus are the inputs of parserCorpus in NMEACorpus.h,
+  ./fuzz_nmea_replay --seeds tools/fuzz/corpus writes them again.
+*/
+#include <stdio.h>
+#include <string>
+#include <NMEADecoder.h>
+#include <NMEACorpus.h>
+
+static std::string expected[4]; // sentences of one chunk of input from the reference
+static unsigned int nrOfExpected = 0;
+static unsigned int nrOfSentences = 0;
+
+static void check(bool ok, const char *what)
+{
+  if (!ok)
+  {
+    fprintf(stderr, "fuzz_nmea: %s\n", what);
+    abort();
+  }
+}
+
+/*
+  Reference of the sentence the parser puts out for a line as framed by the decoder
+*/
+static std::string referenceOutput(const std::string &line)
+{
+  std::string sentence = line.substr(0, strlen(line.c_str())); // the parser sees a C string
+  size_t star = sentence.find('*');
+  if (star == std::string::npos || star < 1)
+  {
+    unsigned char cs = 0;
+    for (size_t n = 1; n < sentence.size(); n++)
+      cs ^= sentence[n];
+    char hex[4];
+    snprintf(hex, sizeof(hex), "*%02x", cs);
+    sentence += hex;
+  }
+  return sentence + NMEA_TERMINATOR;
+}
+
+/*
+  Reference of the framing rules, byte by byte like the decoder
+  - a start delimiter starts a new line, also in the middle of one
+  - a <CR> or <LF> ends a line
+  - a line reaching NMEA_BUFFER_SIZE without a terminator is dropped
+*/
+static std::string referenceLine;
+static bool referenceActive = false;
+
+static void referenceDecode(char c)
+{
+  if (c == '$' || c == '!' || c == '~')
+  {
+    referenceActive = true;
+    referenceLine = c;
+  }
+  else if (c == '\r' || c == '\n')
+  {
+    if (referenceActive && nrOfExpected < sizeof(expected) / sizeof(expected[0]))
+      expected[nrOfExpected++] = referenceOutput(referenceLine);
+    referenceActive = false;
+  }
+  else if (referenceActive)
+  {
+    if (referenceLine.size() >= NMEA_BUFFER_SIZE)
+      referenceActive = false;
+    else
+      referenceLine += c;
+  }
+}
+
+static void collect(NMEAData &nmea)
+{
+  check(nmea.nrOfFields <= MAX_NMEA_FIELDS, "too many fields");
+  check(nmea.sentence.length() <= NMEA_BUFFER_SIZE + 5, "sentence too long");
+  check(nrOfSentences < nrOfExpected, "sentence the reference does not have");
+  check(expected[nrOfSentences] == nmea.sentence.c_str(), "sentence differs from the reference");
+  nrOfSentences++;
+}
+
+static float batteryOffset = 0.2;
+static NMEAParser parser(collect, NULL, "AO", "", &batteryOffset);
+static NMEADecoder decoder(&parser);
+
+extern "C" int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size)
+{
+  //*** every input starts clean, like the listener after a resync
+  decoder.resync();
+  referenceActive = false;
+  for (size_t i = 0; i < size; i++)
+  {
+    nrOfExpected = 0;
+    nrOfSentences = 0;
+    referenceDecode((char)data[i]);
+    decoder.decode((char)data[i]);
+    check(decoder.isConsistent(), "decoder buffer out of bounds");
+    check(nrOfSentences == nrOfExpected, "sentence missing");
+  }
+  return 0;
+}
+
+#ifdef FUZZ_STANDALONE
+/*
+  Run every file given once, for AFL++ and to replay a corpus or a crash
+*/
+static int runFile(const char *name)
+{
+  FILE *file = fopen(name, "rb");
+  if (file == NULL)
+  {
+    perror(name);
+    return 1;
+  }
+  std::string input;
+  char block[4096];
+  size_t length;
+  while ((length = fread(block, 1, sizeof(block), file)) > 0)
+    input.append(block, length);
+  fclose(file);
+  LLVMFuzzerTestOneInput((const uint8_t *)input.data(), input.size());
+  return 0;
+}
+
+static int writeSeeds(const char *directory)
+{
+  for (unsigned int i = 0; i < sizeof(parserCorpus) / sizeof(parserCorpus[0]); i++)
+  {
+    char name[256];
+    snprintf(name, sizeof(name), "%s/corpus_%02u", directory, i);
+    FILE *file = fopen(name, "wb");
+    if (file == NULL)
+    {
+      perror(name);
+      return 1;
+    }
+    fwrite(parserCorpus[i].input, 1, strlen(parserCorpus[i].input), file);
+    fclose(file);
+  }
+  return 0;
+}
+
+int main(int argc, char **argv)
+{
+  if (argc == 3 && strcmp(argv[1], "--seeds") == 0)
+    return writeSeeds(argv[2]);
+  int result = 0;
+  for (int i = 1; i < argc; i++)
+    result |= runFile(argv[i]);
+  if (argc == 1)
+    result = runFile("/dev/stdin");
+  return result;
+}
+#endif
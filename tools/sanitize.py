@@ -0,0 +1,8 @@
+"""
+  Project:  NMEAtor ESP32 - sanitizers of the native environment
+  Purpose:  PlatformIO passes the -fsanitize build flags to the compiler only,
+            the linker needs them too for the sanitizer runtime
+"""
+Import("env")
+
+env.Append(LINKFLAGS=["-fsanitize=address,undefined", "-fno-sanitize-recover=all"])